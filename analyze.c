@@ -0,0 +1,386 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  trace analyzer
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * read --trace file and report
+ *  - turnaround per command (last sent byte -> first answer byte)
+ *  - turnaround distribution of positive answers (ACK)
+ *  - host gaps (last answer byte -> next send) and idle gaps
+ *  - time split into link (bytes / bitrate), target and host
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "h8flash.h"
+
+#define ANALYZE_CMDS 64
+/* log2 us buckets */
+#define HIST_BUCKETS 24
+/* idle gap (ns) */
+#define IDLE_GAP 10000000
+#define IDLE_TOP 5
+
+struct series_t {
+	unsigned long long *v;
+	int n, max;
+};
+
+struct cmd_t {
+	char name[24];
+	struct series_t lat;
+	unsigned long naks;
+};
+
+struct gap_t {
+	unsigned long long t;
+	unsigned long long len;
+	char phase[24];
+};
+
+struct analyze_t {
+	const char *proto;
+	char phase[24];
+	int bitrate;
+	struct cmd_t cmd[ANALYZE_CMDS];
+	int cmds;
+	struct series_t ack;
+	struct series_t host;
+	struct gap_t idle[IDLE_TOP];
+	unsigned long idles;
+	unsigned long long idle_ns;
+	unsigned long long link_ns;
+	unsigned long long target_ns;
+	unsigned long long turn_ns;
+	unsigned long long host_ns;
+	unsigned long tx_bytes, rx_bytes;
+};
+
+static const struct {
+	unsigned char code;
+	const char *name;
+} v1_cmds[] = {
+	{0x10, "select device"}, {0x11, "clock mode"},
+	{0x20, "device query"}, {0x21, "clock query"},
+	{0x22, "multirate query"}, {0x23, "frequency query"},
+	{0x24, "boot area query"}, {0x25, "user area query"},
+	{0x27, "write size query"}, {0x3f, "bitrate"},
+	{0x40, "writemode"}, {0x42, "userboot select"},
+	{0x43, "user select"}, {0x4a, "userboot sum"},
+	{0x4b, "user sum"}, {0x4c, "userboot blank"},
+	{0x4d, "user blank"}, {0x50, "write"}, {0x52, "read"},
+}, v2_cmds[] = {
+	{0x00, "sync"}, {0x12, "erase"}, {0x13, "write"},
+	{0x15, "read"}, {0x18, "crc"}, {0x32, "frequency"},
+	{0x34, "bitrate"}, {0x36, "endian"}, {0x38, "device type"},
+	{0x3a, "signature"},
+};
+
+static int add(struct series_t *s, unsigned long long v)
+{
+	unsigned long long *p;
+
+	if (s->n >= s->max) {
+		p = realloc(s->v, (s->max * 2 + 64) * sizeof(*p));
+		if (p == NULL)
+			return -1;
+		s->v = p;
+		s->max = s->max * 2 + 64;
+	}
+	s->v[s->n++] = v;
+	return 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* percentile of sorted series (us) */
+static double pct(struct series_t *s, int p)
+{
+	if (s->n == 0)
+		return 0;
+	return s->v[(s->n - 1) * p / 100] / 1000.0;
+}
+
+static const char *table(unsigned char code, const char *proto)
+{
+	int i;
+
+	if (strcmp(proto, "v1") == 0) {
+		for (i = 0; i < sizeof(v1_cmds) / sizeof(v1_cmds[0]); i++)
+			if (v1_cmds[i].code == code)
+				return v1_cmds[i].name;
+	} else if (strcmp(proto, "v2") == 0) {
+		for (i = 0; i < sizeof(v2_cmds) / sizeof(v2_cmds[0]); i++)
+			if (v2_cmds[i].code == code)
+				return v2_cmds[i].name;
+	}
+	return "";
+}
+
+/* command name of sent frame */
+static void decode(struct analyze_t *a, const unsigned char *d, int len,
+		   char *name, int size)
+{
+	unsigned char code = d[0];
+
+	if (strcmp(a->phase, "setup.download") == 0) {
+		snprintf(name, size, "download");
+		return;
+	}
+	if (strcmp(a->proto, "v2") == 0) {
+		/* SOH len(2) command ... / SOD: write data */
+		if (d[0] == 0x81) {
+			snprintf(name, size, "13 write data");
+			return;
+		}
+		code = (len > 3) ? d[3] : 0xff;
+	} else if (strcmp(a->proto, "stub") == 0) {
+		snprintf(name, size, "%c", isprint(code) ? code : '?');
+		return;
+	}
+	snprintf(name, size, "%02x %s", code, table(code, a->proto));
+}
+
+/* answer code of received frame */
+static int answer(struct analyze_t *a, const unsigned char *d, int len)
+{
+	if (strcmp(a->proto, "v2") == 0 && d[0] == 0x81 && len > 3)
+		return d[3];
+	return d[0];
+}
+
+static struct cmd_t *command(struct analyze_t *a, const char *name)
+{
+	int i;
+
+	for (i = 0; i < a->cmds; i++)
+		if (strcmp(a->cmd[i].name, name) == 0)
+			return &a->cmd[i];
+	if (a->cmds >= ANALYZE_CMDS)
+		return NULL;
+	snprintf(a->cmd[a->cmds].name, sizeof(a->cmd[0].name), "%s", name);
+	return &a->cmd[a->cmds++];
+}
+
+/* wire time of bytes (ns) */
+static unsigned long long wire_ns(struct analyze_t *a, int len)
+{
+	if (a->bitrate <= 0)
+		return 0;
+	return (unsigned long long)len * 10 * 10000000 / a->bitrate;
+}
+
+static void idle(struct analyze_t *a, unsigned long long t,
+		 unsigned long long len)
+{
+	int i, min;
+
+	if (len < IDLE_GAP)
+		return;
+	a->idles++;
+	a->idle_ns += len;
+	for (min = 0, i = 1; i < IDLE_TOP; i++)
+		if (a->idle[i].len < a->idle[min].len)
+			min = i;
+	if (a->idle[min].len < len) {
+		a->idle[min].t = t;
+		a->idle[min].len = len;
+		snprintf(a->idle[min].phase, sizeof(a->idle[min].phase), "%s",
+			 a->phase[0] ? a->phase : "-");
+	}
+}
+
+static void histogram(const char *title, struct series_t *s)
+{
+	unsigned long hist[HIST_BUCKETS];
+	unsigned long peak = 0;
+	unsigned long long us;
+	int i, b;
+
+	if (s->n == 0)
+		return;
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < s->n; i++) {
+		us = s->v[i] / 1000;
+		for (b = 0; b < HIST_BUCKETS - 1 && us >= (1ULL << b); b++);
+		if (++hist[b] > peak)
+			peak = hist[b];
+	}
+	printf("\n%s (%d, median %.1f us, p99 %.1f us)\n", title, s->n,
+	       pct(s, 50), pct(s, 99));
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (hist[b] == 0)
+			continue;
+		printf("  < %8llu us %7lu ", 1ULL << b, hist[b]);
+		for (i = 0; i < (hist[b] * 40 + peak - 1) / peak; i++)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+static void report(struct analyze_t *a, const char *port,
+		   unsigned long long total)
+{
+	struct cmd_t *c;
+	const char *bound;
+	int i;
+
+	printf("trace %s (%s), %.3f ms, sent %lu byte, received %lu byte\n",
+	       port, a->proto, total / 1e6, a->tx_bytes, a->rx_bytes);
+	printf("\n%-24s %7s %10s %10s %10s %10s\n", "command", "count",
+	       "min us", "median us", "p99 us", "max us");
+	for (i = 0; i < a->cmds; i++) {
+		c = &a->cmd[i];
+		qsort(c->lat.v, c->lat.n, sizeof(c->lat.v[0]), cmp);
+		printf("%-24s %7d %10.1f %10.1f %10.1f %10.1f", c->name,
+		       c->lat.n, pct(&c->lat, 0), pct(&c->lat, 50),
+		       pct(&c->lat, 99), pct(&c->lat, 100));
+		if (c->naks)
+			printf("  %lu nak", c->naks);
+		putchar('\n');
+	}
+	qsort(a->ack.v, a->ack.n, sizeof(a->ack.v[0]), cmp);
+	qsort(a->host.v, a->host.n, sizeof(a->host.v[0]), cmp);
+	histogram("ACK turnaround (positive answers)", &a->ack);
+	histogram("host gap (answer -> next send)", &a->host);
+
+	printf("\nidle gaps > %d ms: %lu, %.3f ms\n", IDLE_GAP / 1000000,
+	       a->idles, a->idle_ns / 1e6);
+	for (i = 0; i < IDLE_TOP; i++)
+		if (a->idle[i].len)
+			printf("  at %10.3f ms %10.3f ms  %s\n",
+			       a->idle[i].t / 1e6, a->idle[i].len / 1e6,
+			       a->idle[i].phase);
+
+	/* pty / USB boot interface: no line rate */
+	if (a->link_ns > total) {
+		printf("\nwire time at bitrate (%.3f ms) exceeds trace, "
+		       "link has no line rate\n", a->link_ns / 1e6);
+		a->link_ns = 0;
+		a->target_ns = a->turn_ns;
+	}
+	if (a->link_ns >= a->target_ns && a->link_ns >= a->host_ns)
+		bound = "link-bound";
+	else if (a->target_ns >= a->host_ns)
+		bound = "target-bound";
+	else
+		bound = "host-bound";
+	printf("\nlink %.3f ms, target %.3f ms, host %.3f ms: %s\n",
+	       a->link_ns / 1e6, a->target_ns / 1e6, a->host_ns / 1e6, bound);
+}
+
+int analyze(const char *fn)
+{
+	struct analyze_t a;
+	struct trace_rec rec, last;
+	struct cmd_t *c = NULL;
+	unsigned char *buf;
+	char head[64], name[24];
+	unsigned long long end = 0, gap, turn, w;
+	FILE *fp;
+	int i, r = 1;
+
+	memset(&a, 0, sizeof(a));
+	a.proto = "-";
+	memset(&last, 0, sizeof(last));
+	buf = malloc(TRACE_BUF + 1);
+	fp = fopen(fn, "r");
+	if (buf == NULL || fp == NULL) {
+		perror(fn);
+		goto error;
+	}
+	if (fread(head, sizeof(head), 1, fp) != 1 ||
+	    memcmp(head, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not trace file\n", fn);
+		goto error;
+	}
+	head[sizeof(head) - 1] = '\0';
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.len > TRACE_BUF ||
+		    fread(buf, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "%s: broken record\n", fn);
+			break;
+		}
+		buf[rec.len] = '\0';
+		gap = (last.type && rec.t0 > end) ? rec.t0 - end : 0;
+		switch (rec.type) {
+		case TRACE_PHASE:
+			snprintf(a.phase, sizeof(a.phase), "%s", buf);
+			continue;
+		case TRACE_PROTO:
+			a.proto = (strcmp((char *)buf, "v1") == 0) ? "v1" :
+				(strcmp((char *)buf, "v2") == 0) ? "v2" : "stub";
+			continue;
+		case TRACE_BITRATE:
+			memcpy(&a.bitrate, buf, sizeof(a.bitrate));
+			continue;
+		case TRACE_TX:
+			a.tx_bytes += rec.len;
+			a.link_ns += wire_ns(&a, rec.len);
+			if (last.type == TRACE_RX) {
+				add(&a.host, gap);
+				a.host_ns += gap;
+			}
+			idle(&a, end, gap);
+			decode(&a, buf, rec.len, name, sizeof(name));
+			c = command(&a, name);
+			break;
+		case TRACE_RX:
+			a.rx_bytes += rec.len;
+			a.link_ns += wire_ns(&a, rec.len);
+			idle(&a, end, gap);
+			if (last.type != TRACE_TX || c == NULL)
+				break;
+			/* sent bytes are on the wire after send returns */
+			turn = (rec.t0 > last.t1) ? rec.t0 - last.t1 : 0;
+			add(&c->lat, turn);
+			w = wire_ns(&a, last.len + 1);
+			a.target_ns += (turn > w) ? turn - w : 0;
+			a.turn_ns += turn;
+			i = answer(&a, buf, rec.len);
+			/* boot program echoes stub download */
+			if (strcmp(c->name, "download") == 0)
+				;
+			else if (i == 0x15 || (i & 0x80))
+				c->naks++;
+			else
+				add(&a.ack, turn);
+			break;
+		default:
+			continue;
+		}
+		last = rec;
+		end = rec.t1;
+	}
+	report(&a, head + 8, end);
+	r = 0;
+ error:
+	for (i = 0; i < a.cmds; i++)
+		free(a.cmd[i].lat.v);
+	free(a.ack.v);
+	free(a.host.v);
+	free(buf);
+	if (fp)
+		fclose(fp);
+	return r;
+}
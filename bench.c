@@ -0,0 +1,597 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  benchmark (make bench)
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * micro benchmarks of host paths (image load, lookup_area, blank check,
+ * checksums) with synthetic data, end to end write to h8flash-emu for
+ * each protocol / image size / line rate (--impair rate), and frame
+ * assembly (write_rom only, against replay:// of recorded end to end run
+ * of each image size).
+ * min / median / p99 of iteration time (ns) are written to CSV / JSON.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#ifdef HAVE_GELF_H
+#include <elf.h>
+#endif
+#include "h8flash.h"
+#include "libh8flash.h"
+
+#define IMAGE_SIZE (256 * 1024)
+#define LOOKUP_AREAS 64
+#define LOOKUP_OPS 65536
+/* emulator flash (h8flash-emu default) */
+#define EMU_FLASH (256 * 1024)
+
+struct result_t {
+	char name[48];
+	int iterations;
+	unsigned long ops;	/* operations per iteration */
+	unsigned long bytes;	/* bytes per iteration */
+	long long min, median, p99;
+};
+
+struct proto_t {
+	const char *name;
+	const char *emu;	/* emulator option */
+	int freq;
+	unsigned int base;
+	int stub;
+};
+
+static const struct proto_t protos[] = {
+	{"v1", "-1", 1228, 0, 0},
+	{"v2", "-2", 1228, 0 - EMU_FLASH, 0},
+	{"stub", "-3", 1474, 0, 1},
+};
+
+static struct result_t *results;
+static int nresults;
+static FILE *out;
+static char dir[] = "/tmp/h8bench.XXXXXX";
+static unsigned long long seed = 1;
+static volatile unsigned int sink;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned char next_rand(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 0x2545f4914f6cdd1dULL) >> 56;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void add_result(const char *name, long long *t, int n,
+		       unsigned long ops, unsigned long bytes)
+{
+	struct result_t *r;
+
+	if (n == 0)
+		return;
+	results = realloc(results, sizeof(*results) * (nresults + 1));
+	if (results == NULL)
+		exit(1);
+	r = &results[nresults++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	qsort(t, n, sizeof(*t), cmp_ll);
+	r->iterations = n;
+	r->ops = ops;
+	r->bytes = bytes;
+	r->min = t[0];
+	r->median = t[n / 2];
+	r->p99 = t[(n * 99 + 99) / 100 - 1];
+	fprintf(out, "%-24s %6d %12.3f %12.3f %12.3f", name, n,
+		r->min / 1e6, r->median / 1e6, r->p99 / 1e6);
+	if (bytes)
+		fprintf(out, " %9.2f MB/s", bytes * 1e3 / r->median);
+	else
+		fprintf(out, " %9.1f ns/op", (double)r->median / ops);
+	fputc('\n', out);
+	fflush(out);
+}
+
+static struct arealist_t *new_arealist(int areas, unsigned int size)
+{
+	struct arealist_t *a;
+	int i;
+
+	a = calloc(1, sizeof(*a) + sizeof(struct area_t) * areas);
+	if (a == NULL)
+		return NULL;
+	a->areas = areas;
+	for (i = 0; i < areas; i++) {
+		a->area[i].start = size * i;
+		a->area[i].end = size * (i + 1) - 1;
+		a->area[i].size = size;
+		a->area[i].image = malloc(size);
+		if (a->area[i].image == NULL)
+			return NULL;
+	}
+	return a;
+}
+
+static void free_arealist(struct arealist_t *a)
+{
+	int i;
+
+	for (i = 0; i < a->areas; i++)
+		free(a->area[i].image);
+	free(a);
+}
+
+static int write_file(const char *fn, const unsigned char *data, int len)
+{
+	FILE *fp;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL || fwrite(data, 1, len, fp) != len) {
+		perror(fn);
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+	return fclose(fp) ? -1 : 0;
+}
+
+/* S3 records of 32 bytes */
+static int write_srec(const char *fn, const unsigned char *data, int len)
+{
+	FILE *fp;
+	unsigned int addr, sum;
+	int i, n;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL) {
+		perror(fn);
+		return -1;
+	}
+	for (addr = 0; addr < len; addr += n) {
+		n = len - addr < 32 ? len - addr : 32;
+		sum = n + 5 + (addr >> 24) + (addr >> 16) + (addr >> 8) + addr;
+		fprintf(fp, "S3%02X%08X", n + 5, addr);
+		for (i = 0; i < n; i++) {
+			fprintf(fp, "%02X", data[addr + i]);
+			sum += data[addr + i];
+		}
+		fprintf(fp, "%02X\n", ~sum & 0xff);
+	}
+	fputs("S70500000000FA\n", fp);
+	return fclose(fp) ? -1 : 0;
+}
+
+#ifdef HAVE_GELF_H
+/* one PT_LOAD segment at address 0 */
+static int write_elf(const char *fn, const unsigned char *data, int len)
+{
+	unsigned char *buf;
+	Elf32_Ehdr *eh;
+	Elf32_Phdr *ph;
+	int size = sizeof(*eh) + sizeof(*ph) + len;
+	int r;
+
+	buf = calloc(1, size);
+	if (buf == NULL)
+		return -1;
+	eh = (Elf32_Ehdr *)buf;
+	ph = (Elf32_Phdr *)(buf + sizeof(*eh));
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS32;
+	eh->e_ident[EI_DATA] = ELFDATA2LSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_type = ET_EXEC;
+	eh->e_machine = EM_SH;
+	eh->e_version = EV_CURRENT;
+	eh->e_phoff = sizeof(*eh);
+	eh->e_ehsize = sizeof(*eh);
+	eh->e_phentsize = sizeof(*ph);
+	eh->e_phnum = 1;
+	ph->p_type = PT_LOAD;
+	ph->p_offset = sizeof(*eh) + sizeof(*ph);
+	ph->p_filesz = ph->p_memsz = len;
+	ph->p_flags = PF_R | PF_X;
+	memcpy(buf + ph->p_offset, data, len);
+	r = write_file(fn, buf, size);
+	free(buf);
+	return r;
+}
+#endif
+
+static void bench_load(const char *name, const char *fn, int binary,
+		       int iterations)
+{
+	struct arealist_t *a;
+	long long *t;
+	long long t0;
+	int i, n;
+
+	a = new_arealist(1, IMAGE_SIZE);
+	t = calloc(iterations, sizeof(*t));
+	if (a == NULL || t == NULL)
+		exit(1);
+	for (i = n = 0; i < iterations; i++) {
+		t0 = now_ns();
+		if (load_file(fn, binary, 0, a) < 0)
+			break;
+		t[n++] = now_ns() - t0;
+	}
+	add_result(name, t, n, 1, IMAGE_SIZE);
+	free(t);
+	free_arealist(a);
+}
+
+static void bench_lookup(int iterations)
+{
+	struct arealist_t *a;
+	unsigned int *addr;
+	long long *t;
+	long long t0;
+	int i, j;
+
+	a = new_arealist(LOOKUP_AREAS, IMAGE_SIZE / LOOKUP_AREAS);
+	addr = malloc(sizeof(*addr) * LOOKUP_OPS);
+	t = calloc(iterations, sizeof(*t));
+	if (a == NULL || addr == NULL || t == NULL)
+		exit(1);
+	/* S-record order (ascending, 32 byte step) */
+	for (j = 0; j < LOOKUP_OPS; j++)
+		addr[j] = (j * 32) % IMAGE_SIZE;
+	for (i = 0; i < iterations; i++) {
+		t0 = now_ns();
+		for (j = 0; j < LOOKUP_OPS; j++)
+			sink += lookup_area(a, addr[j])->size;
+		t[i] = now_ns() - t0;
+	}
+	add_result("lookup_area", t, iterations, LOOKUP_OPS, 0);
+	free(t);
+	free(addr);
+	free_arealist(a);
+}
+
+static void bench_image(const unsigned char *image, int iterations)
+{
+	static const char *names[] = {"blank_check", "sum", "crc32"};
+	unsigned char *blank;
+	long long *t;
+	long long t0;
+	int i, k;
+
+	blank = malloc(IMAGE_SIZE);
+	t = calloc(iterations, sizeof(*t));
+	if (blank == NULL || t == NULL)
+		exit(1);
+	memset(blank, 0xff, IMAGE_SIZE);
+	for (k = 0; k < 3; k++) {
+		for (i = 0; i < iterations; i++) {
+			t0 = now_ns();
+			switch (k) {
+			case 0:
+				sink += image_blank(blank, IMAGE_SIZE);
+				break;
+			case 1:
+				sink += image_sum(image, IMAGE_SIZE);
+				break;
+			case 2:
+				sink += image_crc32(0, image, IMAGE_SIZE);
+				break;
+			}
+			t[i] = now_ns() - t0;
+		}
+		add_result(names[k], t, iterations, 1, IMAGE_SIZE);
+	}
+	free(t);
+	free(blank);
+}
+
+/* start emulator, returns pid and pty name */
+static pid_t start_emu(const char *emu, const struct proto_t *pr, char *pty,
+		       int size)
+{
+	int fd[2];
+	pid_t pid;
+	FILE *fp;
+
+	if (pipe(fd) < 0)
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		dup2(fd[1], 1);
+		close(fd[0]);
+		close(fd[1]);
+		execl(emu, emu, pr->emu, (char *)NULL);
+		perror(emu);
+		_exit(1);
+	}
+	close(fd[1]);
+	fp = fdopen(fd[0], "r");
+	if (pid < 0 || fp == NULL || fgets(pty, size, fp) == NULL) {
+		if (fp)
+			fclose(fp);
+		if (pid > 0)
+			kill(pid, SIGTERM);
+		return -1;
+	}
+	pty[strcspn(pty, "\n")] = '\0';
+	fclose(fp);
+	return pid;
+}
+
+/* one write session. returns time (ns) or -1.
+   write_only: time of h8flash_write (transfer loop) only */
+static long long run(const char *port, const struct proto_t *pr,
+		     const char *image, int rate, const char *trace,
+		     const char *stub, int write_only)
+{
+	struct h8flash_config config = {.endian = 'l'};
+	struct h8flash *h;
+	char spec[32];
+	long long t0, tw = 0;
+	int r = -1;
+
+	config.freq = pr->freq;
+	config.stub = pr->stub ? stub : NULL;
+	t0 = now_ns();
+	h = h8flash_open(port);
+	if (h == NULL)
+		return -1;
+	snprintf(spec, sizeof(spec), "rate=%d", rate);
+	if ((rate && h8flash_impair(h, spec) < 0) ||
+	    (trace && h8flash_trace(h, trace) < 0))
+		goto error;
+	if (h8flash_connect(h, &config) == 0 &&
+	    h8flash_plan(h, image, 1, pr->base, 0, NULL) == 0) {
+		tw = now_ns();
+		r = h8flash_write(h);
+		tw = now_ns() - tw;
+	}
+ error:
+	h8flash_close(h);
+	if (r < 0)
+		return -1;
+	return write_only ? tw : now_ns() - t0;
+}
+
+static void bench_e2e(const char *emu, const char *sizes, const char *rates,
+		      int iterations, int replays, const char *stub)
+{
+	const struct proto_t *pr;
+	char name[48], image[64], trace[64], port[80], pty[64];
+	unsigned char *data;
+	long long *t;
+	const char *s, *b;
+	int size, rate, i, n;
+	pid_t pid;
+
+	t = calloc(iterations > replays ? iterations : replays, sizeof(*t));
+	data = malloc(EMU_FLASH);
+	if (t == NULL || data == NULL)
+		exit(1);
+	for (i = 0; i < EMU_FLASH; i++)
+		data[i] = next_rand();
+	for (pr = protos; pr < protos + sizeof(protos) / sizeof(protos[0]);
+	     pr++) {
+		for (s = sizes; *s; s += strcspn(s, ","), s += (*s == ',')) {
+			size = strtoul(s, NULL, 0) * 1024;
+			if (size <= 0 || size > EMU_FLASH)
+				continue;
+			snprintf(image, sizeof(image), "%s/e2e%d.bin", dir, size);
+			if (write_file(image, data, size) < 0)
+				continue;
+			for (b = rates; *b; b += strcspn(b, ","), b += (*b == ',')) {
+				rate = strtoul(b, NULL, 0);
+				for (i = n = 0; i < iterations; i++) {
+					pid = start_emu(emu, pr, pty, sizeof(pty));
+					if (pid < 0)
+						break;
+					t[n] = run(pty, pr, image, rate, NULL, stub, 0);
+					kill(pid, SIGTERM);
+					waitpid(pid, NULL, 0);
+					if (t[n] < 0) {
+						fprintf(stderr, "e2e %s %dKB %dbps failed\n",
+							pr->name, size / 1024, rate);
+						break;
+					}
+					n++;
+				}
+				snprintf(name, sizeof(name), "e2e_%s_%dk_%s", pr->name,
+					 size / 1024, rate ? b : "pty");
+				name[strcspn(name, ",")] = '\0';
+				add_result(name, t, n, 1, size);
+			}
+			/* frame assembly: write_rom against replay of image */
+			snprintf(trace, sizeof(trace), "%s/%s%d.trc", dir,
+				 pr->name, size);
+			pid = start_emu(emu, pr, pty, sizeof(pty));
+			if (pid < 0)
+				continue;
+			t[0] = run(pty, pr, image, 0, trace, stub, 0);
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			if (t[0] < 0)
+				continue;
+			snprintf(port, sizeof(port), "replay://%s", trace);
+			for (i = n = 0; i < replays; i++) {
+				t[n] = run(port, pr, image, 0, NULL, stub, 1);
+				if (t[n] < 0)
+					break;
+				n++;
+			}
+			snprintf(name, sizeof(name), "frame_%s_%dk", pr->name,
+				 size / 1024);
+			add_result(name, t, n, 1, size);
+		}
+	}
+	free(data);
+	free(t);
+}
+
+static void write_csv(const char *fn)
+{
+	struct result_t *r;
+	FILE *fp;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL) {
+		perror(fn);
+		return;
+	}
+	fputs("name,iterations,ops,bytes,min_ns,median_ns,p99_ns\n", fp);
+	for (r = results; r < results + nresults; r++)
+		fprintf(fp, "%s,%d,%lu,%lu,%lld,%lld,%lld\n", r->name,
+			r->iterations, r->ops, r->bytes, r->min, r->median,
+			r->p99);
+	fclose(fp);
+}
+
+static void write_json(const char *fn)
+{
+	struct result_t *r;
+	FILE *fp;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL) {
+		perror(fn);
+		return;
+	}
+	fputs("{\"benchmarks\": [", fp);
+	for (r = results; r < results + nresults; r++)
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"iterations\": %d, "
+			"\"ops\": %lu, \"bytes\": %lu, \"min_ns\": %lld, "
+			"\"median_ns\": %lld, \"p99_ns\": %lld}",
+			r == results ? "" : ",", r->name, r->iterations,
+			r->ops, r->bytes, r->min, r->median, r->p99);
+	fputs("\n]}\n", fp);
+	fclose(fp);
+}
+
+static void remove_dir(void)
+{
+	struct dirent *d;
+	char fn[300];
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		snprintf(fn, sizeof(fn), "%s/%s", dir, d->d_name);
+		if (d->d_name[0] != '.')
+			unlink(fn);
+	}
+	closedir(dp);
+	rmdir(dir);
+}
+
+static void usage(void)
+{
+	puts("h8flash-bench [-n iterations] [-e h8flash-emu] [-s KB,KB,...]"
+	     " [-r bps,bps,...] [-i e2e iterations] [-c out.csv]"
+	     " [-j out.json]");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *image;
+	char fn[64], stub[64];
+	const char *emu = NULL;
+	const char *csv = NULL, *json = NULL;
+	const char *sizes = "16,64";
+	const char *rates = "0,921600,115200";
+	int iterations = 100;
+	int e2e = 3;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "n:e:s:r:i:c:j:")) >= 0) {
+		switch (c) {
+		case 'n': iterations = strtoul(optarg, NULL, 0); break;
+		case 'e': emu = optarg; break;
+		case 's': sizes = optarg; break;
+		case 'r': rates = optarg; break;
+		case 'i': e2e = strtoul(optarg, NULL, 0); break;
+		case 'c': csv = optarg; break;
+		case 'j': json = optarg; break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (iterations < 1 || e2e < 1) {
+		usage();
+		return 1;
+	}
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	/* library progress output is discarded */
+	out = fdopen(dup(1), "w");
+	if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+		return 1;
+	fprintf(out, "%-24s %6s %12s %12s %12s\n", "name", "iter",
+		"min(ms)", "median(ms)", "p99(ms)");
+
+	image = malloc(IMAGE_SIZE);
+	if (image == NULL)
+		return 1;
+	for (i = 0; i < IMAGE_SIZE; i++)
+		image[i] = next_rand();
+	snprintf(fn, sizeof(fn), "%s/image.mot", dir);
+	if (write_srec(fn, image, IMAGE_SIZE) == 0)
+		bench_load("srec_load", fn, 0, iterations);
+	snprintf(fn, sizeof(fn), "%s/image.bin", dir);
+	if (write_file(fn, image, IMAGE_SIZE) == 0)
+		bench_load("binary_load", fn, 1, iterations);
+#ifdef HAVE_GELF_H
+	snprintf(fn, sizeof(fn), "%s/image.elf", dir);
+	if (write_elf(fn, image, IMAGE_SIZE) == 0)
+		bench_load("elf_load", fn, 0, iterations);
+#endif
+	bench_lookup(iterations);
+	bench_image(image, iterations);
+	if (emu) {
+		/* boot mode download of emulator is echo only */
+		snprintf(stub, sizeof(stub), "%s/stub.bin", dir);
+		if (write_file(stub, image, 1024) == 0)
+			bench_e2e(emu, sizes, rates, e2e, iterations, stub);
+	}
+	free(image);
+
+	if (csv)
+		write_csv(csv);
+	if (json)
+		write_json(json);
+	remove_dir();
+	return 0;
+}
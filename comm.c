@@ -47,6 +47,29 @@
 #define BLANKCHECK_USERBOOT  0x4c
 #define BLANKCHECK_USER      0x4d
 #define WRITE                0x50
+#define SUMCHECK_USERBOOT    0x4a
+#define SUMCHECK_USER        0x4b
+#define SUMCHECK_USERBOOT_RES 0x5a
+#define SUMCHECK_USER_RES    0x5b
+#define READ_MEMORY          0x52
+#define READ_MEMORY_NAK      0xd2
+
+/* read block progress step */
+#define READ_PROGRESS        1024
+/* max bytes of one read command */
+#define READ_BLOCK           4096
+
+struct v1_t {
+	struct comm_t comm;
+	/* program/erase state entered */
+	int writemode;
+	/* flash written (erased only entering program/erase state) */
+	int written;
+	/* selected device code */
+	char device_code[5];
+};
+
+#define V1(c) ((struct v1_t *)(c))
 
 struct devinfo_t {
 	char code[4];
@@ -108,28 +131,31 @@ static __inline__ void setlong(unsigned char *buf, unsigned long val)
 	*(buf + 3) = (val      ) & 0xff;
 }
 
-/* send multibyte command */
-static void send(struct port_t *p, unsigned char *data, int len)
+/* send multibyte command. 0: sent -1: port error */
+static int send(struct port_t *p, unsigned char *data, int len)
 {
 	unsigned char sum;
-	p->send_data(data, len);
+	if (p->send_data(p, data, len) != len)
+		return -1;
 	if (len > 1) {
 		for(sum = 0; len > 0; len--, data++)
 			sum += *data;
 		sum = 0x100 - sum;
-		p->send_data(&sum, 1);
+		if (p->send_data(p, &sum, 1) != 1)
+			return -1;
 	}
+	return 0;
 }
 
-/* receive answer */
-static int receive(struct port_t *p, unsigned char *data)
+/* receive answer into data (size bytes) */
+static int receive(struct port_t *p, unsigned char *data, int size)
 {
 	int len;
 	unsigned char *rxptr;
 	unsigned char sum;
 
 	rxptr = data;
-	if (p->receive_byte(rxptr) != 1)
+	if (p->receive_byte(p, rxptr) != 1)
 		return -1;
 	rxptr++;
 	/* ACK */
@@ -138,19 +164,21 @@ static int receive(struct port_t *p, unsigned char *data)
 	}
 	/* NAK */
 	if (memchr(naktable, *data, sizeof(naktable))) {
-		if (p->receive_byte(rxptr) != 1)
+		if (p->receive_byte(p, rxptr) != 1)
 			return -1;
 		else
 			return 2;
 	}
 
 	/* multibyte response */
-	if (p->receive_byte(rxptr) != 1)
+	if (p->receive_byte(p, rxptr) != 1)
 		return -1;
 	rxptr++;
+	if (*(data + 1) + 3 > size)
+		return -1;
 	len = *(data + 1) + 1;
 	for(; len > 0; len--) {
-		if (p->receive_byte(rxptr) != 1)
+		if (p->receive_byte(p, rxptr) != 1)
 			return -1;
 		rxptr++;
 	}
@@ -167,17 +195,97 @@ static int receive(struct port_t *p, unsigned char *data)
 	return *(data + 1);
 }
 
+/* NAK error code */
+#define NAK_SUMERR           0x11
+
+/* retry policy */
+#define RETRY_NONE           0	/* state changing frame */
+#define RETRY_SUMERR         1	/* retry only target rejected frame */
+#define RETRY_ANY            2	/* idempotent frame */
+
+static const struct {
+	unsigned char code;
+	const char *msg;
+} nak_messages[] = {
+	{0x11, "checksum error"},
+	{0x29, "block number error"},
+	{0x2a, "address error"},
+	{0x2b, "data length error"},
+	{0x51, "erase error"},
+	{0x52, "erase incomplete"},
+	{0x53, "programming error"},
+	{0x54, "selection error"},
+	{0x80, "command error"},
+	{0xff, "bitrate matching error"},
+};
+
+/* print NAK reason */
+static void nak_report(unsigned char *res)
+{
+	int i;
+
+	if (!memchr(naktable, res[0], sizeof(naktable)))
+		return;
+	for (i = 0; i < sizeof(nak_messages) / sizeof(nak_messages[0]); i++)
+		if (nak_messages[i].code == res[1]) {
+			fprintf(stderr, " (%s)", nak_messages[i].msg);
+			return;
+		}
+	fprintf(stderr, " (error %02x)", res[1]);
+}
+
+/* wait before retry and discard rest of broken frame */
+static void retry_wait(struct port_t *p, int count)
+{
+	p->stats.retries++;
+	progress_retry(p);
+	port_sleep(p, RETRY_WAIT << count);
+	if (p->flush)
+		p->flush(p);
+}
+
+/* send command and receive answer. retry recoverable error */
+static int transfer(struct port_t *p, unsigned char *cmd, int len,
+		    unsigned char *res, int size, int retry)
+{
+	int count;
+	int r;
+
+	for (count = 0;; count++) {
+		/* port error is not recoverable */
+		if (send(p, cmd, len) < 0)
+			return -1;
+		p->stats.frames++;
+		r = receive(p, res, size);
+		if (r == -1) {
+			/* timeout or broken answer */
+			p->stats.errors++;
+			if (retry < RETRY_ANY)
+				return r;
+		} else if (r == 2 && memchr(naktable, res[0], sizeof(naktable))) {
+			p->stats.naks++;
+			if (retry < RETRY_SUMERR || res[1] != NAK_SUMERR)
+				return r;
+		} else
+			return r;
+		if (count >= RETRY_COUNT)
+			return r;
+		VERBOSE_PRINT("retry command %02x\n", cmd[0]);
+		retry_wait(p, count);
+	}
+}
+
 /* get target device list */
 static struct devicelist_t *get_devicelist(struct port_t *port)
 {
+	unsigned char cmd;
 	unsigned char rxbuf[255+3];
 	unsigned char *devp;
 	struct devicelist_t *devlist;
 	int devno;
 
-	rxbuf[0] = QUERY_DEVICE;
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = QUERY_DEVICE;
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return NULL;
 	if (rxbuf[0] != QUERY_DEVICE_RES)
 		return NULL;
@@ -203,10 +311,10 @@ static struct devicelist_t *get_devicelist(struct port_t *port)
 static int select_device(struct port_t *port, const char *code)
 {
 	unsigned char buf[6] = {SELECT_DEVICE, 0x04, 0x00, 0x00, 0x00, 0x00};
-	
+	unsigned char res[255+3];
+
 	memcpy(&buf[2], code, 4);
-	send(port, buf, sizeof(buf));
-	if (receive(port, buf) != 1)
+	if (transfer(port, buf, sizeof(buf), res, sizeof(res), RETRY_ANY) != 1)
 		return 0;
 	return 1;
 }
@@ -214,14 +322,14 @@ static int select_device(struct port_t *port, const char *code)
 /* get target clock mode */
 static struct clockmode_t *get_clockmode(struct port_t *port)
 {
+	unsigned char cmd;
 	unsigned char rxbuf[255+3];
 	unsigned char *clkmdp;
 	struct clockmode_t *clocks;
 	int numclock;
 
-	rxbuf[0] = QUERY_CLOCKMODE;
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = QUERY_CLOCKMODE;
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return NULL;
 	if (rxbuf[0] != QUERY_CLOCKMODE_RES)
 		return NULL;
@@ -247,10 +355,10 @@ static struct clockmode_t *get_clockmode(struct port_t *port)
 static int set_clockmode(struct port_t *port, int mode)
 {
 	unsigned char buf[3] = {SET_CLOCKMODE, 0x01, 0x00};
-	
+	unsigned char res[255+3];
+
 	buf[2] =  mode;
-	send(port, buf, sizeof(buf));
-	if (receive(port, buf) != 1)
+	if (transfer(port, buf, sizeof(buf), res, sizeof(res), RETRY_ANY) != 1)
 		return 0;
 	else
 		return 1;
@@ -259,6 +367,7 @@ static int set_clockmode(struct port_t *port, int mode)
 /* get target multiplier/divider rate */
 static struct multilist_t *get_multirate(struct port_t *port)
 {
+	unsigned char cmd;
 	unsigned char rxbuf[255+3];
 	unsigned char *mulp;
 	struct multilist_t *multilist;
@@ -267,9 +376,8 @@ static struct multilist_t *get_multirate(struct port_t *port)
 	int numrate;
 	int listsize;
 
-	rxbuf[0] = QUERY_MULTIRATE;
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = QUERY_MULTIRATE;
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return NULL;
 	if (rxbuf[0] != QUERY_MULTIRATE_RES)
 		return NULL;
@@ -305,14 +413,14 @@ static struct multilist_t *get_multirate(struct port_t *port)
 /* get target operation frequency list */
 static struct freqlist_t *get_freqlist(struct port_t *port)
 {
+	unsigned char cmd;
 	unsigned char rxbuf[255+3];
 	unsigned char *freqp;
 	struct freqlist_t *freqlist;
 	int numfreq;
 
-	rxbuf[0] = QUERY_FREQ;
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = QUERY_FREQ;
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return NULL;
 	if (rxbuf[0] != QUERY_FREQ_RES)
 		return NULL;
@@ -337,12 +445,12 @@ static struct freqlist_t *get_freqlist(struct port_t *port)
 /* get write page size */
 static int get_writesize(struct port_t *port)
 {
+	unsigned char cmd;
 	unsigned char rxbuf[5];
 	unsigned short size;
 
-	rxbuf[0] = QUERY_WRITESIZE;
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = QUERY_WRITESIZE;
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return -1;
 	if (rxbuf[0] != QUERY_WRITESIZE_RES)
 		return -1;
@@ -353,8 +461,10 @@ static int get_writesize(struct port_t *port)
 	return size;
 }
 
-static struct arealist_t *get_arealist(struct port_t *port, enum mat_t mat)
+static struct arealist_t *get_arealist(struct comm_t *com, struct port_t *port,
+				       enum mat_t mat)
 {
+	unsigned char cmd;
 	char ans;
 	unsigned char rxbuf[255+3];
 	unsigned char *areap;
@@ -376,18 +486,19 @@ static struct arealist_t *get_arealist(struct port_t *port, enum mat_t mat)
 	default:
 		return NULL;
 	}
-	send(port, rxbuf, 1);
-	if (receive(port, rxbuf) == -1)
+	cmd = rxbuf[0];
+	if (transfer(port, &cmd, 1, rxbuf, sizeof(rxbuf), RETRY_ANY) == -1)
 		return NULL;
 	if (rxbuf[0] != ans)
 		return NULL;
 
 	numarea = rxbuf[2];
-	arealist = (struct arealist_t *)malloc(sizeof(struct arealist_t) + 
+	arealist = (struct arealist_t *)calloc(1, sizeof(struct arealist_t) + 
                                                sizeof(struct area_t) * numarea);
 	if (arealist == NULL)
 		return NULL;
 
+	arealist->journal = NULL;
 	arealist->areas = numarea;
 	areap = &rxbuf[3];
 	for(numarea = 0; numarea < arealist->areas; numarea++) {
@@ -397,7 +508,7 @@ static struct arealist_t *get_arealist(struct port_t *port, enum mat_t mat)
 		arealist->area[numarea].end   = getlong(areap+4);
 		arealist->area[numarea].size  = wsize;
 		areap += 8;
-		size = arealist->area[numarea].end - arealist->area[numarea].start;
+		size = AREA_LEN(&arealist->area[numarea]);
 		if (!(arealist->area[numarea].image = malloc(size)))
 			return NULL;
 		memset(arealist->area[numarea].image, 0xff, size);
@@ -431,6 +542,7 @@ static int adjust_bitrate(int p_freq)
 static int set_bitrate(struct port_t *p, int bitrate, int freq, int coremul, int peripheralmul)
 {
 	unsigned char buf[9] = {SET_BITRATE, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char res[255+3];
 
 	buf[2] = (bitrate >> 8) & 0xff;
 	buf[3] = bitrate & 0xff;
@@ -443,19 +555,17 @@ static int set_bitrate(struct port_t *p, int bitrate, int freq, int coremul, int
 	buf[7] = coremul;
 	buf[8] = peripheralmul;
 
-	send(p, buf, sizeof(buf));
-	if (receive(p, buf) != 1)
+	if (transfer(p, buf, sizeof(buf), res, sizeof(res), RETRY_SUMERR) != 1)
 		return 0;
 
 	if (p->setbaud) {
-		if (!p->setbaud(bitrate))
+		if (!p->setbaud(p, bitrate))
 			return 0;
 
 	}
-	usleep(10000);
+	port_sleep(p, p->settle);
 	buf[0] = ACK;
-	send(p, buf, 1);
-	if (receive(p, buf) != 1)
+	if (send(p, buf, 1) < 0 || receive(p, buf, sizeof(buf)) != 1)
 		return 0;
 	else
 		return 1;
@@ -536,34 +646,46 @@ static int change_bitrate(struct port_t *p, int in_freq,
 	return set_bitrate(p, rate, in_freq, core_mul, peripheral_mul);
 }
 
-/* check blank page */
-static int skipcheck(unsigned char *data, unsigned short size)
+/* enter program/erase state (boot program erase flash) */
+static int enter_writemode(struct comm_t *com, struct port_t *port)
 {
-	unsigned char r = 0xff;
-	int c;
-	for (c = 0; c < size; c++)
-		r &= *data++;
-	return (r == 0xff);
+	unsigned char cmdbuf[2];
+
+	if (V1(com)->writemode)
+		return 0;
+	puts("Erase flash...");
+	cmdbuf[0] = WRITEMODE;
+	if (send(port, cmdbuf, 1) < 0 || receive(port, cmdbuf, sizeof(cmdbuf)) != 1) {
+		printf("%02x ", cmdbuf[0]);
+		fputs(PROGNAME ": writemode start failed\n", stderr);
+		return -1;
+	}
+	V1(com)->writemode = 1;
+	return 0;
 }
 
 /* write rom image */
-static int write_rom(struct port_t *port, struct arealist_t *arealist, enum mat_t mat)
+static int write_rom(struct comm_t *com, struct port_t *port,
+		     struct arealist_t *arealist, enum mat_t mat)
 {
 	unsigned char *buf = NULL;
-	unsigned char cmdbuf[1];
-	unsigned int romaddr;
+	unsigned char cmdbuf[255+3];
+	unsigned int romaddr, total;
 	int i;
 	struct area_t *area;
 
-	puts("Erase flash...");
-	/* enter writemode */
-	cmdbuf[0] = WRITEMODE;
-	send(port, cmdbuf, 1);
-	if (receive(port, cmdbuf) != 1) {
-		printf("%02x ", buf[0]);
-		fputs(PROGNAME ": writemode start failed\n", stderr);
-		goto error;
+	if (V1(com)->written) {
+		fputs(PROGNAME ": old protocol writes once per boot session, "
+		      "reset target\n", stderr);
+		return -1;
 	}
+	prof_phase(port, "erase");
+	if (enter_writemode(com, port) < 0)
+		goto error;
+	/* whole flash erased, nothing left from journal */
+	journal_discard(arealist->journal);
+	V1(com)->written = 1;
+	prof_phase(port, "write");
 
 	/* mat select */
 	switch (mat) {
@@ -574,75 +696,271 @@ static int write_rom(struct port_t *port, struct arealist_t *arealist, enum mat_
 		cmdbuf[0] = WRITE_USERBOOT;
 		break;
 	}
-	send(port, cmdbuf, 1);
-	if (receive(port, cmdbuf) != 1) {
-		printf("%02x ", cmdbuf[0]);
+	if (transfer(port, cmdbuf, 1, cmdbuf + 1, sizeof(cmdbuf) - 1,
+		     RETRY_ANY) != 1) {
+		printf("%02x ", cmdbuf[1]);
 		fputs(PROGNAME ": writemode start failed\n", stderr);
 		goto error;
 	}
 
+	/* bytes to write */
+	for (total = 0, i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		for (romaddr = area->start; romaddr < area->end;
+		     romaddr += area->size)
+			if (!image_blank(area_image(area, romaddr - area->start),
+					 area->size) &&
+			    !journal_done(arealist->journal, romaddr))
+				total += area->size;
+	}
+	progress_start(port, "writing", total);
+
 	/* writing loop */
 	for (i = 0; i < arealist->areas; i++) {
 		area = &arealist->area[i];
+		buf = realloc(buf, area->size + 5);
+		if (buf == NULL)
+			goto error;
 		for (romaddr = area->start; 
 		     romaddr < area->end; 
 		     romaddr += area->size) {
-			if (skipcheck(area->image + romaddr - area->start,
-				      area->size)) {
+			if (image_blank(area_image(area, romaddr - area->start),
+					area->size) ||
+			    journal_done(arealist->journal, romaddr)) {
 				if (verbose)
 					printf("skip - %08x\n",romaddr);
-				else {
-					printf("writing %d/%d byte\r",
-					       romaddr - area->start, 
-					       area->end  - area->start); 
-					fflush(stdout);
-				}
 				continue;
 			}
-			buf = malloc(area->size + 5);
-			if (buf == NULL)
-				goto error;
 			/* set write data */
 			*(buf + 0) = WRITE;
 			setlong(buf + 1, romaddr);
 			memcpy(buf + 5,
-			       area->image + romaddr - area->start,
+			       area_image(area, romaddr - area->start),
 			       area->size);
 			/* write */
-			send(port, buf, 5 + area->size);
-			free(buf);
-			if (receive(port, buf) != 1) {
+			if (transfer(port, buf, 5 + area->size, cmdbuf,
+				     sizeof(cmdbuf), RETRY_SUMERR) != 1) {
 				fprintf(stderr, PROGNAME ": write data %08x failed.", romaddr);
+				nak_report(cmdbuf);
 				goto error;
 			}
+			journal_ack(arealist->journal, romaddr);
 			if (verbose)
 				printf("write - %08x\n",romaddr);
-			else {
-				printf("writing %d/%d byte\r",
-				       romaddr - area->start, 
-				       area->end  - area->start); 
-				fflush(stdout);
-			}
+			progress_step(port, romaddr, area->size);
 		}
 	}
 	/* write finish */
+	buf = realloc(buf, 5);
+	if (buf == NULL)
+		goto error;
 	*(buf + 0) = WRITE;
 	memset(buf + 1, 0xff, 4);
-	send(port, buf, 5);
-	if (receive(port, buf) != 1) {
+	if (transfer(port, buf, 5, cmdbuf, sizeof(cmdbuf), RETRY_SUMERR) != 1) {
 		fputs(PROGNAME ": writemode exit failed", stderr);
 		goto error;
 	}
-	if (!verbose)
-		putc('\n', stdout);
+	progress_end(port);
 
-	return 1;
+	free(buf);
+	return 0;
+ error:
+	free(buf);
+	return -1;
+}
+
+/* read memory command */
+static int read_block(struct comm_t *com, struct port_t *port, enum mat_t mat,
+		      unsigned int addr, unsigned int size, unsigned char *buf)
+{
+	unsigned char cmd[11];
+	unsigned char rx[5];
+	unsigned char sum;
+	unsigned int i;
+
+	/* read command works in inquiry state. program/erase state
+	   is not entered (it erases whole flash) */
+	cmd[0] = READ_MEMORY;
+	cmd[1] = 9;
+	cmd[2] = (mat == user) ? 0x01 : 0x00;
+	setlong(cmd + 3, addr);
+	setlong(cmd + 7, size);
+	if (send(port, cmd, sizeof(cmd)) < 0)
+		goto error;
+	port->stats.frames++;
+
+	if (port->receive_byte(port, rx) != 1)
+		goto error;
+	if (rx[0] == READ_MEMORY_NAK) {
+		port->stats.naks++;
+		port->receive_byte(port, rx + 1);
+		if (rx[1] == NAK_SUMERR)
+			return -1;
+		fprintf(stderr, PROGNAME ": read %08x - %08x failed",
+			addr, addr + size - 1);
+		nak_report(rx);
+		fputc('\n', stderr);
+		return -2;
+	}
+	if (rx[0] != READ_MEMORY)
+		goto error;
+	for (i = 1; i < 5; i++)
+		if (port->receive_byte(port, rx + i) != 1)
+			goto error;
+	if (getlong(rx + 1) != size)
+		goto error;
+	for (sum = 0, i = 0; i < 5; i++)
+		sum += rx[i];
+
+	/* data body */
+	for (i = 0; i < size; i++) {
+		if (port->receive_byte(port, buf + i) != 1)
+			goto error;
+		sum += buf[i];
+		if ((i + 1) % READ_PROGRESS == 0)
+			progress_step(port, addr + i + 1 - READ_PROGRESS,
+				      READ_PROGRESS);
+	}
+	if (port->receive_byte(port, rx) != 1)
+		goto error;
+	sum += rx[0];
+	if (sum != 0)
+		goto error;
+	if (size % READ_PROGRESS)
+		progress_step(port, addr + size - size % READ_PROGRESS,
+			      size % READ_PROGRESS);
+	VERBOSE_PRINT("read - %08x - %08x\n", addr, addr + size - 1);
+	return 0;
  error:
+	port->stats.errors++;
+	return -1;
+}
+
+/* read rom data */
+static int read_rom(struct comm_t *com, struct port_t *port, enum mat_t mat,
+		    unsigned int addr, unsigned int size, unsigned char *buf)
+{
+	unsigned int pos, n;
+	int count;
+	int r = 0;
+
+	for (pos = 0; pos < size && r == 0; pos += n) {
+		n = size - pos < READ_BLOCK ? size - pos : READ_BLOCK;
+		/* memory read is idempotent, retry whole request */
+		for (count = 0;; count++) {
+			r = read_block(com, port, mat, addr + pos, n, buf + pos);
+			if (r != -1 || count >= RETRY_COUNT)
+				break;
+			VERBOSE_PRINT("retry read %08x\n", addr + pos);
+			retry_wait(port, count);
+		}
+		if (r == -1)
+			fprintf(stderr, PROGNAME ": read %08x - %08x failed\n",
+				addr + pos, addr + pos + n - 1);
+	}
+	return r < 0 ? -1 : 0;
+}
+
+/* first page to write in journal */
+static unsigned int inflight_page(struct arealist_t *arealist)
+{
+	struct area_t *area;
+	unsigned int romaddr;
+	int i;
+
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		for (romaddr = area->start;
+		     romaddr < area->end;
+		     romaddr += area->size) {
+			if (!image_blank(area_image(area, romaddr - area->start),
+					 area->size) &&
+			    !journal_done(arealist->journal, romaddr))
+				return romaddr;
+		}
+	}
+	return 0xffffffff;
+}
+
+/* compare target MAT checksum with image */
+static int verify_rom(struct comm_t *com, struct port_t *port,
+		      struct arealist_t *arealist, enum mat_t mat)
+{
+	unsigned char buf[255+3];
+	unsigned char cmd;
+	unsigned char ans;
+	unsigned int sum, target;
+	unsigned int romaddr;
+	struct area_t *area;
+	int i;
+
+	/* sum check works in inquiry state, program/erase state is not
+	   entered (it erases whole flash before verify) */
+	switch (mat) {
+	case user:
+		buf[0] = SUMCHECK_USER;
+		ans    = SUMCHECK_USER_RES;
+		break;
+	case userboot:
+		buf[0] = SUMCHECK_USERBOOT;
+		ans    = SUMCHECK_USERBOOT_RES;
+		break;
+	default:
+		return -1;
+	}
+	cmd = buf[0];
+	if (transfer(port, &cmd, 1, buf, sizeof(buf), RETRY_ANY) != 4 ||
+	    buf[0] != ans) {
+		fputs(PROGNAME ": sum check failed\n", stderr);
+		return -1;
+	}
+	target = getlong(&buf[2]);
+
+	for (sum = 0, i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		sum += area_sum(area);
+		if (arealist->journal == NULL)
+			continue;
+		/* not acknowledged page is erased */
+		for (romaddr = area->start;
+		     romaddr < area->end;
+		     romaddr += area->size) {
+			if (journal_done(arealist->journal, romaddr) ||
+			    image_blank(area_image(area, romaddr - area->start),
+					area->size))
+				continue;
+			sum += 0xff * area->size -
+				image_sum(area_image(area, romaddr - area->start),
+					  area->size);
+		}
+	}
+	if (sum != target && arealist->journal &&
+	    (romaddr = inflight_page(arealist)) != 0xffffffff) {
+		/* last page written but not acknowledged */
+		area = lookup_area(arealist, romaddr);
+		if (sum + image_sum(area_image(area, romaddr - area->start),
+				    area->size) - 0xff * area->size == target) {
+			VERBOSE_PRINT("page %08x written without ack\n",
+				      romaddr);
+			journal_ack(arealist->journal, romaddr);
+			sum = target;
+		}
+	}
+	if (sum != target) {
+		fprintf(stderr, PROGNAME ": verify %08x - %08x failed "
+			"(target %08x / image %08x)\n",
+			arealist->area[0].start,
+			arealist->area[arealist->areas - 1].end,
+			target, sum);
+		return -1;
+	}
+	VERBOSE_PRINT("checksum %08x\n", sum);
 	return 0;
 }
 
 /* connect to target chip */
-static int setup_connection(struct port_t *p, int input_freq, char endian)
+static int setup_connection(struct comm_t *com, struct port_t *p,
+			    int input_freq, char endian)
 {
 	int c;
 	int r = -1;
@@ -652,6 +970,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	struct freqlist_t   *freqlist   = NULL;
 
 	/* query target infomation */
+	prof_phase(p, "setup.device");
 	devicelist = get_devicelist(p);
 	if (devicelist == NULL) {
 		if (errno != 0)
@@ -671,6 +990,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	}
 
 	/* query target clockmode */
+	prof_phase(p, "setup.clockmode");
 	clockmode = get_clockmode(p);
 	if (clockmode == NULL) {
 		if (errno != 0)
@@ -691,6 +1011,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	}
 	
 	/* SELDEV devicetype select */
+	prof_phase(p, "setup.select");
 	if (devicelist->numdevs < SELDEV) {
 		fprintf(stderr, "Select Device (%d) not supported.\n", SELDEV);
 		goto error;
@@ -699,6 +1020,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 		fputs("device select error", stderr);
 		goto error;
 	}
+	memcpy(V1(com)->device_code, devicelist->devs[SELDEV].code, 4);
 
 	/* SELCLK clockmode select */
 	if (clockmode->nummode > 0) {
@@ -718,6 +1040,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	}
 
 	/* query multiplier/devider rate */
+	prof_phase(p, "setup.multirate");
 	multilist = get_multirate(p);
 	if (multilist == NULL) {
 		if (errno != 0)
@@ -738,6 +1061,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	}
 
 	/* query operation frequency range */
+	prof_phase(p, "setup.frequency");
 	freqlist = get_freqlist(p);
 	if (freqlist == NULL) {
 		if (errno != 0)
@@ -756,6 +1080,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	}
 
 	/* set writeing bitrate */
+	prof_phase(p, "bitrate");
 	if (!change_bitrate(p, input_freq, multilist, freqlist)) {
 		fputs("set bitrate failed\n",stderr);
 		goto error;
@@ -771,7 +1096,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 }
 
 /* connect to target chip */
-static void dump_configs(struct port_t *p)
+static void dump_configs(struct comm_t *com, struct port_t *p)
 {
 	struct devicelist_t *devicelist = NULL;
 	struct clockmode_t  *clockmode  = NULL;
@@ -854,14 +1179,98 @@ error:
 	free(clockmode);
 }	
 
-static struct comm_t v1 = {
+static const char *target_id(struct comm_t *com)
+{
+	return V1(com)->device_code;
+}
+
+/* harmless inquiry in current state */
+static int keepalive(struct comm_t *com, struct port_t *port)
+{
+	unsigned char buf[255+3];
+	unsigned char cmd;
+
+	if (!V1(com)->writemode) {
+		cmd = QUERY_DEVICE;
+		return transfer(port, &cmd, 1, buf, sizeof(buf),
+				RETRY_ANY) < 0 ? -1 : 0;
+	}
+	cmd = SUMCHECK_USER;
+	return (transfer(port, &cmd, 1, buf, sizeof(buf), RETRY_ANY) != 4 ||
+		buf[0] != SUMCHECK_USER_RES) ? -1 : 0;
+}
+
+static int identify(struct comm_t *com, struct port_t *port)
+{
+	struct devicelist_t *devicelist;
+
+	devicelist = get_devicelist(port);
+	if (devicelist == NULL || devicelist->numdevs <= SELDEV) {
+		free(devicelist);
+		return -1;
+	}
+	memcpy(V1(com)->device_code, devicelist->devs[SELDEV].code, 4);
+	free(devicelist);
+	return 0;
+}
+
+/* write_rom traffic: writemode (erase all), mat select, pages, end */
+static void plan_rom(struct comm_t *com, struct arealist_t *arealist,
+		     struct wire_t *w)
+{
+	unsigned int romaddr;
+	struct area_t *area;
+	int i;
+
+	w->erase = ERASE_ALL;
+	wire_frame(w, 1, 1);
+	wire_frame(w, 1, 1);
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		w->maxdata = area->size;
+		for (romaddr = area->start; romaddr < area->end;
+		     romaddr += area->size) {
+			if (image_blank(area_image(area, romaddr - area->start),
+					area->size) ||
+			    journal_done(arealist->journal, romaddr))
+				continue;
+			/* command, address, data, sum */
+			wire_frame(w, 5 + area->size + 1, 1);
+			w->units++;
+			w->payload += area->size;
+		}
+	}
+	wire_frame(w, 5 + 1, 1);
+	w->window = 1;
+}
+
+static void comm_close(struct comm_t *com)
+{
+	free(com);
+}
+
+static const struct comm_t v1 = {
+	.name = "v1",
 	.get_arealist = get_arealist,
 	.write_rom = write_rom,
 	.setup_connection = setup_connection,
 	.dump_configs = dump_configs,
+	.verify_rom = verify_rom,
+	.read_rom = read_rom,
+	.target_id = target_id,
+	.identify = identify,
+	.keepalive = keepalive,
+	.plan_rom = plan_rom,
+	.close = comm_close,
 };
 
 struct comm_t *comm_v1(void)
 {
-	return &v1;
+	struct v1_t *com;
+
+	com = calloc(1, sizeof(struct v1_t));
+	if (com == NULL)
+		return NULL;
+	com->comm = v1;
+	return &com->comm;
 }
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <ctype.h>
 #include "h8flash.h"
 
@@ -29,6 +30,16 @@
 #define ETB 0x17
 #define SOD 0x81
 
+struct v2_t {
+	struct comm_t comm;
+	/* device type code */
+	char device_type[17];
+	/* read packet buffer */
+	unsigned char rcv[65536 + 6];
+};
+
+#define V2(c) ((struct v2_t *)(c))
+
 /* big endian to cpu endian convert 32bit */
 static __inline__ int getlong(uint32_t *p)
 {
@@ -59,17 +70,18 @@ static __inline__ void setword(unsigned char *buf, unsigned short val)
 	*(buf + 1) = (val      ) & 0xff;
 }
 
-/* send multibyte command */
-static void send(struct port_t *p, unsigned char *data, int len,
-		 unsigned char head, unsigned char tail)
+/* send multibyte command. 0: sent -1: port error */
+static int send(struct port_t *p, unsigned char *data, int len,
+		unsigned char head, unsigned char tail)
 {
 	unsigned char buf[2];
 	unsigned char sum;
+	int r;
 	
-	p->send_data(&head, 1);
 	setword(buf, len);
-	p->send_data(buf, 2);
-	p->send_data(data, len);
+	r = p->send_data(p, &head, 1) != 1 ||
+		p->send_data(p, buf, 2) != 2 ||
+		p->send_data(p, data, len) != len;
 	if (len > 0) {
 		for(sum = 0; len > 0; len--, data++)
 			sum += *data;
@@ -77,12 +89,14 @@ static void send(struct port_t *p, unsigned char *data, int len,
 	sum += buf[0];
 	sum += buf[1];
 	sum = 0x100 - sum;
-	p->send_data(&sum, 1);
-	p->send_data(&tail, 1);
+	if (r || p->send_data(p, &sum, 1) != 1 ||
+	    p->send_data(p, &tail, 1) != 1)
+		return -1;
+	return 0;
 }
 
 /* receive answer */
-static unsigned int receive(struct port_t *p, unsigned char *data)
+static int receive(struct port_t *p, unsigned char *data, int size)
 {
 	int len;
 	unsigned char *rxptr;
@@ -91,22 +105,24 @@ static unsigned int receive(struct port_t *p, unsigned char *data)
 	rxptr = data;
 	/* Header */
 	for (len = 0; len < 3; len++) {
-		if (p->receive_byte(rxptr) != 1)
+		if (p->receive_byte(p, rxptr) != 1)
 			return -1;
 		rxptr++;
 	}
 
 	/* Res + Data */
 	len = getword((uint16_t *)(data + 1));
+	if (*data != SOD || len == 0 || len + 5 > size)
+		return -1;
 	for(; len > 0; len--) {
-		if (p->receive_byte(rxptr) != 1)
+		if (p->receive_byte(p, rxptr) != 1)
 			return -1;
 		rxptr++;
 	}
 
 	/* SUM + ETX/ETB */
 	for (len = 0; len < 2; len++) {
-		if (p->receive_byte(rxptr) != 1)
+		if (p->receive_byte(p, rxptr) != 1)
 			return -1;
 		rxptr++;
 	}
@@ -120,6 +136,95 @@ static unsigned int receive(struct port_t *p, unsigned char *data)
 	return *(data + 3);
 }
 
+/* error status */
+#define STS_PACKET   0xc2
+#define STS_SUMERR   0xc3
+
+/* retry policy */
+#define RETRY_NONE   0	/* state changing frame */
+#define RETRY_SUMERR 1	/* retry only target rejected frame */
+#define RETRY_ANY    2	/* idempotent frame */
+
+#define FAILED(r) ((r) < 0 || ((r) & 0x80))
+
+static const struct {
+	unsigned char code;
+	const char *msg;
+} sts_messages[] = {
+	{0xc1, "unsupported command"},
+	{0xc2, "packet error"},
+	{0xc3, "checksum error"},
+	{0xc4, "flow error"},
+	{0xd0, "address error"},
+	{0xd4, "bitrate margin error"},
+	{0xda, "protection error"},
+	{0xdb, "ID mismatch"},
+	{0xdc, "serial programming disabled"},
+	{0xe1, "erase error"},
+	{0xe2, "write error"},
+	{0xe7, "sequencer error"},
+};
+
+/* print error status */
+static void sts_report(int r, unsigned char *res)
+{
+	int i;
+
+	if (r < 0) {
+		fputs(" (no answer)\n", stderr);
+		return;
+	}
+	for (i = 0; i < sizeof(sts_messages) / sizeof(sts_messages[0]); i++)
+		if (sts_messages[i].code == res[4]) {
+			fprintf(stderr, " (%s)\n", sts_messages[i].msg);
+			return;
+		}
+	fprintf(stderr, " (error %02x)\n", res[4]);
+}
+
+/* wait before retry and discard rest of broken frame */
+static void retry_wait(struct port_t *p, int count)
+{
+	p->stats.retries++;
+	progress_retry(p);
+	port_sleep(p, RETRY_WAIT << count);
+	if (p->flush)
+		p->flush(p);
+}
+
+/* send frame and receive answer. retry recoverable error */
+static int transfer(struct port_t *p, unsigned char *data, int len,
+		    unsigned char head, unsigned char tail,
+		    unsigned char *res, int size, int retry)
+{
+	int count;
+	int r;
+
+	for (count = 0;; count++) {
+		/* port error is not recoverable */
+		if (send(p, data, len, head, tail) < 0)
+			return -1;
+		p->stats.frames++;
+		r = receive(p, res, size);
+		if (r < 0) {
+			/* timeout or broken answer */
+			p->stats.errors++;
+			if (retry < RETRY_ANY)
+				return r;
+		} else if (r & 0x80) {
+			p->stats.naks++;
+			if (retry < RETRY_SUMERR ||
+			    (res[4] != STS_SUMERR && res[4] != STS_PACKET))
+				return r;
+		} else
+			return r;
+		if (count >= RETRY_COUNT)
+			return r;
+		VERBOSE_PRINT("retry command %02x\n", data[0]);
+		retry_wait(p, count);
+	}
+}
+
 struct raw_devtype_t {
 	uint8_t  sod;
 	uint16_t len;
@@ -147,11 +252,11 @@ static  int get_devtype(struct port_t *port, struct devtype_t *type)
 	struct raw_devtype_t raw_type;
 	unsigned char cmd[] = {0x38};
 
-	send(port, cmd, 1, SOH, ETX);
-	if (receive(port, (unsigned char *)&raw_type) == -1)
+	if (FAILED(transfer(port, cmd, 1, SOH, ETX, (unsigned char *)&raw_type,
+			    sizeof(raw_type), RETRY_ANY)))
 		return -1;
-	send(port, cmd, 1, SOD, ETX);
-       	if (receive(port, (unsigned char *)&raw_type) == -1)
+	if (FAILED(transfer(port, cmd, 1, SOD, ETX, (unsigned char *)&raw_type,
+			    sizeof(raw_type), RETRY_ANY)))
 		return -1;
 	if (raw_type.res != 0x38)
 		return -1;
@@ -170,8 +275,9 @@ static int set_endian(struct port_t *port, unsigned int endian)
 	unsigned char rcv[8];
 
 	cmd[1] = endian;
-	send(port, cmd, 2, SOH, ETX);
-	return receive(port, rcv);
+	if (FAILED(transfer(port, cmd, 2, SOH, ETX, rcv, sizeof(rcv), RETRY_ANY)))
+		return -1;
+	return 0;
 }
 
 struct raw_freq_t {
@@ -192,11 +298,11 @@ static int set_frequency(struct port_t *port, unsigned int input, unsigned int s
 	unsigned int core, peripheral;
 	setlong(cmd + 1, input);
 	setlong(cmd + 5, system);
-	send(port, cmd, sizeof(cmd), SOH, ETX);
-	if (receive(port, (unsigned char *)&freq) == -1)
+	if (FAILED(transfer(port, cmd, sizeof(cmd), SOH, ETX,
+			    (unsigned char *)&freq, sizeof(freq), RETRY_ANY)))
 		return -1;
-	send(port, cmd, 1, SOD, ETX);
-       	if (receive(port, (unsigned char *)&freq) == -1)
+	if (FAILED(transfer(port, cmd, 1, SOD, ETX,
+			    (unsigned char *)&freq, sizeof(freq), RETRY_ANY)))
 		return -1;
 	core = getlong(&freq.fq);
 	peripheral = getlong(&freq.pf);
@@ -230,18 +336,18 @@ static int adjust_bitrate(int p_freq)
 static int set_bitrate(struct port_t *p, int bitrate)
 {
 	unsigned char cmd[] = {0x34, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rcv[6];
+	unsigned char rcv[8];
 	setlong(cmd + 1, bitrate);
-	send(p, cmd, sizeof(cmd), SOH, ETX);
-	if (receive(p, rcv) != 0x34)
+	if (transfer(p, cmd, sizeof(cmd), SOH, ETX, rcv, sizeof(rcv),
+		     RETRY_SUMERR) != 0x34)
 		return 0;
 
 	if (p->setbaud) {
-		if (!p->setbaud(bitrate / 100))
+		if (!p->setbaud(p, bitrate / 100))
 			return 0;
 
 	}
-	usleep(10000);
+	port_sleep(p, p->settle);
 	return 1;
 }
 
@@ -270,9 +376,9 @@ static int change_bitrate(struct port_t *p, int peripheral_freq)
 static int syncro(struct port_t *p)
 {
 	unsigned char cmd[] = {0x00};
-	unsigned char rcv[6];
-	send(p, cmd, sizeof(cmd), SOH, ETX);
-	return receive(p, rcv) == 0x00;
+	unsigned char rcv[8];
+	return transfer(p, cmd, sizeof(cmd), SOH, ETX, rcv, sizeof(rcv),
+			RETRY_ANY) == 0x00;
 }
 
 struct raw_signature_t {
@@ -290,7 +396,8 @@ struct raw_signature_t {
 } __attribute__((packed,aligned(1)));
 
 /* get target rom mapping */
-static struct arealist_t *get_arealist(struct port_t *p, enum mat_t mat)
+static struct arealist_t *get_arealist(struct comm_t *com, struct port_t *p,
+				       enum mat_t mat)
 {
 	unsigned char cmd[] = {0x3a};
 	struct raw_signature_t raw_sig;
@@ -300,11 +407,11 @@ static struct arealist_t *get_arealist(struct port_t *p, enum mat_t mat)
 	unsigned int addr = 0;
 	struct arealist_t *arealist;
 
-	send(p, cmd, 1, SOH, ETX);
-	if (receive(p, (unsigned char *)&raw_sig) < 0)
+	if (FAILED(transfer(p, cmd, 1, SOH, ETX, (unsigned char *)&raw_sig,
+			    sizeof(raw_sig), RETRY_ANY)))
 		return NULL;
-	send(p, cmd, 1, SOD, ETX);
-	if (receive(p, (unsigned char *)&raw_sig) < 0)
+	if (FAILED(transfer(p, cmd, 1, SOD, ETX, (unsigned char *)&raw_sig,
+			    sizeof(raw_sig), RETRY_ANY)))
 		return NULL;
 	
 	/* lookup area */
@@ -312,11 +419,12 @@ static struct arealist_t *get_arealist(struct port_t *p, enum mat_t mat)
 		if (raw_sig.bank[i].type == id[mat])
 			numarea += getword(&raw_sig.bank[i].num);
 	}
-	arealist = (struct arealist_t *)malloc(sizeof(struct arealist_t) + 
+	arealist = (struct arealist_t *)calloc(1, sizeof(struct arealist_t) + 
                                                sizeof(struct area_t) * numarea);
 	if (arealist == NULL)
 		return NULL;
 
+	arealist->journal = NULL;
 	arealist->areas = numarea;
 	/* setup area list*/
 	for(numarea = 0, i = 0; i < 6; i++) {
@@ -339,95 +447,221 @@ static struct arealist_t *get_arealist(struct port_t *p, enum mat_t mat)
 	return arealist;
 }
 
-/* check blank page */
-static int skipcheck(unsigned char *data, unsigned short size)
-{
-	unsigned char r = 0xff;
-	int c;
-	for (c = 0; c < size; c++)
-		r &= *data++;
-	return (r == 0xff);
-}
-
 /* write rom image */
-static int write_rom(struct port_t *port, struct arealist_t *arealist, enum mat_t mat)
+static int write_rom(struct comm_t *com, struct port_t *port,
+		     struct arealist_t *arealist, enum mat_t mat)
 {
 	uint8_t erase[] = {0x12, 0x00, 0x00, 0x00, 0x00};
 	uint8_t write[] = {0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	uint8_t data[257];
 	unsigned char rcv[8];
-	unsigned int wsize, total;
+	unsigned int total;
 	int i, j, r;
 	struct area_t *area;
+	/* bytes to write */
 	for (total = 0, i = 0; i < arealist->areas; i++) {
-		total += arealist->area[i].size;
+		area = &arealist->area[i];
+		if (!image_blank(area_image(area, 0), area->size) &&
+		    !journal_done(arealist->journal, area->start))
+			total += area->size;
 	}
+	progress_start(port, "writing", total);
 	/* writing loop */
-	for (wsize = 0, i = 0; i < arealist->areas; i++) {
+	for (i = 0; i < arealist->areas; i++) {
 		area = &arealist->area[i];
-		if (skipcheck(area->image, area->size)) {
-			wsize += area->size;
+		if (image_blank(area_image(area, 0), area->size) ||
+		    journal_done(arealist->journal, area->start)) {
 			if (verbose)
 				printf("skip - %08x\n",area->start);
-			else {
-				printf("writing %d/%d byte\r",
-				       wsize, 
-				       total); 
-				fflush(stdout);
-			}
 			continue;
 		}
+		prof_phase(port, "erase");
 		setlong(erase + 1, area->start);
-		send(port, erase, sizeof(erase), SOH, ETX);
-		if ((r=receive(port, rcv)) > 0x80) {
+		r = transfer(port, erase, sizeof(erase), SOH, ETX,
+			     rcv, sizeof(rcv), RETRY_ANY);
+		if (FAILED(r)) {
+			fprintf(stderr, PROGNAME ": erase %08x failed", area->start);
+			sts_report(r, rcv);
 			return -1;
 		}
+		prof_phase(port, "write");
 		setlong(write + 1, area->start);
 		setlong(write + 5, area->end);
-		send(port, write, sizeof(write), SOH, ETX);
-		if (receive(port, rcv) > 0x80)
+		r = transfer(port, write, sizeof(write), SOH, ETX,
+			     rcv, sizeof(rcv), RETRY_SUMERR);
+		if (FAILED(r)) {
+			fprintf(stderr, PROGNAME ": write %08x failed", area->start);
+			sts_report(r, rcv);
 			return -1;
+		}
 		for(j = 0; j < area->size / 256; j++) {
 			data[0] = 0x13;
 			memcpy(&data[1],
-			       area->image + j * (sizeof(data) - 1),
+			       area_image(area, j * (sizeof(data) - 1)),
 			       sizeof(data) -1);
-			if (j < (area->size / 256 -1))
-				send(port, data, sizeof(data), SOD, ETB);
-			else
-				send(port, data, sizeof(data), SOD, ETX);
-			if ((r = receive(port, rcv)) > 0x80) {
+			r = transfer(port, data, sizeof(data), SOD,
+				     (j < (area->size / 256 -1)) ? ETB : ETX,
+				     rcv, sizeof(rcv), RETRY_SUMERR);
+			if (FAILED(r)) {
+				fprintf(stderr, PROGNAME ": write data %08x failed",
+					area->start + j * 256);
+				sts_report(r, rcv);
 				return -1;
 			}
 		}
-		wsize += area->size;
+		journal_ack(arealist->journal, area->start);
 		if (verbose)
 			printf("write - %08x\n", area->start);
-		else {
-			printf("writing %d/%d byte\r",
-			       wsize, 
-			       total); 
-			fflush(stdout);
-		}
+		progress_step(port, area->start, area->size);
 	}
-	if (!verbose)
-		putc('\n', stdout);
+	progress_end(port);
+
+	return 0;
+}
 
+/* read rom data */
+static int read_rom(struct comm_t *com, struct port_t *port, enum mat_t mat,
+		    unsigned int addr, unsigned int size, unsigned char *buf)
+{
+	uint8_t cmd[] = {0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char *rcv = V2(com)->rcv;
+	unsigned int len, pos;
+	unsigned char tail;
+	int count = 0;
+	int r;
+
+	for (pos = 0; pos < size;) {
+		/* (re)start read from current position */
+		setlong(cmd + 1, addr + pos);
+		setlong(cmd + 5, addr + size - 1);
+		r = -1;
+		if (send(port, cmd, sizeof(cmd), SOH, ETX) < 0)
+			goto error;
+		port->stats.frames++;
+		for (;;) {
+			r = receive(port, rcv, sizeof(V2(com)->rcv));
+			if (r != 0x15)
+				break;
+			len = getword((uint16_t *)(rcv + 1)) - 1;
+			tail = rcv[len + 5];
+			if (len > size - pos) {
+				r = -1;
+				break;
+			}
+			memcpy(buf + pos, rcv + 4, len);
+			pos += len;
+			if (verbose)
+				printf("read - %08x\n", addr + pos - len);
+			progress_step(port, addr + pos - len, len);
+			if (tail == ETX)
+				break;
+			/* request next packet */
+			r = -1;
+			if (send(port, cmd, 1, SOD, ETX) < 0)
+				goto error;
+			port->stats.frames++;
+		}
+		if (pos == size)
+			break;
+		if (r < 0)
+			port->stats.errors++;
+		else if (r & 0x80) {
+			port->stats.naks++;
+			if (rcv[4] != STS_SUMERR && rcv[4] != STS_PACKET)
+				goto error;
+		}
+		if (count >= RETRY_COUNT)
+			goto error;
+		VERBOSE_PRINT("retry read %08x\n", addr + pos);
+		retry_wait(port, count++);
+	}
 	return 0;
+ error:
+	fprintf(stderr, PROGNAME ": read %08x - %08x failed",
+		addr, addr + size - 1);
+	sts_report(r, rcv);
+	return -1;
+}
+
+struct raw_crc_t {
+	uint8_t  sod;
+	uint16_t len;
+	uint8_t  res;
+	uint32_t crc;
+	uint8_t  sum;
+	uint8_t  etx;
+} __attribute__((packed,aligned(1)));
+
+/* compare target CRC with image per written range */
+static int verify_rom(struct comm_t *com, struct port_t *port,
+		      struct arealist_t *arealist, enum mat_t mat)
+{
+	uint8_t cmd[] = {0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	struct raw_crc_t raw_crc;
+	struct area_t *area;
+	unsigned int start, end, crc, target;
+	int i;
+	int r = 0;
+
+	/* arealist is ordered from top address */
+	for (i = arealist->areas - 1; i >= 0; i--) {
+		area = &arealist->area[i];
+		if (image_blank(area_image(area, 0), area->size) ||
+		    (arealist->journal &&
+		     !journal_done(arealist->journal, area->start)))
+			continue;
+		/* join continuous written blocks */
+		start = area->start;
+		crc = area_crc(area);
+		for (; i > 0; i--) {
+			area = &arealist->area[i - 1];
+			if (area->start != arealist->area[i].end + 1 ||
+			    image_blank(area_image(area, 0), area->size) ||
+			    (arealist->journal &&
+			     !journal_done(arealist->journal, area->start)))
+				break;
+			crc = image_crc32_combine(crc, area_crc(area),
+						  area->size);
+		}
+		end = arealist->area[i].end;
+
+		setlong(cmd + 1, start);
+		setlong(cmd + 5, end);
+		if (transfer(port, cmd, sizeof(cmd), SOH, ETX,
+			     (unsigned char *)&raw_crc, sizeof(raw_crc),
+			     RETRY_ANY) != 0x18) {
+			fprintf(stderr, PROGNAME ": CRC check %08x - %08x failed\n",
+				start, end);
+			return -1;
+		}
+		target = getlong(&raw_crc.crc);
+		if (target != crc) {
+			fprintf(stderr, PROGNAME ": verify %08x - %08x failed "
+				"(target %08x / image %08x)\n",
+				start, end, target, crc);
+			r = -1;
+		} else
+			VERBOSE_PRINT("%08x - %08x crc %08x\n", start, end, crc);
+	}
+	return r;
 }
 
 /* connect to target chip */
-static int setup_connection(struct port_t *p, int input_freq, char endian)
+static int setup_connection(struct comm_t *com, struct port_t *p,
+			    int input_freq, char endian)
 {
 	struct devtype_t dt;
 	int e = -1;
 	int pf;
 
 	input_freq *= 10000;
+	prof_phase(p, "setup.device");
 	if(get_devtype(p, &dt) < 0) {
 		fputs("device type failed", stderr);
 		return -1;
 	}
+	snprintf(V2(com)->device_type, sizeof(V2(com)->device_type),
+		 "%016" PRIx64, dt.typ);
 	switch(toupper(endian)) {
 	case 'L':
 		e = 1;
@@ -436,23 +670,27 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 		e = 0;
 		break;
 	}
+	prof_phase(p, "setup.endian");
 	if (e == -1 || set_endian(p, e) < 0) {
 		fputs("endian setup failed", stderr);
 		return -1;
 	}
 
+	prof_phase(p, "setup.frequency");
 	pf = set_frequency(p, input_freq, dt.cpa);
 	if (pf < 0) {
 		fputs("frequency setup failed", stderr);
 		return -1;
 	}
 		
-	/* set writeing bitrate */
-	if (!change_bitrate(p, pf)) {
+	/* set writeing bitrate (USB boot interface has no bitrate) */
+	prof_phase(p, "bitrate");
+	if (p->type != usb && !change_bitrate(p, pf)) {
 		fputs("set bitrate failed\n",stderr);
 		return -1;
 	}
 
+	prof_phase(p, "setup.sync");
 	if (!syncro(p)) {
 		fputs("sync failed\n",stderr);
 		return -1;
@@ -461,7 +699,7 @@ static int setup_connection(struct port_t *p, int input_freq, char endian)
 	return 0;
 }
 
-static void dump_configs(struct port_t *p)
+static void dump_configs(struct comm_t *com, struct port_t *p)
 {
 	struct devtype_t dt;
 
@@ -469,21 +707,88 @@ static void dump_configs(struct port_t *p)
 		fputs("device type failed", stderr);
 		return;
 	}
-	printf("type code: %016llx\n", dt.typ);
+	printf("type code: %016" PRIx64 "\n", dt.typ);
 	printf("input max: %dHz\n", dt.osa);
 	printf("input min: %dHz\n", dt.osi);
 	printf("sys max: %dHz\n", dt.cpa);
 	printf("sys min: %dHz\n", dt.cpi);
 }	
 
-static struct comm_t v2 = {
+static const char *target_id(struct comm_t *com)
+{
+	return V2(com)->device_type;
+}
+
+static int keepalive(struct comm_t *com, struct port_t *port)
+{
+	return syncro(port) ? 0 : -1;
+}
+
+static int identify(struct comm_t *com, struct port_t *port)
+{
+	struct devtype_t dt;
+
+	if (get_devtype(port, &dt) < 0)
+		return -1;
+	snprintf(V2(com)->device_type, sizeof(V2(com)->device_type),
+		 "%016" PRIx64, dt.typ);
+	return 0;
+}
+
+/* write_rom traffic. frame: head, length(2), data, sum, tail
+   answer: head, length(2), res, sum, tail */
+static void plan_rom(struct comm_t *com, struct arealist_t *arealist,
+		     struct wire_t *w)
+{
+	struct area_t *area;
+	int i, j;
+
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		if (image_blank(area_image(area, 0), area->size) ||
+		    journal_done(arealist->journal, area->start))
+			continue;
+		/* erase, write start, data */
+		wire_frame(w, 5 + 5, 6);
+		wire_frame(w, 5 + 9, 6);
+		for (j = 0; j < area->size / 256; j++)
+			wire_frame(w, 5 + 257, 6);
+		w->erase++;
+		w->units++;
+		w->payload += area->size;
+	}
+	w->window = 1;
+	w->maxdata = 256;
+}
+
+static void comm_close(struct comm_t *com)
+{
+	free(com);
+}
+
+static const struct comm_t v2 = {
+	.name = "v2",
 	.get_arealist = get_arealist,
 	.write_rom = write_rom,
 	.setup_connection = setup_connection,
 	.dump_configs = dump_configs,
+	.verify_rom = verify_rom,
+	.read_rom = read_rom,
+	.target_id = target_id,
+	.identify = identify,
+	.keepalive = keepalive,
+	.plan_rom = plan_rom,
+	.close = comm_close,
+	.block_erase = 1,
 };
 
 struct comm_t *comm_v2(void)
 {
-	return &v2;
+	struct v2_t *com;
+
+	com = calloc(1, sizeof(struct v2_t));
+	if (com == NULL)
+		return NULL;
+	com->comm = v2;
+	return &com->comm;
 }
@@ -0,0 +1,332 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  boot session daemon
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * targets are connected once and held, jobs are sent over UNIX socket.
+ * one command per line, reply lines end with "ok" or "error <reason>".
+ *
+ *  status                          list targets
+ *  write <target> <file> [-b[base]] [-c]
+ *  verify <target>
+ *  dump <target> <file> [ranges]
+ *  keepalive [target]              inquiry to hold boot session
+ *  cd <dir>                        base directory of file names
+ *  quit                            close connection
+ *  shutdown                        stop daemon
+ * target is index or port name.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "h8flash.h"
+#include "libh8flash.h"
+
+#define DAEMON_LINE 1024
+#define DAEMON_ARGS 8
+
+struct target_t {
+	struct h8flash *h;
+	const char *port;
+	const char *state;
+};
+
+static void reply(int fd, const char *fmt, ...)
+{
+	char buf[DAEMON_LINE];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len > sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+	send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+static struct target_t *lookup(struct target_t *t, int n, const char *name)
+{
+	char *end;
+	int i;
+
+	if (name == NULL)
+		return NULL;
+	i = strtol(name, &end, 10);
+	if (*end == '\0')
+		return (i >= 0 && i < n && t[i].h) ? &t[i] : NULL;
+	for (i = 0; i < n; i++)
+		if (t[i].h && strcmp(t[i].port, name) == 0)
+			return &t[i];
+	return NULL;
+}
+
+/* write job. returns error reason or NULL */
+static const char *job_write(struct target_t *t, char **arg, int args)
+{
+	unsigned long base = 0;
+	int binary = 0, verify = 0;
+	int i;
+
+	for (i = 1; i < args; i++) {
+		if (strncmp(arg[i], "-b", 2) == 0) {
+			binary = 1;
+			base = strtoul(arg[i] + 2, NULL, 16);
+		} else if (strcmp(arg[i], "-c") == 0)
+			verify = 1;
+		else
+			return "bad option";
+	}
+	t->state = "write failed";
+	if (h8flash_load(t->h, arg[0], binary, base) < 0 ||
+	    h8flash_plan(t->h, NULL, 0, 0, 0, NULL) < 0)
+		return "load failed";
+	if (h8flash_write(t->h) < 0)
+		return "write failed";
+	if (verify && h8flash_verify(t->h) < 0) {
+		t->state = "verify failed";
+		return "verify failed";
+	}
+	t->state = "written";
+	return NULL;
+}
+
+/* one command. returns 1 close connection, 2 shutdown */
+static int command(int fd, char *line, struct target_t *t, int n)
+{
+	char *arg[DAEMON_ARGS + 1];
+	struct h8flash_stats stats;
+	struct target_t *tp;
+	const char *err = NULL;
+	int args, i;
+
+	for (args = 0, arg[0] = strtok(line, " \t\r\n");
+	     arg[args] && args < DAEMON_ARGS;
+	     arg[++args] = strtok(NULL, " \t\r\n"));
+	arg[args] = NULL;
+	if (args == 0)
+		return 0;
+	tp = lookup(t, n, arg[1]);
+
+	if (strcmp(arg[0], "status") == 0) {
+		for (i = 0; i < n; i++) {
+			if (t[i].h == NULL) {
+				reply(fd, "%d %s - %s", i, t[i].port, t[i].state);
+				continue;
+			}
+			h8flash_stats(t[i].h, &stats);
+			reply(fd, "%d %s %s %s frames %lu retries %lu", i,
+			      t[i].port, h8flash_target(t[i].h), t[i].state,
+			      stats.frames, stats.retries);
+		}
+	} else if (strcmp(arg[0], "write") == 0) {
+		if (tp == NULL || args < 3)
+			err = "usage: write <target> <file> [-b[base]] [-c]";
+		else
+			err = job_write(tp, arg + 2, args - 2);
+	} else if (strcmp(arg[0], "verify") == 0) {
+		if (tp == NULL)
+			err = "usage: verify <target>";
+		else if (h8flash_verify(tp->h) < 0)
+			err = "verify failed";
+	} else if (strcmp(arg[0], "dump") == 0) {
+		if (tp == NULL || args < 3)
+			err = "usage: dump <target> <file> [ranges]";
+		else if (h8flash_dump(tp->h, arg[3], arg[2]) < 0)
+			err = "dump failed";
+	} else if (strcmp(arg[0], "keepalive") == 0) {
+		for (i = 0; i < n; i++) {
+			if (t[i].h == NULL || (tp && tp != &t[i]))
+				continue;
+			if (h8flash_keepalive(t[i].h) < 0) {
+				t[i].state = "no answer";
+				err = "keepalive failed";
+			}
+		}
+	} else if (strcmp(arg[0], "cd") == 0) {
+		if (arg[1] == NULL || chdir(arg[1]) < 0)
+			err = strerror(errno);
+	} else if (strcmp(arg[0], "quit") == 0) {
+		reply(fd, "ok");
+		return 1;
+	} else if (strcmp(arg[0], "shutdown") == 0) {
+		reply(fd, "ok");
+		return 2;
+	} else
+		err = "unknown command";
+
+	if (err)
+		reply(fd, "error %s", err);
+	else
+		reply(fd, "ok");
+	return 0;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un sa;
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, PROGNAME ": %s too long\n", path);
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto error;
+	/* stale socket */
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+		fprintf(stderr, PROGNAME ": daemon of %s is running\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		umask(mask);
+		goto error;
+	}
+	umask(mask);
+	if (listen(fd, 4) < 0)
+		goto error;
+	return fd;
+ error:
+	perror(path);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/* connect all targets and serve jobs */
+int daemon_main(const char *path, char **ports, int n,
+		const struct h8flash_config *config)
+{
+	struct target_t *t;
+	char line[DAEMON_LINE];
+	FILE *fp;
+	int lfd, fd;
+	int i, r = 0;
+
+	t = calloc(n, sizeof(struct target_t));
+	if (t == NULL)
+		return -1;
+	lfd = listen_socket(path);
+	if (lfd < 0) {
+		free(t);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		t[i].port = ports[i];
+		t[i].state = "connect failed";
+		t[i].h = h8flash_open(ports[i]);
+		if (t[i].h && h8flash_connect(t[i].h, config) < 0) {
+			h8flash_close(t[i].h);
+			t[i].h = NULL;
+		}
+		if (t[i].h)
+			t[i].state = "connected";
+	}
+	printf("listening %s\n", path);
+	fflush(stdout);
+
+	while (r < 2) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(path);
+			break;
+		}
+		fp = fdopen(fd, "r");
+		if (fp == NULL) {
+			close(fd);
+			continue;
+		}
+		for (r = 0; r == 0 && fgets(line, sizeof(line), fp); )
+			r = command(fd, line, t, n);
+		fclose(fp);
+	}
+
+	for (i = 0; i < n; i++)
+		h8flash_close(t[i].h);
+	close(lfd);
+	unlink(path);
+	free(t);
+	return 0;
+}
+
+/* send command to daemon. print replies */
+int daemon_ctl(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un sa;
+	char line[DAEMON_LINE];
+	char cwd[FILENAME_MAX];
+	FILE *fp;
+	int fd, i, len;
+	int r = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	/* file names are relative to client */
+	len = 0;
+	cwd[0] = '\0';
+	if (getcwd(cwd, sizeof(cwd)))
+		len = snprintf(line, sizeof(line), "cd %s\n", cwd);
+	for (i = 0; i < argc && len < sizeof(line) - 1; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%s%s",
+				argv[i], (i < argc - 1) ? " " : "\n");
+	fp = fdopen(fd, "r");
+	if (fp == NULL || send(fd, line, len, MSG_NOSIGNAL) != len) {
+		perror(path);
+		goto error;
+	}
+	/* skip reply of cd */
+	if (cwd[0] == '/' && fgets(line, sizeof(line), fp) == NULL)
+		goto error;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strcmp(line, "ok\n") == 0) {
+			r = 0;
+			break;
+		}
+		fputs(line, stdout);
+		if (strncmp(line, "error", 5) == 0)
+			break;
+	}
+ error:
+	if (fp)
+		fclose(fp);
+	else
+		close(fd);
+	return r;
+}
@@ -0,0 +1,288 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  rom dump
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "h8flash.h"
+
+/* S-record data bytes per line */
+#define SREC_BYTES 32
+/* "S3" + len + addr + data + sum + "\n" */
+#define SREC_LINE(n) (2 + 2 + 8 + (n) * 2 + 2 + 1)
+#define SREC_HEAD "S0030000FC\n"
+#define SREC_TAIL "S70500000000FA\n"
+
+struct range_t {
+	unsigned int start;
+	unsigned int end;
+};
+
+static const char hex[] = "0123456789ABCDEF";
+
+static int is_srec(const char *fn)
+{
+	const static char *ext[] = {".mot", ".srec", ".s37", ".s28", ".s19", NULL};
+	const char *p = strrchr(fn, '.');
+	int i;
+
+	if (p == NULL)
+		return 0;
+	for (i = 0; ext[i]; i++)
+		if (strcasecmp(p, ext[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* parse "start-end[,start-end...]" */
+static int parse_ranges(const char *arg, struct range_t **ranges)
+{
+	struct range_t *range;
+	const char *s;
+	char *p;
+	int n;
+
+	for (n = 1, s = arg; *s; s++)
+		n += (*s == ',');
+	range = *ranges = calloc(n, sizeof(struct range_t));
+	if (range == NULL)
+		return -1;
+	for (n = 0; *arg; n++) {
+		range[n].start = strtoul(arg, &p, 16);
+		if (*p != '-')
+			return -1;
+		range[n].end = strtoul(p + 1, &p, 16);
+		if (range[n].end < range[n].start)
+			return -1;
+		if (*p == ',')
+			p++;
+		else if (*p != '\0')
+			return -1;
+		arg = p;
+	}
+	return n;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range_t *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* whole MAT: one range per contiguous region in address order */
+static int area_ranges(struct arealist_t *arealist, struct range_t **ranges)
+{
+	struct range_t *range;
+	size_t total = 0, len = 0;
+	int i, n;
+
+	range = *ranges = calloc(arealist->areas, sizeof(struct range_t));
+	if (range == NULL || arealist->areas == 0)
+		return -1;
+	for (i = 0; i < arealist->areas; i++) {
+		range[i].start = arealist->area[i].start;
+		range[i].end = arealist->area[i].end;
+		total += AREA_LEN(&arealist->area[i]);
+	}
+	qsort(range, arealist->areas, sizeof(struct range_t), range_cmp);
+	for (n = 0, i = 1; i < arealist->areas; i++) {
+		if (range[n].end != 0xffffffff &&
+		    range[n].end + 1 == range[i].start)
+			range[n].end = range[i].end;
+		else
+			range[++n] = range[i];
+	}
+	n++;
+	for (i = 0; i < n; i++)
+		len += range[i].end - range[i].start + 1;
+	if (len != total) {
+		fputs(PROGNAME ": overlapped rom areas, "
+		      "can't dump whole MAT\n", stderr);
+		return -1;
+	}
+	return n;
+}
+
+/* split range into rom areas and read */
+static int read_range(struct comm_t *com, struct port_t *port,
+		      struct arealist_t *arealist, enum mat_t mat,
+		      struct range_t *range, unsigned char *buf)
+{
+	unsigned int addr, end;
+	struct area_t *area;
+	int i;
+
+	for (addr = range->start; addr <= range->end; addr = end + 1) {
+		for (area = NULL, i = 0; i < arealist->areas; i++)
+			if (arealist->area[i].start <= addr &&
+			    arealist->area[i].end >= addr)
+				area = &arealist->area[i];
+		if (area == NULL) {
+			fprintf(stderr, "%08x is out of ROM.\n", addr);
+			return -1;
+		}
+		end = area->end < range->end ? area->end : range->end;
+		if (com->read_rom(com, port, mat, addr, end - addr + 1, buf) < 0)
+			return -1;
+		buf += end - addr + 1;
+		if (end == 0xffffffff)
+			break;
+	}
+	return 0;
+}
+
+static char *put_hex(char *p, unsigned int val, int digits)
+{
+	while (digits-- > 0)
+		*p++ = hex[(val >> (digits * 4)) & 0x0f];
+	return p;
+}
+
+/* format S3 records */
+static char *put_srec(char *p, unsigned int addr,
+		      const unsigned char *data, unsigned int size)
+{
+	unsigned int n, i;
+	unsigned char sum;
+
+	for (; size > 0; size -= n, addr += n) {
+		n = size < SREC_BYTES ? size : SREC_BYTES;
+		sum = n + 5;
+		sum += (addr >> 24) + (addr >> 16) + (addr >> 8) + addr;
+		*p++ = 'S';
+		*p++ = '3';
+		p = put_hex(p, n + 5, 2);
+		p = put_hex(p, addr, 8);
+		for (i = 0; i < n; i++) {
+			p = put_hex(p, *data, 2);
+			sum += *data++;
+		}
+		p = put_hex(p, ~sum & 0xff, 2);
+		*p++ = '\n';
+	}
+	return p;
+}
+
+static size_t srec_size(unsigned int size)
+{
+	return (size / SREC_BYTES) * SREC_LINE(SREC_BYTES) +
+		((size % SREC_BYTES) ? SREC_LINE(size % SREC_BYTES) : 0);
+}
+
+/* read rom and save to file */
+int dump_rom(struct comm_t *com, struct port_t *port,
+	     struct arealist_t *arealist, enum mat_t mat,
+	     const char *ranges, const char *fn)
+{
+	struct range_t *range = NULL;
+	struct timeval start, end;
+	unsigned char *buf = NULL;
+	char *map = MAP_FAILED;
+	char *p;
+	size_t total, filesize;
+	unsigned int size;
+	int srec;
+	int nrange;
+	int fd = -1;
+	int i;
+	int r = -1;
+	long usec;
+
+	if (com->read_rom == NULL) {
+		fputs(PROGNAME ": dump not supported\n", stderr);
+		return -1;
+	}
+	if (ranges) {
+		nrange = parse_ranges(ranges, &range);
+		if (nrange <= 0) {
+			fprintf(stderr, PROGNAME ": illegal range %s\n", ranges);
+			goto error;
+		}
+	} else if ((nrange = area_ranges(arealist, &range)) <= 0)
+		goto error;
+
+	srec = is_srec(fn);
+	for (total = 0, filesize = 0, i = 0; i < nrange; i++) {
+		size = range[i].end - range[i].start + 1;
+		total += size;
+		filesize += srec ? srec_size(size) : size;
+	}
+	if (srec)
+		filesize += strlen(SREC_HEAD) + strlen(SREC_TAIL);
+
+	fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || ftruncate(fd, filesize) < 0)
+		goto error_perror;
+	map = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error_perror;
+
+	gettimeofday(&start, NULL);
+	progress_start(port, "reading", total);
+	p = map;
+	if (srec) {
+		memcpy(p, SREC_HEAD, strlen(SREC_HEAD));
+		p += strlen(SREC_HEAD);
+	}
+	for (i = 0; i < nrange; i++) {
+		size = range[i].end - range[i].start + 1;
+		if (srec) {
+			/* read to work buffer and format */
+			buf = realloc(buf, size);
+			if (buf == NULL)
+				goto error_perror;
+			if (read_range(com, port, arealist, mat,
+				       &range[i], buf) < 0)
+				goto error;
+			p = put_srec(p, range[i].start, buf, size);
+		} else {
+			/* read into file directly */
+			if (read_range(com, port, arealist, mat,
+				       &range[i], (unsigned char *)p) < 0)
+				goto error;
+			p += size;
+		}
+	}
+	if (srec)
+		memcpy(p, SREC_TAIL, strlen(SREC_TAIL));
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_usec - start.tv_usec);
+	if (usec <= 0)
+		usec = 1;
+	progress_end(port);
+	printf("read %zu byte %ld.%03ld sec (%lld byte/s)\n",
+	       total, usec / 1000000, (usec / 1000) % 1000,
+	       (long long)total * 1000000 / usec);
+	r = 0;
+	goto error;
+ error_perror:
+	perror(PROGNAME);
+ error:
+	if (map != MAP_FAILED)
+		munmap(map, filesize);
+	if (fd >= 0) {
+		close(fd);
+		/* no partial image */
+		if (r < 0)
+			unlink(fn);
+	}
+	free(range);
+	free(buf);
+	return r;
+}
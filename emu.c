@@ -0,0 +1,959 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  boot program emulator
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * target side of boot protocols on pseudo terminal.
+ * h8flash -p <printed pts> writes to in-memory flash model.
+ *   -1  old protocol (H8/SH)  -2  new protocol (RX)
+ *   -3  new protocol and RAM stub (--stub)
+ *   -U  USB boot interface (no bitrate adjust)
+ * flash: user area (-s size) and user boot area (-u size, old
+ * protocol only), erase block (-B), write unit (-w).
+ * erase / write time of each block / unit is -E / -W (us).
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+
+#define PROGNAME "h8flash-emu"
+
+#define ACK 0x06
+#define SOH 0x01
+#define SOD 0x81
+#define ETX 0x03
+#define ETB 0x17
+
+#define V2_READ_MAX 1024
+
+struct flash_t {
+	unsigned int base;
+	unsigned int size;
+	unsigned char *mem;
+};
+
+static struct flash_t user = {.size = 256 * 1024};
+static struct flash_t userboot = {.size = 8 * 1024};
+static unsigned int writesize = 128;
+static unsigned int blocksize = 4096;
+static int protocol = 1;
+static int erase_delay = 0;
+static int write_delay = 0;
+static int keep = 0;
+static int verbose = 0;
+
+/* inter byte timeout in frame (ms) */
+#define FRAME_TIMEOUT 1000
+
+static int fd;
+static unsigned char rxbuf[4096];
+static int rxcount, rxpos;
+static int rx_wait = -1;
+static int eof;
+static unsigned long corrupt, rxtotal;
+
+#define LOG(...) do { if (verbose) fprintf(stderr, __VA_ARGS__); } while(0)
+
+static int rx(void)
+{
+	struct pollfd pfd;
+
+	if (rxpos >= rxcount) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, rx_wait) == 0) {
+			LOG("frame timeout\n");
+			return -1;
+		}
+		do {
+			rxcount = read(fd, rxbuf, sizeof(rxbuf));
+		} while (rxcount < 0 && errno == EINTR);
+		if (rxcount <= 0) {
+			eof = 1;
+			return -1;
+		}
+		rxpos = 0;
+	}
+	rxtotal++;
+	if (corrupt && rxtotal > 64 && rxtotal % corrupt == 0) {
+		LOG("corrupt byte %lu\n", rxtotal);
+		return rxbuf[rxpos++] ^ 0x20;
+	}
+	return rxbuf[rxpos++];
+}
+
+static void tx(const unsigned char *buf, int len)
+{
+	int r;
+	while (len > 0) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return;
+		}
+		buf += r;
+		len -= r;
+	}
+}
+
+static unsigned int getlong(const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void setlong(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void setword(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static struct flash_t *lookup(unsigned int addr, unsigned int len)
+{
+	if (addr - user.base < user.size && len <= user.size - (addr - user.base))
+		return &user;
+	if (protocol == 1 && addr - userboot.base < userboot.size &&
+	    len <= userboot.size - (addr - userboot.base))
+		return &userboot;
+	return NULL;
+}
+
+static int program(unsigned int addr, const unsigned char *data, int len)
+{
+	struct flash_t *f = lookup(addr, len);
+	unsigned char *p;
+	int i;
+
+	if (f == NULL)
+		return -1;
+	p = f->mem + addr - f->base;
+	for (i = 0; i < len; i++)
+		if (p[i] != 0xff && data[i] != 0xff)
+			return -2;
+	for (i = 0; i < len; i++)
+		p[i] &= data[i];
+	if (write_delay)
+		usleep(write_delay);
+	return 0;
+}
+
+static void erase(struct flash_t *f, unsigned int addr, unsigned int len)
+{
+	memset(f->mem + addr - f->base, 0xff, len);
+	if (erase_delay)
+		usleep(erase_delay);
+}
+
+static unsigned int crc32(const unsigned char *p, unsigned int len)
+{
+	unsigned int crc = 0xffffffff;
+	int i;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/* ---- old protocol ---- */
+
+static void v1_reply(unsigned char *buf, int len)
+{
+	unsigned char sum = 0;
+	int i;
+	for (i = 0; i < len; i++)
+		sum += buf[i];
+	buf[len] = 0x100 - sum;
+	tx(buf, len + 1);
+}
+
+static void v1_ack(void)
+{
+	unsigned char c = ACK;
+	tx(&c, 1);
+}
+
+static void v1_nak(unsigned char res, unsigned char err)
+{
+	unsigned char buf[2] = {res, err};
+	tx(buf, 2);
+}
+
+/* read command body. returns body length or -1 on sum error */
+static int v1_body(unsigned char cmd, unsigned char *buf, int lenbytes)
+{
+	unsigned char sum = cmd;
+	int len, i, c;
+
+	for (len = 0, i = 0; i < lenbytes; i++) {
+		if ((c = rx()) < 0)
+			return -2;
+		sum += c;
+		len = (len << 8) | c;
+	}
+	for (i = 0; i <= len; i++) {
+		if ((c = rx()) < 0)
+			return -2;
+		buf[i] = c;
+		sum += c;
+	}
+	return sum == 0 ? len : -1;
+}
+
+static unsigned int sum_of(const unsigned char *p, unsigned int len)
+{
+	unsigned int s = 0;
+	while (len--)
+		s += *p++;
+	return s;
+}
+
+static int v1_session(void)
+{
+	static unsigned char buf[65536 + 16];
+	unsigned char *res;
+	unsigned int addr, len, i;
+	struct flash_t *mat = NULL;
+	int c, n;
+	int writemode = 0;
+
+	for (;;) {
+		rx_wait = -1;
+		if ((c = rx()) < 0)
+			return -1;
+		rx_wait = FRAME_TIMEOUT;
+		switch (c) {
+		case 0x00:
+			/* host restarted autobaud */
+			return 0;
+		case 0x20:
+			buf[0] = 0x30;
+			buf[2] = 1;
+			buf[3] = 4 + 8;
+			memcpy(buf + 4, "EMU1", 4);
+			memcpy(buf + 8, "EMULATOR", 8);
+			buf[1] = 2 + 4 + 8;
+			v1_reply(buf, buf[1] + 2);
+			break;
+		case 0x10:
+			if (v1_body(c, buf, 1) < 0)
+				v1_nak(0x90, 0x11);
+			else
+				v1_ack();
+			break;
+		case 0x21:
+			buf[0] = 0x31; buf[1] = 2; buf[2] = 1; buf[3] = 0;
+			v1_reply(buf, 4);
+			break;
+		case 0x11:
+			if (v1_body(c, buf, 1) < 0)
+				v1_nak(0x91, 0x11);
+			else
+				v1_ack();
+			break;
+		case 0x22:
+			buf[0] = 0x32; buf[1] = 5; buf[2] = 2;
+			buf[3] = 1; buf[4] = 1;
+			buf[5] = 1; buf[6] = 1;
+			v1_reply(buf, 7);
+			break;
+		case 0x23:
+			buf[0] = 0x33; buf[1] = 9; buf[2] = 2;
+			setword(buf + 3, 100); setword(buf + 5, 5000);
+			setword(buf + 7, 100); setword(buf + 9, 5000);
+			v1_reply(buf, 11);
+			break;
+		case 0x24:
+		case 0x25:
+			mat = (c == 0x24) ? &userboot : &user;
+			buf[0] = c + 0x10; buf[1] = 9; buf[2] = 1;
+			setlong(buf + 3, mat->base);
+			setlong(buf + 7, mat->base + mat->size - 1);
+			v1_reply(buf, 11);
+			break;
+		case 0x26:
+			n = user.size / blocksize;
+			buf[0] = 0x36;
+			setword(buf + 1, 1 + n * 8);
+			buf[3] = n;
+			for (i = 0; i < n; i++) {
+				setlong(buf + 4 + i * 8, user.base + i * blocksize);
+				setlong(buf + 8 + i * 8,
+					user.base + (i + 1) * blocksize - 1);
+			}
+			v1_reply(buf, 4 + n * 8);
+			break;
+		case 0x27:
+			buf[0] = 0x37; buf[1] = 2;
+			setword(buf + 2, writesize);
+			v1_reply(buf, 4);
+			break;
+		case 0x3f:
+			if (v1_body(c, buf, 1) < 0) {
+				v1_nak(0xbf, 0x11);
+				break;
+			}
+			v1_ack();
+			/* wait confirmation */
+			if ((c = rx()) < 0)
+				return -1;
+			if (c == ACK)
+				v1_ack();
+			break;
+		case 0x40:
+			if (!keep) {
+				erase(&user, user.base, user.size);
+				erase(&userboot, userboot.base, userboot.size);
+			}
+			writemode = 1;
+			v1_ack();
+			break;
+		case 0x42:
+		case 0x43:
+			if (!writemode) {
+				v1_nak(0x80, c);
+				break;
+			}
+			mat = (c == 0x42) ? &userboot : &user;
+			v1_ack();
+			break;
+		case 0x50:
+			/* fixed length: address + writesize */
+			for (i = 0; i < 4; i++)
+				buf[i] = rx();
+			addr = getlong(buf);
+			len = (addr == 0xffffffff) ? 0 : writesize;
+			for (i = 0; i <= len; i++)
+				buf[4 + i] = rx();
+			if ((sum_of(buf, 5 + len) + c) & 0xff) {
+				v1_nak(0xd0, 0x11);
+				break;
+			}
+			if (len == 0) {
+				LOG("write end\n");
+				v1_ack();
+				break;
+			}
+			if (mat == NULL || (addr % writesize) ||
+			    addr - mat->base >= mat->size) {
+				v1_nak(0xd0, 0x2a);
+				break;
+			}
+			if (program(addr, buf + 4, len) < 0) {
+				v1_nak(0xd0, 0x53);
+				break;
+			}
+			LOG("write %08x\n", addr);
+			v1_ack();
+			break;
+		case 0x48:
+			v1_ack();
+			break;
+		case 0x58:
+			if ((n = v1_body(c, buf, 1)) < 0) {
+				v1_nak(0xd8, 0x11);
+				break;
+			}
+			if (buf[0] == 0xff) {
+				v1_ack();
+				break;
+			}
+			if (buf[0] >= user.size / blocksize) {
+				v1_nak(0xd8, 0x29);
+				break;
+			}
+			LOG("erase block %d\n", buf[0]);
+			erase(&user, user.base + buf[0] * blocksize, blocksize);
+			v1_ack();
+			break;
+		case 0x4a:
+		case 0x4b:
+			mat = (c == 0x4a) ? &userboot : &user;
+			buf[0] = c + 0x10; buf[1] = 4;
+			setlong(buf + 2, sum_of(mat->mem, mat->size));
+			v1_reply(buf, 6);
+			break;
+		case 0x4c:
+		case 0x4d:
+			mat = (c == 0x4c) ? &userboot : &user;
+			for (i = 0; i < mat->size; i++)
+				if (mat->mem[i] != 0xff)
+					break;
+			if (i == mat->size)
+				v1_ack();
+			else
+				v1_nak(c + 0x80, 0x52);
+			break;
+		case 0x4f:
+			buf[0] = 0x5f; buf[1] = 2; buf[2] = writemode ? 0x2f : 0x1f;
+			buf[3] = 0;
+			v1_reply(buf, 4);
+			break;
+		case 0x52:
+			if ((n = v1_body(c, buf, 1)) != 9) {
+				v1_nak(0xd2, 0x11);
+				break;
+			}
+			mat = buf[0] ? &user : &userboot;
+			addr = getlong(buf + 1);
+			len = getlong(buf + 5);
+			if (len > sizeof(buf) - 16 ||
+			    addr - mat->base >= mat->size ||
+			    len > mat->size - (addr - mat->base)) {
+				v1_nak(0xd2, 0x2a);
+				break;
+			}
+			res = malloc(len + 6);
+			res[0] = 0x52;
+			setlong(res + 1, len);
+			memcpy(res + 5, mat->mem + addr - mat->base, len);
+			v1_reply(res, len + 5);
+			free(res);
+			break;
+		default:
+			LOG("unknown command %02x\n", c);
+			v1_nak(0x80, 0x80);
+			break;
+		}
+	}
+}
+
+/* ---- new protocol ---- */
+
+static void v2_reply(unsigned char res, const unsigned char *data, int len,
+		     unsigned char tail)
+{
+	unsigned char buf[V2_READ_MAX + 16];
+	unsigned char sum = 0;
+	int i;
+
+	buf[0] = SOD;
+	setword(buf + 1, len + 1);
+	buf[3] = res;
+	memcpy(buf + 4, data, len);
+	for (i = 1; i < len + 4; i++)
+		sum += buf[i];
+	buf[len + 4] = 0x100 - sum;
+	buf[len + 5] = tail;
+	tx(buf, len + 6);
+}
+
+static void v2_status(unsigned char res)
+{
+	v2_reply(res, NULL, 0, ETX);
+}
+
+static void v2_error(unsigned char cmd, unsigned char sts)
+{
+	v2_reply(cmd | 0x80, &sts, 1, ETX);
+}
+
+/* receive frame after head. returns payload length or -1 on error */
+static int v2_frame(unsigned char *buf)
+{
+	unsigned char sum;
+	int len, i, c;
+
+	if ((c = rx()) < 0)
+		return -2;
+	len = c << 8;
+	if ((c = rx()) < 0)
+		return -2;
+	len |= c;
+	sum = (len >> 8) + len;
+	for (i = 0; i < len + 2; i++) {
+		if ((c = rx()) < 0)
+			return -2;
+		buf[i] = c;
+		sum += c;
+	}
+	sum -= buf[len + 1];
+	if (sum != 0)
+		return -1;
+	return len;
+}
+
+static int v2_session(void)
+{
+	static unsigned char buf[65536 + 8];
+	unsigned char data[64];
+	unsigned int addr, end, wp = 0, wend = 0, rp = 0, rend = 0;
+	int c, len, n;
+
+	for (;;) {
+		rx_wait = -1;
+		if ((c = rx()) < 0)
+			return -1;
+		rx_wait = FRAME_TIMEOUT;
+		if (c == 0x00)
+			return 0;
+		LOG("rx %02x\n", c);
+		if (c != SOH && c != SOD) {
+			LOG("garbage %02x\n", c);
+			continue;
+		}
+		len = v2_frame(buf);
+		if (len == -2)
+			return -1;
+		if (len < 0) {
+			v2_error(buf[0], 0xc3);
+			continue;
+		}
+		if (c == SOD) {
+			switch (buf[0]) {
+			case 0x13:
+				if (wp == 0 && wend == 0) {
+					v2_error(0x13, 0xc4);
+					break;
+				}
+				if (program(wp, buf + 1, len - 1) < 0) {
+					v2_error(0x13, 0xe2);
+					break;
+				}
+				LOG("write %08x\n", wp);
+				wp += len - 1;
+				if (wp - 1 == wend)
+					wp = wend = 0;
+				v2_status(0x13);
+				break;
+			case 0x15:
+				if (rend == 0 || rp > rend) {
+					v2_error(0x15, 0xc4);
+					break;
+				}
+				goto send_read;
+			case 0x38:
+				memset(data, 0, sizeof(data));
+				memcpy(data, "EMU2\0\0\0\0", 8);
+				setlong(data + 8, 20000000);
+				setlong(data + 12, 8000000);
+				setlong(data + 16, 120000000);
+				setlong(data + 20, 1000000);
+				v2_reply(0x38, data, 24, ETX);
+				break;
+			case 0x32:
+				setlong(data, 120000000);
+				setlong(data + 4, 60000000);
+				v2_reply(0x32, data, 8, ETX);
+				break;
+			case 0x3a:
+				memset(data, 0, sizeof(data));
+				memcpy(data, "EMULATOR-RX     ", 16);
+				data[16] = 0x00;
+				setlong(data + 17, blocksize);
+				setword(data + 21, user.size / blocksize);
+				for (n = 1; n < 6; n++)
+					data[16 + n * 7] = 0xff;
+				v2_reply(0x3a, data, 16 + 6 * 7, ETX);
+				break;
+			default:
+				v2_error(buf[0], 0xc1);
+			}
+			continue;
+		}
+		switch (buf[0]) {
+		case 0x00:
+		case 0x32:
+		case 0x34:
+		case 0x36:
+		case 0x38:
+		case 0x3a:
+			v2_status(buf[0]);
+			break;
+		case 0x12:
+			addr = getlong(buf + 1);
+			if (addr < user.base || (addr - user.base) % blocksize) {
+				v2_error(0x12, 0xd0);
+				break;
+			}
+			LOG("erase %08x\n", addr);
+			erase(&user, addr, blocksize);
+			v2_status(0x12);
+			break;
+		case 0x13:
+			addr = getlong(buf + 1);
+			end = getlong(buf + 5);
+			if (end < addr || lookup(addr, end - addr + 1) == NULL) {
+				v2_error(0x13, 0xd0);
+				break;
+			}
+			wp = addr;
+			wend = end;
+			v2_status(0x13);
+			break;
+		case 0x15:
+			addr = getlong(buf + 1);
+			end = getlong(buf + 5);
+			if (end < addr || lookup(addr, end - addr + 1) == NULL) {
+				v2_error(0x15, 0xd0);
+				break;
+			}
+			rp = addr;
+			rend = end;
+		send_read:
+			n = rend - rp + 1;
+			if (n > V2_READ_MAX)
+				n = V2_READ_MAX;
+			v2_reply(0x15, user.mem + rp - user.base, n,
+				 (rp + n - 1 == rend) ? ETX : ETB);
+			if (rp + n - 1 == rend)
+				rp = rend = 0;
+			else
+				rp += n;
+			break;
+		case 0x18:
+			addr = getlong(buf + 1);
+			end = getlong(buf + 5);
+			if (end < addr || lookup(addr, end - addr + 1) == NULL) {
+				v2_error(0x18, 0xd0);
+				break;
+			}
+			setlong(data, crc32(user.mem + addr - user.base,
+					    end - addr + 1));
+			v2_reply(0x18, data, 4, ETX);
+			break;
+		default:
+			v2_error(buf[0], 0xc1);
+		}
+	}
+}
+
+/* RAM stub protocol */
+static unsigned int crc32_add(unsigned int crc, const unsigned char *p,
+			      unsigned int len)
+{
+	int i;
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void stub_reply(unsigned char res, unsigned char seq,
+		       const unsigned char *data, int len)
+{
+	static unsigned char buf[4096 + 8];
+	buf[0] = res;
+	buf[1] = seq;
+	setword(buf + 2, len);
+	if (len)
+		memcpy(buf + 4, data, len);
+	setlong(buf + 4 + len, crc32_add(0, buf, 4 + len));
+	tx(buf, len + 8);
+}
+
+static void stub_error(unsigned char cmd, unsigned char seq, unsigned char code)
+{
+	stub_reply(cmd | 0x80, seq, &code, 1);
+}
+
+static int lz_decode(const unsigned char *src, int len, unsigned char *dst,
+		     int size)
+{
+	int in = 0, out = 0, bit;
+	unsigned char flag;
+	int off, l;
+
+	while (in < len) {
+		flag = src[in++];
+		for (bit = 0; bit < 8 && in < len; bit++) {
+			if (flag & (1 << bit)) {
+				if (out >= size)
+					return -1;
+				dst[out++] = src[in++];
+			} else {
+				if (in + 2 > len)
+					return -1;
+				off = src[in] | ((src[in + 1] >> 4) << 8);
+				l = (src[in + 1] & 0x0f) + 3;
+				in += 2;
+				if (off == 0 || off > out || out + l > size)
+					return -1;
+				for (; l > 0; l--, out++)
+					dst[out] = dst[out - off];
+			}
+		}
+	}
+	return out;
+}
+
+static int stub_session(void)
+{
+	static unsigned char buf[4096 + 16];
+	unsigned char data[4096];
+	unsigned char expect = 0;
+	int nak_sent = 0;
+	unsigned int size, i, len, addr, n;
+	int c;
+	struct flash_t *f;
+
+	/* boot mode download */
+	for (size = 0, i = 0; i < 2; i++) {
+		if ((c = rx()) < 0)
+			return -1;
+		buf[0] = c;
+		tx(buf, 1);
+		size = (size << 8) | c;
+	}
+	for (i = 0; i < size; i++) {
+		if ((c = rx()) < 0)
+			return -1;
+		buf[0] = c;
+		tx(buf, 1);
+	}
+	buf[0] = 0xaa;
+	tx(buf, 1);
+	LOG("stub %d bytes loaded\n", size);
+
+	for (;;) {
+		rx_wait = -1;
+		if ((c = rx()) < 0)
+			return -1;
+		buf[0] = c;
+		rx_wait = FRAME_TIMEOUT;
+		for (i = 1; i < 4; i++) {
+			if ((c = rx()) < 0)
+				goto broken;
+			buf[i] = c;
+		}
+		len = (buf[2] << 8) | buf[3];
+		if (len > 4096)
+			goto broken;
+		for (; i < len + 8; i++) {
+			if ((c = rx()) < 0)
+				goto broken;
+			buf[i] = c;
+		}
+		if (getlong(buf + 4 + len) != crc32_add(0, buf, 4 + len))
+			goto broken;
+		if (buf[1] != expect) {
+			if (nak_sent)
+				continue;
+			if ((unsigned char)(expect - buf[1]) <= 16) {
+				/* resent frame */
+				if (buf[0] == 'E' || buf[0] == 'W') {
+					stub_reply(0x06, expect - 1, NULL, 0);
+					continue;
+				}
+			} else
+				continue;
+		} else {
+			expect++;
+			nak_sent = 0;
+		}
+		LOG("stub %c seq %d\n", buf[0], buf[1]);
+		switch (buf[0]) {
+		case 'S':
+			stub_reply('S', buf[1], NULL, 0);
+			break;
+		case 'I':
+			memset(data, 0, 38);
+			data[0] = 1;
+			data[1] = 8;
+			setword(data + 2, 1024);
+			memcpy(data + 4, "EMUSTUB", 7);
+			data[20] = 1;
+			setlong(data + 21, user.base);
+			setlong(data + 25, user.base + user.size - 1);
+			setlong(data + 29, blocksize);
+			stub_reply('I', buf[1], data, 33);
+			break;
+		case 'B':
+			stub_reply('B', buf[1], NULL, 0);
+			break;
+		case 'E':
+			addr = getlong(buf + 4);
+			f = lookup(addr, blocksize);
+			if (f == NULL || (addr - f->base) % blocksize) {
+				stub_error('E', buf[1], 0x02);
+				break;
+			}
+			erase(f, addr, blocksize);
+			stub_reply('E', buf[1], NULL, 0);
+			break;
+		case 'W':
+			addr = getlong(buf + 4);
+			n = (buf[8] << 8) | buf[9];
+			if (buf[10] == 1) {
+				if (lz_decode(buf + 11, len - 7, data, sizeof(data)) != n) {
+					stub_error('W', buf[1], 0x05);
+					break;
+				}
+			} else if (n == len - 7)
+				memcpy(data, buf + 11, n);
+			else {
+				stub_error('W', buf[1], 0x03);
+				break;
+			}
+			if (program(addr, data, n) < 0) {
+				stub_error('W', buf[1], 0x11);
+				break;
+			}
+			stub_reply('W', buf[1], NULL, 0);
+			break;
+		case 'C':
+			addr = getlong(buf + 4);
+			n = getlong(buf + 8) - addr + 1;
+			f = lookup(addr, n);
+			if (f == NULL) {
+				stub_error('C', buf[1], 0x02);
+				break;
+			}
+			setlong(data, crc32(f->mem + addr - f->base, n));
+			stub_reply('C', buf[1], data, 4);
+			break;
+		case 'R':
+			addr = getlong(buf + 4);
+			n = (buf[8] << 8) | buf[9];
+			f = lookup(addr, n);
+			if (f == NULL) {
+				stub_error('R', buf[1], 0x02);
+				break;
+			}
+			stub_reply('R', buf[1], f->mem + addr - f->base, n);
+			break;
+		default:
+			stub_error(buf[0], buf[1], 0x01);
+		}
+		continue;
+	broken:
+		if (eof)
+			return -1;
+		/* drop until idle */
+		LOG("stub broken frame\n");
+		rx_wait = 5;
+		while (rx() >= 0)
+			;
+		if (eof)
+			return -1;
+		if (!nak_sent)
+			stub_reply(0x15, expect, NULL, 0);
+		nak_sent = 1;
+	}
+}
+
+static int usb_mode;
+
+static int autobaud(void)
+{
+	unsigned char c;
+	int r;
+
+	/* wait bitrate adjust pattern */
+	rx_wait = -1;
+	/* USB boot interface has no bitrate adjust */
+	if (!usb_mode) {
+		do {
+			if ((r = rx()) < 0)
+				return -1;
+		} while (r != 0x00);
+		c = 0x00;
+		tx(&c, 1);
+	}
+	/* wait 0x55, ignore rest of pattern */
+	do {
+		if ((r = rx()) < 0)
+			return -1;
+	} while (r != 0x55);
+	c = (protocol == 1) ? 0xe6 : (protocol == 2) ? 0xc1 : 0xaa;
+	tx(&c, 1);
+	return 0;
+}
+
+static void usage(void)
+{
+	puts(PROGNAME " [-1|-2|-3] [-U] [-s size] [-u userboot size]"
+	     " [-w writesize] [-B blocksize] [-E erase_us] [-W write_us]"
+	     " [-x n] [-k] [-v]");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int slave;
+	struct termios attr;
+
+	while ((c = getopt(argc, argv, "123Us:u:w:B:E:W:kvx:")) >= 0) {
+		switch (c) {
+		case '1': protocol = 1; break;
+		case '2': protocol = 2; break;
+		case '3': protocol = 3; break;
+		case 'U': usb_mode = 1; break;
+		case 's': user.size = strtoul(optarg, NULL, 0); break;
+		case 'u': userboot.size = strtoul(optarg, NULL, 0); break;
+		case 'w': writesize = strtoul(optarg, NULL, 0); break;
+		case 'B': blocksize = strtoul(optarg, NULL, 0); break;
+		case 'E': erase_delay = strtoul(optarg, NULL, 0); break;
+		case 'W': write_delay = strtoul(optarg, NULL, 0); break;
+		case 'k': keep = 1; break;
+		case 'v': verbose = 1; break;
+		case 'x': corrupt = strtoul(optarg, NULL, 0); break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (protocol == 2)
+		user.base = 0 - user.size;
+	else
+		userboot.base = 0x00200000;
+	user.mem = malloc(user.size);
+	userboot.mem = malloc(userboot.size);
+	memset(user.mem, 0xff, user.size);
+	memset(userboot.mem, 0xff, userboot.size);
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror(PROGNAME);
+		return 1;
+	}
+	/* hold slave side open, keep master alive over host sessions */
+	slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	tcgetattr(slave, &attr);
+	cfmakeraw(&attr);
+	tcsetattr(slave, TCSANOW, &attr);
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+
+	for (;;) {
+		if (autobaud() < 0)
+			break;
+		LOG("connected\n");
+		c = (protocol == 1) ? v1_session() :
+			(protocol == 2) ? v2_session() : stub_session();
+		if (c < 0 && eof)
+			break;
+	}
+	close(slave);
+	return 0;
+}
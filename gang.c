@@ -0,0 +1,222 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  gang writing scheduler
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * each port runs own job (protocol code) on a coroutine.
+ * port receive waits yield to scheduler, scheduler waits all port fds
+ * with one epoll and resumes ready / timed out jobs.
+ * all jobs run on caller thread, one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include "h8flash.h"
+
+#define GANG_STACK (1024 * 1024)
+
+enum task_state {TASK_RUN, TASK_WAIT, TASK_DONE};
+
+struct gang_t;
+
+struct task_t {
+	ucontext_t ctx;
+	struct gang_t *gang;
+	struct port_t *port;
+	int no;
+	enum task_state state;
+	long long deadline;
+	int ready;
+	int result;
+	void *stack;
+};
+
+struct gang_t {
+	ucontext_t main;
+	int epfd;
+	struct task_t *current;
+	int (*job)(int no, void *arg);
+	void *arg;
+};
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* makecontext can't pass pointer */
+static __thread struct gang_t *starting;
+
+static void task_entry(void)
+{
+	struct task_t *t = starting->current;
+
+	t->result = t->gang->job(t->no, t->gang->arg);
+	t->state = TASK_DONE;
+}
+
+/* port wait hook: sleep job until fd ready or timeout */
+static int task_wait(struct port_t *p, int timeout, int events)
+{
+	struct task_t *t = p->waitctx;
+	struct epoll_event ev;
+
+	ev.events = EPOLLONESHOT;
+	if (events & WAIT_RX)
+		ev.events |= EPOLLIN;
+	if (events & WAIT_TX)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = t;
+	if (epoll_ctl(t->gang->epfd, EPOLL_CTL_MOD, p->fd, &ev) < 0)
+		return -1;
+	t->deadline = now_ms() + timeout;
+	t->state = TASK_WAIT;
+	swapcontext(&t->ctx, &t->gang->main);
+	return t->ready;
+}
+
+/* sleep of protocol code. in gang, other jobs run while sleeping */
+void port_sleep(struct port_t *p, int ms)
+{
+	if (ms <= 0)
+		return;
+	if (p->wait)
+		p->wait(p, ms, 0);
+	else
+		usleep(ms * 1000);
+}
+
+static void resume(struct gang_t *g, struct task_t *t, int ready)
+{
+	struct epoll_event ev;
+
+	if (!ready) {
+		/* disarm */
+		ev.events = 0;
+		ev.data.ptr = t;
+		epoll_ctl(g->epfd, EPOLL_CTL_MOD, t->port->fd, &ev);
+	}
+	t->ready = ready;
+	t->state = TASK_RUN;
+	g->current = t;
+	starting = g;
+	swapcontext(&g->main, &t->ctx);
+}
+
+/* run job on all ports concurrently. result[i] is job result of ports[i] */
+int gang_run(struct port_t **ports, int n,
+	     int (*job)(int no, void *arg), void *arg, int *result)
+{
+	struct gang_t g;
+	struct task_t *task;
+	struct epoll_event *ev = NULL;
+	struct epoll_event e;
+	long long now, next;
+	int running = 0;
+	int i, nev;
+	int r = -1;
+
+	memset(&g, 0, sizeof(g));
+	g.job = job;
+	g.arg = arg;
+	task = calloc(n, sizeof(struct task_t));
+	ev = calloc(n, sizeof(struct epoll_event));
+	g.epfd = epoll_create1(0);
+	if (task == NULL || ev == NULL || g.epfd < 0) {
+		perror(PROGNAME);
+		goto error;
+	}
+
+	for (i = 0; i < n; i++) {
+		task[i].gang = &g;
+		task[i].port = ports[i];
+		task[i].no = i;
+		task[i].state = TASK_DONE;
+		task[i].result = -1;
+		if (ports[i] == NULL)
+			continue;
+		if (ports[i]->fd >= 0) {
+			e.events = 0;
+			e.data.ptr = &task[i];
+			if (epoll_ctl(g.epfd, EPOLL_CTL_ADD, ports[i]->fd, &e) < 0) {
+				perror(PROGNAME);
+				continue;
+			}
+			ports[i]->wait = task_wait;
+			ports[i]->waitctx = &task[i];
+			progress_label(ports[i], ports[i]->dev);
+		}
+		task[i].stack = malloc(GANG_STACK);
+		if (task[i].stack == NULL || getcontext(&task[i].ctx) < 0) {
+			perror(PROGNAME);
+			continue;
+		}
+		task[i].ctx.uc_stack.ss_sp = task[i].stack;
+		task[i].ctx.uc_stack.ss_size = GANG_STACK;
+		task[i].ctx.uc_link = &g.main;
+		makecontext(&task[i].ctx, task_entry, 0);
+		running++;
+		/* run until first wait (non pollable port runs to end) */
+		resume(&g, &task[i], 1);
+		if (task[i].state == TASK_DONE)
+			running--;
+	}
+
+	while (running > 0) {
+		now = now_ms();
+		next = -1;
+		for (i = 0; i < n; i++)
+			if (task[i].state == TASK_WAIT &&
+			    (next < 0 || task[i].deadline < next))
+				next = task[i].deadline;
+		nev = epoll_wait(g.epfd, ev, n,
+				 next < 0 ? -1 : (next > now ? next - now : 0));
+		for (i = 0; i < nev; i++) {
+			struct task_t *t = ev[i].data.ptr;
+			if (t->state != TASK_WAIT)
+				continue;
+			resume(&g, t, 1);
+			if (t->state == TASK_DONE)
+				running--;
+		}
+		now = now_ms();
+		for (i = 0; i < n; i++) {
+			if (task[i].state != TASK_WAIT || task[i].deadline > now)
+				continue;
+			resume(&g, &task[i], 0);
+			if (task[i].state == TASK_DONE)
+				running--;
+		}
+	}
+	r = 0;
+ error:
+	for (i = 0; task && i < n; i++) {
+		if (result)
+			result[i] = task[i].result;
+		if (ports[i]) {
+			ports[i]->wait = NULL;
+			ports[i]->waitctx = NULL;
+			progress_label(ports[i], NULL);
+		}
+		free(task[i].stack);
+	}
+	if (g.epfd >= 0)
+		close(g.epfd);
+	free(ev);
+	free(task);
+	return r;
+}
@@ -24,50 +24,332 @@
 #define SELAREA 0
 /* serial lockfile directory */
 #define LOCKDIR "/var/lock"
+/* write journal directory */
+#define JOURNALDIR "/var/tmp"
+/* frame retry count */
+#define RETRY_COUNT 3
+/* first retry wait (ms), doubled each retry */
+#define RETRY_WAIT 10
+/* --scan target ports (glob) */
+#define SCAN_PORTS "/dev/tty{USB,ACM}*"
+/* --scan connect timeout (ms) */
+#define SCAN_TIMEOUT 1000
+/* --watch quiet time after image change (ms) */
+#define WATCH_SETTLE 200
+/* --watch keepalive interval of held boot session (ms) */
+#define WATCH_KEEPALIVE 2000
+/* stub mode frames in flight */
+#define STUB_WINDOW 8
+/* stub mode max data bytes per frame */
+#define STUB_MAXDATA 1024
+/* --report profiler phase names */
+#define PROF_PHASES 32
+/* --trace max bytes of one record */
+#define TRACE_BUF 4096
+/* progress line interval on terminal (ms) */
+#define PROGRESS_INTERVAL 250
+/* progress log line interval (not terminal / gang) (ms) */
+#define PROGRESS_LOG_INTERVAL 5000
+/* target settle time after bitrate change (ms) */
+#define BITRATE_SETTLE 10
+/* --plan flash times without measured profile (us).
+   erase block (whole flash of old protocol) / program 1KB */
+#define PLAN_ERASE 100000
+#define PLAN_PROGRAM 10000
 
 /* -------------------------------------------- */
 
 
+/* USB transport (libusb-1.0 or libusb-0.1) */
+#if (defined(HAVE_LIBUSB1) && defined(HAVE_LIBUSB_1_0_LIBUSB_H)) || \
+	defined(HAVE_USB_H)
+#define HAVE_USB 1
+#endif
+
 #define PROGNAME "h8flash"
 #define VERBOSE_PRINT(...) do { if (verbose) printf(__VA_ARGS__); } while(0)
 
 enum mat_t {user, userboot};
 
+struct overlay_t;
+
 struct area_t {
 	unsigned int start;
 	unsigned int end;
 	int size;
 	char *image;
+	/* base image sum / CRC-32 (valid when based) */
+	unsigned int sum;
+	unsigned int crc;
+	int based;
+	/* per board patched units */
+	struct overlay_t *overlay;
 };
 
+/* area byte length (end is inclusive) */
+#define AREA_LEN(a) ((a)->end - (a)->start + 1)
+
+struct journal_t;
+
 struct arealist_t {
+	struct journal_t *journal;
 	int areas;
 	struct area_t area[0];
 };
 
-enum port_type {serial, usb};
+enum port_type {serial, usb, net, replay};
+
+struct stats_t {
+	unsigned long frames;
+	unsigned long retries;
+	unsigned long naks;
+	unsigned long errors;
+	/* wire bytes and I/O system calls */
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	unsigned long syscalls;
+};
+
+struct prof_t;
+struct trace_t;
+struct impair_t;
+struct progress_t;
+
+/* port wait hook events */
+#define WAIT_RX 1
+#define WAIT_TX 2
 
 struct port_t {
 	enum port_type type;
 	char *dev;
-	int (*connect_target)(char *port);
-	int (*send_data)(const unsigned char *data, int len);
-	int (*receive_byte)(unsigned char *data);
-	int (*setbaud)(int bitrate);
-	void (*close)(void);
+	/* pollable descriptor (-1: none) */
+	int fd;
+	int (*connect_target)(struct port_t *p);
+	/* bounded silent connect_target (ms), NULL is not supported */
+	int (*probe)(struct port_t *p, int timeout);
+	/* control line sequence, NULL is not supported */
+	int (*control)(struct port_t *p, const char *seq);
+	int (*send_data)(struct port_t *p, const unsigned char *data, int len);
+	int (*receive_byte)(struct port_t *p, unsigned char *data);
+	int (*setbaud)(struct port_t *p, int bitrate);
+	void (*flush)(struct port_t *p);
+	void (*close)(struct port_t *p);
+	/* event loop hook: wait fd ready for events (WAIT_RX / WAIT_TX,
+	   0: sleep only) or timeout (ms), NULL is blocking wait */
+	int (*wait)(struct port_t *p, int timeout, int events);
+	void *waitctx;
+	struct stats_t stats;
+	/* line bitrate (100bps unit), 0: unknown */
+	int bitrate;
+	/* wait after bitrate change (ms), 0: no line (replay) */
+	int settle;
+	struct prof_t *prof;
+	struct trace_t *trace;
+	struct impair_t *impair;
+	struct progress_t *progress;
+};
+
+/* wire traffic of write_rom (--plan) */
+struct wire_t {
+	unsigned int erase;	/* erase blocks, ERASE_ALL: whole flash */
+	unsigned int units;	/* write units sent */
+	unsigned int payload;	/* image bytes sent */
+	unsigned long frames;	/* frames sent */
+	unsigned long waits;	/* answer waits (round trips) */
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	/* frames in flight / max data bytes of frame.
+	   in: used when session has no value (profile), out: used value */
+	int window;
+	int maxdata;
 };
 
+#define ERASE_ALL 0xffffffff
+
 struct comm_t {
-	struct arealist_t *(*get_arealist)(struct port_t *port, enum mat_t mat);
-	int (*write_rom)(struct port_t *port, struct arealist_t *arealist,
-			 enum mat_t mat);
-	int (*setup_connection)(struct port_t *port, int input_freq, char endian);
-	void (*dump_configs)(struct port_t *p);
+	/* protocol name (trace, profile) */
+	const char *name;
+	struct arealist_t *(*get_arealist)(struct comm_t *com,
+					   struct port_t *port, enum mat_t mat);
+	int (*write_rom)(struct comm_t *com, struct port_t *port,
+			 struct arealist_t *arealist, enum mat_t mat);
+	int (*setup_connection)(struct comm_t *com, struct port_t *port,
+				int input_freq, char endian);
+	void (*dump_configs)(struct comm_t *com, struct port_t *p);
+	int (*verify_rom)(struct comm_t *com, struct port_t *port,
+			  struct arealist_t *arealist, enum mat_t mat);
+	int (*read_rom)(struct comm_t *com, struct port_t *port, enum mat_t mat,
+			unsigned int addr, unsigned int size,
+			unsigned char *buf);
+	const char *(*target_id)(struct comm_t *com);
+	/* inquire device type into target_id (no state change) */
+	int (*identify)(struct comm_t *com, struct port_t *port);
+	/* keep boot session (no state change) */
+	int (*keepalive)(struct comm_t *com, struct port_t *port);
+	/* count traffic of write_rom without I/O */
+	void (*plan_rom)(struct comm_t *com, struct arealist_t *arealist,
+			 struct wire_t *w);
+	void (*close)(struct comm_t *com);
+	/* units are erased by each write (unchanged units can be kept) */
+	int block_erase;
 };
 
 struct port_t *open_serial(char *portname);
-struct port_t *open_usb(unsigned short vid, unsigned short pid);
-struct comm_t *comm_v1();
-struct comm_t *comm_v2();
+struct port_t *open_usb(unsigned short vid, unsigned short pid,
+			int bus, int addr);
+struct port_t *open_net(const char *url);
+struct port_t *open_replay(const char *url);
+struct comm_t *comm_v1(void);
+struct comm_t *comm_v2(void);
+struct comm_t *comm_stub(const char *stub);
+
+int load_file(const char *fn, int force_binary, unsigned long binbase,
+	      struct arealist_t *arealist);
+struct area_t *lookup_area(struct arealist_t *arealist, unsigned int addr);
+
+int gang_run(struct port_t **ports, int n,
+	     int (*job)(int no, void *arg), void *arg, int *result);
+void port_sleep(struct port_t *p, int ms);
+
+int dump_rom(struct comm_t *com, struct port_t *port,
+	     struct arealist_t *arealist, enum mat_t mat,
+	     const char *ranges, const char *fn);
+
+struct journal_t *journal_open(struct arealist_t *arealist,
+			       const char *target, enum mat_t mat, int resume);
+int journal_acked(struct journal_t *j);
+int journal_done(struct journal_t *j, unsigned int addr);
+void journal_ack(struct journal_t *j, unsigned int addr);
+void journal_discard(struct journal_t *j);
+void journal_close(struct journal_t *j, int complete);
+
+/* data: image (char) or frame (unsigned char) bytes */
+int image_blank(const void *data, unsigned int size);
+unsigned int image_sum(const void *data, unsigned int size);
+unsigned int image_crc32(unsigned int crc, const void *data,
+			 unsigned int size);
+unsigned int image_crc32_combine(unsigned int crc1, unsigned int crc2,
+				 unsigned int len2);
+
+char *area_image(struct area_t *area, unsigned int offset);
+void area_base(struct area_t *area);
+unsigned int area_sum(struct area_t *area);
+unsigned int area_crc(struct area_t *area);
+int patch_apply(struct arealist_t *arealist, unsigned int addr,
+		const unsigned char *data, unsigned int len);
+int patch_spec(struct arealist_t *arealist, const char *spec,
+	       unsigned long board);
+int patch_csv(struct arealist_t *arealist, const char *fn,
+	      unsigned long board);
+void patch_clear(struct arealist_t *arealist);
+
+struct prof_t *prof_open(void);
+void prof_close(struct prof_t *prof);
+void prof_phase(struct port_t *p, const char *name);
+long long prof_time(struct port_t *p, const char *name,
+		    struct stats_t *stats);
+int prof_report(struct port_t *p, const char *target, unsigned int payload,
+		int result, const char *fn);
+
+/* trace file record (trace.c), followed by len bytes */
+#define TRACE_MAGIC "H8FTRC1"
+#define TRACE_TX      'T'
+#define TRACE_RX      'R'
+#define TRACE_PHASE   'M'	/* phase name ("": no phase) */
+#define TRACE_PROTO   'P'	/* protocol name */
+#define TRACE_BITRATE 'B'	/* int bitrate (100bps unit) */
+
+struct trace_rec {
+	unsigned long long t0;	/* first byte (ns from trace start) */
+	unsigned long long t1;	/* last byte */
+	unsigned short len;
+	unsigned char type;
+	unsigned char pad[5];
+};
+
+int trace_open(struct port_t *p, const char *fn);
+void trace_mark(struct port_t *p, unsigned char type, const char *text);
+int trace_close(struct port_t *p);
+
+int impair_open(struct port_t *p, const char *spec);
+void impair_close(struct port_t *p);
+
+struct progress_t *progress_open(void);
+void progress_label(struct port_t *p, const char *label);
+int progress_events(struct port_t *p, int fd);
+void progress_start(struct port_t *p, const char *what, unsigned int total);
+void progress_step(struct port_t *p, unsigned int addr, unsigned int bytes);
+void progress_end(struct port_t *p);
+void progress_retry(struct port_t *p);
+void progress_phase(struct port_t *p, const char *name);
+void progress_close(struct port_t *p);
+
+/* target geometry profile (--profile) */
+struct profile_t {
+	char protocol[8];
+	char target[32];
+	enum mat_t mat;
+	int bitrate;		/* connected bitrate (100bps) */
+	int rtt;		/* answer turnaround (us) */
+	int window;
+	int maxdata;
+	/* flash time measured by write (us), 0: unknown */
+	int erase;		/* one erase block (ERASE_ALL: whole flash) */
+	int program;		/* program 1KB */
+};
+
+void wire_frame(struct wire_t *w, int tx, int rx);
+struct port_t *open_offline(const char *name);
+int profile_save(const char *fn, const struct profile_t *pf,
+		 struct arealist_t *arealist);
+struct arealist_t *profile_load(const char *fn, struct profile_t *pf);
+int plan_print(struct comm_t *com, struct arealist_t *arealist,
+	       const struct profile_t *pf, const char *rates,
+	       const char *previous, int binary, unsigned long base);
+
+int lz_compress(const void *src, unsigned int size,
+		unsigned char *dst, unsigned int limit);
 
 extern int verbose;
+
+/* command line (main.c / station.c) */
+struct h8flash;
+struct h8flash_config;
+
+struct patch_list {
+	char **spec;
+	int specs;
+	const char *csv;
+	unsigned long board;
+};
+
+struct station_config {
+	const struct h8flash_config *config;
+	const struct patch_list *patch;
+	const char *file;
+	int binary;
+	unsigned long base;
+	int verify;
+	char **match;
+	int matches;
+	const char *log;
+	int verbose;
+};
+
+struct watch_config {
+	const struct h8flash_config *config;
+	const struct patch_list *patch;
+	const char *file;
+	int binary;
+	unsigned long base;
+	int verify;
+};
+
+int apply_patch(struct h8flash *h, const struct patch_list *patch,
+		unsigned long board);
+int station(const struct station_config *config);
+int watch(struct h8flash *h, const struct watch_config *w);
+int daemon_main(const char *path, char **ports, int n,
+		const struct h8flash_config *config);
+int daemon_ctl(const char *path, int argc, char **argv);
+int analyze(const char *fn);
@@ -0,0 +1,167 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  rom image helper
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "h8flash.h"
+
+/* 8bit lane mask */
+#define LANE16 0x00ff00ff00ff00ffULL
+/* 16bit lane accumulator overflow limit (510 * 128 < 65536) */
+#define SUM_BATCH 128
+
+static __inline__ uint64_t load64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* check blank (all 0xff) data */
+int image_blank(const void *buf, unsigned int size)
+{
+	const unsigned char *data = buf;
+	uint64_t r = ~0ULL;
+	unsigned char t = 0xff;
+
+	for (; size >= 32; size -= 32, data += 32) {
+		r &= load64(data) & load64(data + 8) &
+			load64(data + 16) & load64(data + 24);
+		if (r != ~0ULL)
+			return 0;
+	}
+	for (; size >= 8; size -= 8, data += 8)
+		r &= load64(data);
+	for (; size > 0; size--)
+		t &= *data++;
+	return r == ~0ULL && t == 0xff;
+}
+
+/* 32bit byte sum (boot program sum check compatible) */
+unsigned int image_sum(const void *buf, unsigned int size)
+{
+	const unsigned char *data = buf;
+	uint64_t acc;
+	uint64_t v;
+	unsigned int sum = 0;
+	int n;
+
+	while (size >= 8) {
+		/* add 8 bytes into four 16bit lanes at once */
+		for (acc = 0, n = 0; n < SUM_BATCH && size >= 8;
+		     n++, size -= 8, data += 8) {
+			v = load64(data);
+			acc += (v & LANE16) + ((v >> 8) & LANE16);
+		}
+		sum += (acc & 0xffff) + ((acc >> 16) & 0xffff) +
+			((acc >> 32) & 0xffff) + (acc >> 48);
+	}
+	for (; size > 0; size--)
+		sum += *data++;
+	return sum;
+}
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+}
+
+/* CRC-32 (IEEE802.3) slicing-by-8 */
+unsigned int image_crc32(unsigned int crc, const void *buf,
+			 unsigned int size)
+{
+	const unsigned char *data = buf;
+	uint32_t c = ~crc;
+
+	pthread_once(&crc_once, crc_init);
+	for (; size >= 8; size -= 8, data += 8) {
+		c ^= data[0] | (data[1] << 8) | (data[2] << 16) |
+			((uint32_t)data[3] << 24);
+		c = crc_table[7][c & 0xff] ^
+			crc_table[6][(c >> 8) & 0xff] ^
+			crc_table[5][(c >> 16) & 0xff] ^
+			crc_table[4][c >> 24] ^
+			crc_table[3][data[4]] ^
+			crc_table[2][data[5]] ^
+			crc_table[1][data[6]] ^
+			crc_table[0][data[7]];
+	}
+	for (; size > 0; size--)
+		c = (c >> 8) ^ crc_table[0][(c ^ *data++) & 0xff];
+	return ~c;
+}
+
+/* GF(2) matrix times vector */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/* CRC-32 of data1 + data2 from CRC of each (zlib crc32_combine) */
+unsigned int image_crc32_combine(unsigned int crc1, unsigned int crc2,
+				 unsigned int len2)
+{
+	uint32_t even[32];
+	uint32_t odd[32];
+	uint32_t row;
+	int n;
+
+	if (len2 == 0)
+		return crc1 ^ crc2;
+	/* operator for one zero bit */
+	odd[0] = 0xedb88320;
+	for (row = 1, n = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+	/* apply len2 zero bytes to crc1 */
+	do {
+		gf2_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+		gf2_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+	return crc1 ^ crc2;
+}
@@ -0,0 +1,264 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  link impairment
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * send_data / receive_byte of port are wrapped and bytes are delayed,
+ * dropped or corrupted as spec (comma separated key=value).
+ *   rate=bps     line rate cap (10 bit per byte) in each direction
+ *   rate=line    follow host bitrate of port (pty as UART)
+ *   delay=us     one way latency, added at each change of direction
+ *   jitter=us    random additional latency (0 - us)
+ *   drop=ppm     lost bytes per million
+ *   flip=ppm     bytes with one bit error per million
+ *   seed=n       random sequence (same seed, same impairment)
+ * sleeping in wrapper is the time of link, so timeouts of protocol
+ * layer see same timing as slow link.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "h8flash.h"
+
+struct impair_t {
+	/* wrapped port operations */
+	int (*send_data)(struct port_t *p, const unsigned char *data, int len);
+	int (*receive_byte)(struct port_t *p, unsigned char *data);
+	int rate;		/* bit/s, 0: no cap, -1: port bitrate */
+	int delay;		/* us */
+	int jitter;		/* us */
+	unsigned int drop;	/* ppm */
+	unsigned int flip;	/* ppm */
+	unsigned long long rand;
+	/* line free time of each direction (ns) */
+	long long tx_free;
+	long long rx_free;
+	int last_tx;		/* last operation is send */
+	unsigned long dropped;
+	unsigned long flipped;
+	unsigned char *buf;
+	int bufsize;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(struct port_t *p, long long t)
+{
+	struct timespec ts;
+	long long left;
+
+	/* gang: yield to scheduler (ms timer), sleep only rest of ms */
+	while (p->wait && (left = t - now_ns()) >= 1000000)
+		p->wait(p, left / 1000000, 0);
+	if (t <= now_ns())
+		return;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+/* xorshift64* */
+static unsigned int next_rand(struct impair_t *im)
+{
+	im->rand ^= im->rand >> 12;
+	im->rand ^= im->rand << 25;
+	im->rand ^= im->rand >> 27;
+	return (im->rand * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static int hit(struct impair_t *im, unsigned int ppm)
+{
+	return ppm && next_rand(im) % 1000000 < ppm;
+}
+
+static long long byte_ns(struct impair_t *im, struct port_t *p)
+{
+	int rate = im->rate < 0 ? p->bitrate * 100 : im->rate;
+
+	return rate > 0 ? 10000000000LL / rate : 0;
+}
+
+/* latency of new direction (ns) */
+static long long latency(struct impair_t *im)
+{
+	long long ns = im->delay * 1000LL;
+
+	if (im->jitter)
+		ns += (next_rand(im) % (im->jitter + 1)) * 1000LL;
+	return ns;
+}
+
+/* pass one byte. returns 0 (dropped) or 1 */
+static int impair_byte(struct impair_t *im, unsigned char *c)
+{
+	if (hit(im, im->drop)) {
+		im->dropped++;
+		return 0;
+	}
+	if (hit(im, im->flip)) {
+		*c ^= 1 << (next_rand(im) % 8);
+		im->flipped++;
+	}
+	return 1;
+}
+
+static int impair_send(struct port_t *p, const unsigned char *data, int len)
+{
+	struct impair_t *im = p->impair;
+	long long t = now_ns();
+	int i, n;
+
+	if (len > im->bufsize) {
+		free(im->buf);
+		im->buf = malloc(len);
+		if (im->buf == NULL) {
+			im->bufsize = 0;
+			return -1;
+		}
+		im->bufsize = len;
+	}
+	for (i = n = 0; i < len; i++) {
+		im->buf[n] = data[i];
+		n += impair_byte(im, &im->buf[n]);
+	}
+	if (t < im->tx_free)
+		t = im->tx_free;
+	if (!im->last_tx)
+		t += latency(im);
+	t += byte_ns(im, p) * len;
+	im->tx_free = t;
+	im->last_tx = 1;
+	/* frame is on the target side at end of line time */
+	sleep_until(p, t);
+	if (n > 0 && im->send_data(p, im->buf, n) != n)
+		return -1;
+	return len;
+}
+
+static int impair_receive(struct port_t *p, unsigned char *data)
+{
+	struct impair_t *im = p->impair;
+	long long t;
+	int r;
+
+	do {
+		r = im->receive_byte(p, data);
+		if (r != 1)
+			return r;
+	} while (!impair_byte(im, data));
+	t = now_ns();
+	if (t < im->rx_free)
+		t = im->rx_free;
+	if (im->last_tx)
+		t += latency(im);
+	t += byte_ns(im, p);
+	im->rx_free = t;
+	im->last_tx = 0;
+	sleep_until(p, t);
+	return 1;
+}
+
+static int parse(struct impair_t *im, const char *spec)
+{
+	char key[16];
+	const char *v;
+	char *end;
+	unsigned long n;
+	int len;
+
+	im->rand = 1;
+	while (*spec) {
+		v = strchr(spec, '=');
+		len = v ? v - spec : 0;
+		if (len == 0 || len >= sizeof(key))
+			return -1;
+		memcpy(key, spec, len);
+		key[len] = '\0';
+		v++;
+		if (strcmp(key, "rate") == 0 && strncmp(v, "line", 4) == 0) {
+			im->rate = -1;
+			end = (char *)v + 4;
+		} else {
+			n = strtoul(v, &end, 0);
+			if (end == v)
+				return -1;
+			if (strcmp(key, "rate") == 0)
+				im->rate = n;
+			else if (strcmp(key, "delay") == 0)
+				im->delay = n;
+			else if (strcmp(key, "jitter") == 0)
+				im->jitter = n;
+			else if (strcmp(key, "drop") == 0)
+				im->drop = n;
+			else if (strcmp(key, "flip") == 0)
+				im->flip = n;
+			else if (strcmp(key, "seed") == 0)
+				/* zero state is fixed point */
+				im->rand = n ? n : 1;
+			else
+				return -1;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		spec = end;
+	}
+	return 0;
+}
+
+int impair_open(struct port_t *p, const char *spec)
+{
+	struct impair_t *im;
+
+	if (p->impair || p->trace)
+		return -1;
+	im = calloc(1, sizeof(struct impair_t));
+	if (im == NULL)
+		return -1;
+	if (parse(im, spec) < 0) {
+		fprintf(stderr, "impair: invalid spec %s\n", spec);
+		free(im);
+		return -1;
+	}
+	im->send_data = p->send_data;
+	im->receive_byte = p->receive_byte;
+	p->send_data = impair_send;
+	p->receive_byte = impair_receive;
+	p->impair = im;
+	return 0;
+}
+
+void impair_close(struct port_t *p)
+{
+	struct impair_t *im = p->impair;
+
+	if (im == NULL)
+		return;
+	VERBOSE_PRINT("impair: %lu bytes dropped, %lu bytes corrupted\n",
+		      im->dropped, im->flipped);
+	p->send_data = im->send_data;
+	p->receive_byte = im->receive_byte;
+	p->impair = NULL;
+	free(im->buf);
+	free(im);
+}
@@ -0,0 +1,212 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  write journal
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+#include "h8flash.h"
+
+#define JOURNAL_MAGIC "H8FJNL1"
+
+struct journal_head_t {
+	char     magic[8];
+	uint32_t image;
+	uint32_t units;
+	uint32_t mat;
+	char     target[32];
+};
+
+struct journal_t {
+	int fd;
+	char path[FILENAME_MAX];
+	struct arealist_t *arealist;
+	struct journal_head_t head;
+	unsigned int acked;
+	unsigned char map[0];
+};
+
+/* unit number of address */
+static int unit_no(struct journal_t *j, unsigned int addr)
+{
+	struct area_t *area;
+	int i;
+	int no = 0;
+
+	for (i = 0; i < j->arealist->areas; i++) {
+		area = &j->arealist->area[i];
+		if (area->start <= addr && area->end >= addr)
+			return no + (addr - area->start) / area->size;
+		no += (AREA_LEN(area) + area->size - 1) / area->size;
+	}
+	return -1;
+}
+
+/* image and geometry hash */
+static unsigned int image_hash(struct arealist_t *arealist)
+{
+	unsigned char geo[12];
+	struct area_t *area;
+	unsigned int crc = 0;
+	int i;
+
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		memcpy(geo, &area->start, 4);
+		memcpy(geo + 4, &area->end, 4);
+		memcpy(geo + 8, &area->size, 4);
+		crc = image_crc32(crc, geo, sizeof(geo));
+		crc = image_crc32_combine(crc, area_crc(area), AREA_LEN(area));
+	}
+	return crc;
+}
+
+static int journal_load(struct journal_t *j)
+{
+	struct journal_head_t head;
+	unsigned int i;
+	int n;
+
+	if (read(j->fd, &head, sizeof(head)) != sizeof(head))
+		return 0;
+	if (memcmp(&head, &j->head, sizeof(head)) != 0)
+		return 0;
+	n = (j->head.units + 7) / 8;
+	if (read(j->fd, j->map, n) != n)
+		return 0;
+	for (j->acked = 0, i = 0; i < j->head.units; i++)
+		if (j->map[i / 8] & (1 << (i % 8)))
+			j->acked++;
+	return 1;
+}
+
+static int journal_reset(struct journal_t *j)
+{
+	int n = (j->head.units + 7) / 8;
+
+	memset(j->map, 0, n);
+	j->acked = 0;
+	if (ftruncate(j->fd, 0) < 0 ||
+	    pwrite(j->fd, &j->head, sizeof(j->head), 0) != sizeof(j->head) ||
+	    pwrite(j->fd, j->map, n, sizeof(j->head)) != n)
+		return -1;
+	return 0;
+}
+
+/* open journal for image / target. keep acked units if resume */
+struct journal_t *journal_open(struct arealist_t *arealist,
+			       const char *target, enum mat_t mat, int resume)
+{
+	struct journal_t *j;
+	struct stat st;
+	unsigned int units;
+	int i;
+
+	for (units = 0, i = 0; i < arealist->areas; i++)
+		units += (AREA_LEN(&arealist->area[i]) +
+			  arealist->area[i].size - 1) / arealist->area[i].size;
+
+	j = calloc(1, sizeof(struct journal_t) + (units + 7) / 8);
+	if (j == NULL)
+		return NULL;
+	j->arealist = arealist;
+	memcpy(j->head.magic, JOURNAL_MAGIC, sizeof(j->head.magic));
+	j->head.image = image_hash(arealist);
+	j->head.units = units;
+	j->head.mat = mat;
+	strncpy(j->head.target, target, sizeof(j->head.target) - 1);
+	for (i = 0; j->head.target[i]; i++)
+		if (!isalnum((unsigned char)j->head.target[i]))
+			j->head.target[i] = '_';
+
+	snprintf(j->path, sizeof(j->path),
+		 JOURNALDIR "/" PROGNAME "-%u-%s-%08x.jnl",
+		 (unsigned int)geteuid(), j->head.target, j->head.image);
+	/* shared directory: no symlink, own regular file only */
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if (j->fd < 0) {
+		perror(PROGNAME);
+		free(j);
+		return NULL;
+	}
+	if (fstat(j->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || st.st_nlink != 1 ||
+	    (st.st_mode & 077)) {
+		fprintf(stderr, PROGNAME ": %s: journal not private\n",
+			j->path);
+		close(j->fd);
+		free(j);
+		return NULL;
+	}
+	if (resume && journal_load(j)) {
+		VERBOSE_PRINT("journal %s: %d/%d acked\n",
+			      j->path, j->acked, units);
+		return j;
+	}
+	if (journal_reset(j) < 0) {
+		perror(PROGNAME);
+		journal_close(j, 0);
+		return NULL;
+	}
+	return j;
+}
+
+/* acknowledged units */
+int journal_acked(struct journal_t *j)
+{
+	return j ? j->acked : 0;
+}
+
+/* check written unit */
+int journal_done(struct journal_t *j, unsigned int addr)
+{
+	int no;
+
+	if (j == NULL || (no = unit_no(j, addr)) < 0)
+		return 0;
+	return (j->map[no / 8] >> (no % 8)) & 1;
+}
+
+/* record written unit */
+void journal_ack(struct journal_t *j, unsigned int addr)
+{
+	int no;
+
+	if (j == NULL || (no = unit_no(j, addr)) < 0)
+		return;
+	if (j->map[no / 8] & (1 << (no % 8)))
+		return;
+	j->map[no / 8] |= 1 << (no % 8);
+	j->acked++;
+	pwrite(j->fd, &j->map[no / 8], 1, sizeof(j->head) + no / 8);
+}
+
+/* forget acked units */
+void journal_discard(struct journal_t *j)
+{
+	if (j)
+		journal_reset(j);
+}
+
+/* close journal, remove it when write complete */
+void journal_close(struct journal_t *j, int complete)
+{
+	if (j == NULL)
+		return;
+	close(j->fd);
+	if (complete)
+		unlink(j->path);
+	free(j);
+}
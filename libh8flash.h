@@ -0,0 +1,140 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  library interface
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#ifndef __LIBH8FLASH_H__
+#define __LIBH8FLASH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* writer session (one target) */
+struct h8flash;
+
+struct h8flash_config {
+	int freq;		/* input clock frequency (MHz * 100) */
+	char endian;		/* 'l' / 'b' (new protocol) */
+	int userboot;		/* write user boot MAT */
+	const char *stub;	/* RAM stub for boot mode download */
+	/* control line sequence "dtr=1,rts=0,wait=100,cbus0=1,..." */
+	const char *boot_seq;	/* enter boot mode (before connect) */
+	const char *run_seq;	/* reset into application (release) */
+};
+
+struct h8flash_plan {
+	unsigned int units;	/* write units in target MAT */
+	unsigned int blank;	/* blank units (not written) */
+	unsigned int done;	/* units written by interrupted session */
+	unsigned int unchanged;	/* units same as last write of session */
+	unsigned int write;	/* units to write */
+	unsigned int bytes;	/* bytes to write */
+};
+
+struct h8flash_stats {
+	unsigned long frames;
+	unsigned long retries;
+	unsigned long naks;
+	unsigned long errors;
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	unsigned long syscalls;
+};
+
+/*
+ * port: serial device, "usb" / "usbVVVV:PPPP",
+ *       "tcp://host:port" / "rfc2217://host:port"
+ * all functions except open / close return 0 success, -1 failed.
+ */
+struct h8flash *h8flash_open(const char *port);
+struct h8flash_probe {
+	int answer;		/* boot program answer for 0x55 (0: none) */
+	int protocol;		/* 1: old (0xe6) 2: new (0xc1) 0: others */
+	char target[32];	/* device type */
+};
+
+/* bounded boot program connect and device type inquiry (timeout ms).
+   target must be reset before next connect */
+int h8flash_probe(struct h8flash *h, int timeout, struct h8flash_probe *info);
+/* connect boot program and get target rom map */
+int h8flash_connect(struct h8flash *h, const struct h8flash_config *config);
+/* enter boot mode again (config->boot_seq) and connect.
+   last written image is kept, next write rewrites changed units only */
+int h8flash_reconnect(struct h8flash *h, const struct h8flash_config *config);
+/* connect boot program and print device configuration */
+int h8flash_list(struct h8flash *h, const struct h8flash_config *config);
+/* load image file */
+int h8flash_load(struct h8flash *h, const char *file,
+		 int binary, unsigned long base);
+/* use image of src (read only). src must be closed after h */
+int h8flash_share(struct h8flash *h, struct h8flash *src);
+/* session without target with rom map of connected src (h8flash_load
+   and h8flash_share source only). src can be closed */
+struct h8flash *h8flash_open_image(struct h8flash *src);
+/* per board patch on loaded / shared image, before h8flash_plan.
+   spec "addr:type:value" (see patch.c), board is sequence number */
+int h8flash_patch(struct h8flash *h, const char *spec, unsigned long board);
+/* patch with line of board in csv file */
+int h8flash_patch_csv(struct h8flash *h, const char *file,
+		      unsigned long board);
+void h8flash_unpatch(struct h8flash *h);
+/* load image file (NULL: loaded / shared image) and plan writing.
+   resume: skip journaled units. units same as last write of this
+   session are skipped (block erase protocols) */
+int h8flash_plan(struct h8flash *h, const char *file,
+		 int binary, unsigned long base, int resume,
+		 struct h8flash_plan *plan);
+int h8flash_write(struct h8flash *h);
+/* run control line sequence of config->run_seq */
+int h8flash_release(struct h8flash *h);
+int h8flash_verify(struct h8flash *h);
+/* ranges "start-end[,start-end...]" (hex), NULL is whole MAT */
+int h8flash_dump(struct h8flash *h, const char *ranges, const char *file);
+/* run job on all sessions concurrently (NULL session is skipped),
+   result[i] is job result of h[i] */
+int h8flash_gang(struct h8flash **h, int n,
+		 int (*job)(struct h8flash *h, void *arg), void *arg,
+		 int *result);
+/* keep boot session open (harmless inquiry) */
+int h8flash_keepalive(struct h8flash *h);
+const char *h8flash_port(struct h8flash *h);
+const char *h8flash_target(struct h8flash *h);
+void h8flash_stats(struct h8flash *h, struct h8flash_stats *stats);
+/* record all frames of session with timestamp (h8flash --analyze) */
+int h8flash_trace(struct h8flash *h, const char *file);
+/* impair link of session as spec (rate, delay, jitter, drop, flip, seed,
+   see impair.c). call before h8flash_trace */
+int h8flash_impair(struct h8flash *h, const char *spec);
+/* newline delimited JSON events of session on fd (phase, start, block,
+   retry, end, stats, see progress.c) */
+int h8flash_events(struct h8flash *h, int fd);
+/* write JSON run report of session (phase times, wire counters,
+   throughput). result: result of run (0: success) */
+int h8flash_report(struct h8flash *h, const char *file, int result);
+/* save target geometry, protocol and link timing of connected session,
+   flash erase / program time of complete writes of session */
+int h8flash_save_profile(struct h8flash *h, const char *file);
+/* session of saved profile without target (load and dry run only) */
+struct h8flash *h8flash_open_profile(const char *file,
+				     const struct h8flash_config *config);
+/* print erase blocks, frames, wire bytes and time estimate of loaded
+   image at each bitrate of rates ("bps,bps,..." NULL: default).
+   previous: image on target, incremental write is printed too */
+int h8flash_dryrun(struct h8flash *h, const char *rates, const char *previous,
+		   int binary, unsigned long base);
+/* close port. journal is removed when written image is complete */
+void h8flash_close(struct h8flash *h);
+
+void h8flash_verbose(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
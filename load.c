@@ -0,0 +1,297 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  image file loader
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_GELF_H
+#include <gelf.h>
+#endif
+
+#include "h8flash.h"
+
+#define SREC_MAXLEN (256*2 + 4 + 1)
+
+struct area_t *lookup_area(struct arealist_t *arealist, unsigned int addr)
+{
+	int i;
+	for (i = 0; i < arealist->areas; i++) {
+		if (arealist->area[i].start <= addr &&
+		    arealist->area[i].end >= addr)
+			return &arealist->area[i];
+	}
+	return NULL;
+}
+
+/* read raw binary */
+static int load_binary(FILE *fp, struct arealist_t *arealist,
+		       unsigned long base)
+{
+	int fno;
+	struct stat bin_st;
+	size_t bin_len, len;
+	unsigned int addr;
+	unsigned int offset;
+	struct area_t *area;
+	int i;
+
+	fno = fileno(fp);
+
+	fstat(fno, &bin_st);
+	bin_len = bin_st.st_size;
+	if (base != 0)
+		addr = base;
+	else {
+		/* lowest rom address */
+		addr = arealist->area[0].start;
+		for (i = 1; i < arealist->areas; i++)
+			if (arealist->area[i].start < addr)
+				addr = arealist->area[i].start;
+	}
+
+	while(bin_len > 0) {
+		area = lookup_area(arealist, addr);
+		if (area == NULL) {
+			fprintf(stderr, "%08x is out of ROM.\n", addr);
+			goto error;
+		}
+		offset = addr - area->start;
+		len = bin_len < (area->end - addr + 1)?
+			bin_len:(area->end - addr + 1);
+		if (len > read(fno, area->image + offset, len))
+			goto error_perror;
+		bin_len -= len;
+		addr += len;
+	}
+	fclose(fp);
+	return 0;
+ error_perror:
+	perror(PROGNAME);
+ error:	
+	fclose(fp);
+	return -1;
+}
+
+/* read srec binary */
+static int load_srec(FILE *fp, struct arealist_t *arealist)
+{
+	char *bufp;
+	int buff_size;
+	char linebuf[SREC_MAXLEN + 1];
+	char *lp;
+	char hexbuf[9];
+	char data[255];
+	int sum;
+	int len;
+	unsigned int addr;
+	const static int address_len[]={4,4,6,8,0,4,6,8,6,4};
+	int ret = 0;
+	int l;
+	int type;
+	struct area_t *area;
+
+	while (fgets(linebuf, sizeof(linebuf), fp)) {
+		/* check valid Srecord */
+		if (linebuf[0] != 'S' ||
+		    isdigit(linebuf[1]) == 0)
+			continue;
+		type = linebuf[1] - '0';
+		l = address_len[type];
+		if (type == 6 && l == 0)
+			/* S6 is skip */
+			continue;
+
+		/* get length */
+		memcpy(hexbuf, &linebuf[2], 2);
+		hexbuf[2] = '\0';
+		sum = len = strtoul(hexbuf, NULL, 16);
+
+		/* get address */
+		memcpy(hexbuf, &linebuf[4], l);
+		hexbuf[l] = '\0';
+		addr = strtoul(hexbuf, NULL, 16);
+		len -= l / 2;
+
+		/* address part checksum */
+		lp = &linebuf[4];
+		for (; l > 0; l -= 2, lp += 2) {
+			memcpy(hexbuf, lp, 2);
+			hexbuf[2] = '\0';
+			sum += strtoul(hexbuf, NULL, 16);
+		}
+
+		if (type >=1 && type <=3) {
+			area = lookup_area(arealist, addr);
+			if (area == NULL) {
+				fprintf(stderr, "%08x is out of ROM.", addr);
+				ret = -1;
+				goto error;
+			}
+			bufp = area->image + addr - area->start;
+		} else {
+			bufp = data;
+		}
+		/* parse body */
+		for (; len > 1; --len, lp += 2, buff_size++) {
+			unsigned char d;
+			memcpy(hexbuf, lp, 2);
+			hexbuf[2] = '\0';
+			d = strtoul(hexbuf, NULL, 16);
+			*bufp++ = d;
+			sum    += d;
+		}
+
+		/* checksum */
+		memcpy(hexbuf, lp, 2);
+		hexbuf[2] = '\0';
+		sum += strtoul(hexbuf, NULL, 16);
+		if ((sum & 0xff) != 0xff) {
+			fputs("\n" PROGNAME ": Checksum unmatch\n",stderr);
+			ret = -1;
+			goto error;
+		}
+		if (type == 0 && verbose)
+			printf("S0: %.*s\n", (int)(bufp - data), data);
+		else if (type >= 4 && verbose)
+			printf("skip S%d record\n", type);
+	}
+ error:
+	fclose(fp);
+	return ret;
+}
+
+#ifdef HAVE_GELF_H
+static int load_elf(FILE *fp, struct arealist_t *arealist)
+{
+	unsigned char *romimage = NULL;
+	unsigned int romsize;
+	int fd;
+	size_t n;
+	int i,j;
+	Elf *elf = NULL;
+	GElf_Phdr phdr;
+	unsigned long top, last_addr = 0;
+	int ret = -1;
+	size_t sz, remain;
+	struct area_t *area;
+	
+	elf_version(EV_CURRENT);
+	fd = fileno(fp);
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	if (elf == NULL) {
+		fputs(elf_errmsg(-1), stderr);
+		goto error;
+	}
+	if(elf_kind(elf) != ELF_K_ELF) {
+		fputs("Not ELF executable", stderr);
+		goto error;
+	}
+	elf_getphdrnum(elf, &n);
+	for (i = 0; i < n; i++) {
+		if (gelf_getphdr(elf, i, &phdr) == NULL) {
+			fputs(elf_errmsg(-1), stderr);
+			goto error;
+		}
+		if (phdr.p_type != PT_LOAD)
+			continue ;
+		if (verbose) {
+			printf("   offset   paddr    size\n");
+			printf("%d: %08x %08x %08x\n",
+			       i, phdr.p_offset, phdr.p_paddr, phdr.p_filesz);
+		}
+		if (phdr.p_filesz == 0)
+			continue ;
+		lseek(fd, phdr.p_offset, SEEK_SET);
+		remain = phdr.p_filesz;
+		top = phdr.p_paddr;
+		while(remain > 0) {
+			area = lookup_area(arealist, top);
+			if (area == NULL) {
+				fprintf(stderr, "%08x - %08x is out of ROM",
+					top, top + remain);
+				goto error;
+			}
+			j = remain < (area->end - top + 1)?
+				remain:(area->end - top + 1);
+			sz = read(fd, area->image + top - area->start, j);
+			if (sz != j) {
+				perror(PROGNAME);
+				goto error;
+			}
+			remain -= j;
+			top += j;
+		}
+	}
+	ret = 0;
+error:
+	if (elf)
+		elf_end(elf);
+	fclose(fp);
+	return ret;
+}		
+#endif
+
+/* read rom writing data */
+int load_file(const char *fn, int force_binary,
+		     unsigned long binbase,
+		     struct arealist_t *arealist)
+{
+	FILE *fp = NULL;
+	char linebuf[SREC_MAXLEN + 1];
+	char hexbuf[3];
+	int sum;
+	int len;
+	char *p;
+
+	hexbuf[2] = '\0';
+
+	/* open download data file */
+	fp = fopen(fn, "r");
+	if (fp == NULL) {
+		perror(PROGNAME);
+		return -1;
+	}
+	/* get head */
+	if (fread(linebuf, sizeof(linebuf), 1, fp) < 0 && ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fseek(fp,0,SEEK_SET);
+
+#ifdef HAVE_GELF_H
+	/* check ELF */
+	if (!force_binary && memcmp(linebuf, ELFMAG, SELFMAG) == 0)
+		return load_elf(fp, arealist);
+#endif
+	/* check 'S-record' */
+	if (!force_binary && linebuf[0] == 'S' && isdigit(linebuf[1])) {
+		/* check body (calcurate checksum) */
+		memcpy(hexbuf, &linebuf[2], 2);
+		sum = len = strtoul(hexbuf, NULL, 16);
+		for (p = &linebuf[4]; len > 0; --len, p += 2) {
+			memcpy(hexbuf, p, 2);
+			sum += strtoul(hexbuf, NULL, 16);
+		}
+		if ((sum & 0xff) == 0xff)
+			/* checksum ok. This file is S-record format */
+			return load_srec(fp, arealist);
+	}
+	/* binary file */
+	return load_binary(fp, arealist, binbase);
+}
+
@@ -0,0 +1,105 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  LZSS compressor
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * stream format
+ *  flag byte, then 8 items (LSB first)
+ *   bit 1: literal  1byte
+ *   bit 0: match    2byte  [offset 7-0] [offset 11-8 << 4 | length - 3]
+ *  offset is distance back from current output (1 - 4095),
+ *  length is 3 - 18. match may overlap current output (run).
+ *  window is limited to one frame, decoder needs no history.
+ */
+
+#include <string.h>
+#include "h8flash.h"
+
+#define LZ_MINMATCH 3
+#define LZ_MAXMATCH 18
+#define LZ_WINDOW   4095
+#define LZ_HASH     4096
+#define LZ_MASK     4095
+#define LZ_DEPTH    32
+
+struct lz_t {
+	int head[LZ_HASH];
+	int prev[LZ_MASK + 1];
+};
+
+static __inline__ unsigned int hash(const unsigned char *p)
+{
+	return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (LZ_HASH - 1);
+}
+
+static __inline__ void insert(struct lz_t *lz, const unsigned char *src,
+			      unsigned int pos, unsigned int size)
+{
+	unsigned int h;
+
+	if (pos + LZ_MINMATCH > size)
+		return;
+	h = hash(src + pos);
+	lz->prev[pos & LZ_MASK] = lz->head[h];
+	lz->head[h] = pos;
+}
+
+/* compress src into dst. returns compressed size or -1 over limit */
+int lz_compress(const void *source, unsigned int size,
+		unsigned char *dst, unsigned int limit)
+{
+	const unsigned char *src = source;
+	unsigned int pos, out, flag = 0;
+	unsigned int best, off = 0, max, l;
+	int cand, depth;
+	int bit = 8;
+	struct lz_t lz;
+
+	memset(lz.head, 0xff, sizeof(lz.head));
+	for (pos = 0, out = 0; pos < size; bit++) {
+		if (bit == 8) {
+			if (out >= limit)
+				return -1;
+			flag = out++;
+			dst[flag] = 0;
+			bit = 0;
+		}
+		best = 0;
+		if (pos + LZ_MINMATCH <= size) {
+			max = size - pos < LZ_MAXMATCH ? size - pos : LZ_MAXMATCH;
+			for (cand = lz.head[hash(src + pos)], depth = 0;
+			     cand >= 0 && pos - cand <= LZ_WINDOW &&
+				     depth < LZ_DEPTH;
+			     cand = lz.prev[cand & LZ_MASK], depth++) {
+				for (l = 0; l < max && src[cand + l] == src[pos + l]; l++);
+				if (l > best) {
+					best = l;
+					off = pos - cand;
+					if (l == max)
+						break;
+				}
+			}
+		}
+		if (best >= LZ_MINMATCH) {
+			if (out + 2 > limit)
+				return -1;
+			dst[out++] = off & 0xff;
+			dst[out++] = ((off >> 8) << 4) | (best - LZ_MINMATCH);
+			for (; best > 0; best--, pos++)
+				insert(&lz, src, pos, size);
+		} else {
+			if (out + 1 > limit)
+				return -1;
+			dst[flag] |= 1 << bit;
+			dst[out++] = src[pos];
+			insert(&lz, src, pos++, size);
+		}
+	}
+	return out;
+}
@@ -14,24 +14,15 @@
 
 #include <stdio.h>
 #include <getopt.h>
-#include <stddef.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
-#include <errno.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
+#include <glob.h>
 #include <unistd.h>
-#include <limits.h>
-#ifdef HAVE_GELF_H
-#include <gelf.h>
-#endif
+#include <signal.h>
 
 #include "h8flash.h"
-
-#define SREC_MAXLEN (256*2 + 4 + 1)
-
-int verbose = 0;
+#include "libh8flash.h"
 
 const static struct option long_options[] = {
 	{"userboot", no_argument, NULL, 'u'},
@@ -41,342 +32,323 @@ const static struct option long_options[] = {
 	{"verbose", no_argument, NULL, 'V'},
 	{"list", no_argument, NULL, 'l'},
 	{"endian", required_argument, NULL, 'e'},
-	{"dump", no_argument, NULL, 'd'},
+	{"dump", optional_argument, NULL, 'd'},
+	{"verify", no_argument, NULL, 'c'},
+	{"resume", no_argument, NULL, 'r'},
+	{"stub", required_argument, NULL, 's'},
+	{"gang", required_argument, NULL, 'g'},
+	{"patch", required_argument, NULL, 'P'},
+	{"patch-csv", required_argument, NULL, 'C'},
+	{"board", required_argument, NULL, 'N'},
+	{"station", no_argument, NULL, 'T'},
+	{"match", required_argument, NULL, 'M'},
+	{"log", required_argument, NULL, 'L'},
+	{"scan", optional_argument, NULL, 'A'},
+	{"boot-seq", required_argument, NULL, 'B'},
+	{"run-seq", required_argument, NULL, 'R'},
+	{"daemon", required_argument, NULL, 'D'},
+	{"ctl", required_argument, NULL, 'O'},
+	{"watch", no_argument, NULL, 'W'},
+	{"report", required_argument, NULL, 'j'},
+	{"trace", required_argument, NULL, 't'},
+	{"analyze", required_argument, NULL, 'a'},
+	{"impair", required_argument, NULL, 'I'},
+	{"plan", optional_argument, NULL, 'n'},
+	{"profile", required_argument, NULL, 'F'},
+	{"previous", required_argument, NULL, 'v'},
+	{"events", required_argument, NULL, 'E'},
 	{0, 0, 0, 0}
 };
 
 static void usage(void)
 {
 	puts(PROGNAME " -f input clock frequency [-p port]"
-	     "[-b <baseaddr>][--userboot][-l][-V] filename");
+	     "[-b <baseaddr>][--userboot][-c][-r][-l][-V]"
+	     "[--stub=stub.bin][--patch=addr:type:value]"
+	     "[--patch-csv=file.csv][--board=n]"
+	     "[--boot-seq=seq][--run-seq=seq][--report=file.json]"
+	     "[--trace=file][--impair=spec][--events=fd][--profile=file] "
+	     "filename");
+	puts(PROGNAME " -f input clock frequency --gang=port1,port2,..."
+	     "[-b <baseaddr>][--userboot][-c][-r][-V][--patch...]"
+	     "[--events=fd] filename");
+	puts(PROGNAME " -f input clock frequency --station[--match=KEY=pattern]"
+	     "[--log=file][-b <baseaddr>][--userboot][-c][-V][--patch...] "
+	     "filename");
+	puts(PROGNAME " -f input clock frequency [-p port]"
+	     "--dump[=start-end,...][--userboot][-V] filename");
+	puts(PROGNAME " -f input clock frequency [-p port] --watch"
+	     "[-b <baseaddr>][--userboot][-c][-V][--patch...]"
+	     "[--boot-seq=seq][--run-seq=seq] filename");
+	puts(PROGNAME " -f input clock frequency [-p port | --profile=file]"
+	     "--plan[=bps,...][--previous=file][-b <baseaddr>][--userboot]"
+	     "[--stub=stub.bin][--patch...][-V] filename");
+	puts(PROGNAME " --scan[=port pattern]");
+	puts(PROGNAME " -f input clock frequency --daemon=socket [-p port | "
+	     "--gang=port1,port2,...][--userboot][--stub=stub.bin][-V]");
+	puts(PROGNAME " --ctl=socket command [args...]");
+	puts(PROGNAME " --analyze=trace file");
 }
 
-static struct area_t *lookup_area(struct arealist_t *arealist,
-				  unsigned int addr)
+static int get_freq_num(const char *arg)
 {
-	int i;
-	for (i = 0; i < arealist->areas; i++) {
-		if (arealist->area[i].start <= addr &&
-		    arealist->area[i].end >= addr)
-			return &arealist->area[i];
+	int scale = 100;
+	int period = 0;
+	int val = 0;
+
+	while (*arg && period < 3) {
+		if (period > 0) {
+			scale /= 10;
+			period++;
+		}
+		if (*arg == '.') {
+			period = 1;
+			arg++;
+			continue;
+		}
+		if (!isdigit(*arg))
+			break ;
+		val *= 10;
+		val += *arg & 0x0f;
+		arg++;
 	}
-	return NULL;
+	return val * scale;
 }
 
-/* read raw binary */
-static int write_binary(FILE *fp, struct comm_t *com,
-			struct port_t *p, struct arealist_t *arealist,
-			enum mat_t mat, unsigned long base)
+struct gang_job {
+	const struct h8flash_config *config;
+	const struct patch_list *patch;
+	struct h8flash **h;
+	struct h8flash *base;
+	int resume;
+	int verify;
+};
+
+/* apply per board patches */
+int apply_patch(struct h8flash *h, const struct patch_list *patch,
+		unsigned long board)
 {
-	int fno;
-	struct stat bin_st;
-	size_t bin_len, len;
-	unsigned int addr;
-	unsigned int offset;
-	struct area_t *area;
-
-	fno = fileno(fp);
-
-	fstat(fno, &bin_st);
-	bin_len = bin_st.st_size;
-	addr = base != 0 ? base : arealist->area[0].start;
-
-	while(bin_len > 0) {
-		area = lookup_area(arealist, addr);
-		len = bin_len < (area->end - area->start)?
-			bin_len:(area->end - area->start);
-		offset = addr - area->start;
-		if (len > read(fno, area->image + offset, len))
-			goto error_perror;
-		bin_len -= len;
-		addr += len;
-	}
-	if (!com->write_rom(p, arealist, mat))
-		goto error;
-	fclose(fp);
-	return bin_len;
- error_perror:
-	perror(PROGNAME);
- error:	
-	fclose(fp);
+	int i;
+
+	for (i = 0; i < patch->specs; i++)
+		if (h8flash_patch(h, patch->spec[i], board) < 0)
+			return -1;
+	if (patch->csv && h8flash_patch_csv(h, patch->csv, board) < 0)
+		return -1;
 	return 0;
 }
 
-/* read srec binary */
-static int write_srec(FILE *fp, struct comm_t *com,
-		      struct port_t *p, struct arealist_t *arealist,
-		      enum mat_t mat)
+static int gang_connect(struct h8flash *h, void *arg)
 {
-	unsigned char *romimage = NULL;
-	unsigned char *bufp;
-	unsigned int last_addr = 0;
-	int buff_size;
-	static char linebuf[SREC_MAXLEN + 1];
-	char *lp;
-	char hexbuf[9];
-	char data[255];
-	int sum;
-	int len;
-	unsigned int addr;
-	const static int address_len[]={4,4,6,8,0,4,6,8,6,4};
-	int ret = 0;
-	int l;
-	int type;
-	struct area_t *area;
-
-	while (fgets(linebuf, sizeof(linebuf), fp)) {
-		/* check valid Srecord */
-		if (linebuf[0] != 'S' ||
-		    isdigit(linebuf[1]) == 0)
-			continue;
-		type = linebuf[1] - '0';
-		l = address_len[type];
-		if (type == 6 && l == 0)
-			/* S6 is skip */
-			continue;
+	struct gang_job *job = arg;
 
-		/* get length */
-		memcpy(hexbuf, &linebuf[2], 2);
-		hexbuf[2] = '\0';
-		sum = len = strtoul(hexbuf, NULL, 16);
-
-		/* get address */
-		memcpy(hexbuf, &linebuf[4], l);
-		hexbuf[l] = '\0';
-		addr = strtoul(hexbuf, NULL, 16);
-		len -= l / 2;
-
-		/* address part checksum */
-		lp = &linebuf[4];
-		for (; l > 0; l -= 2, lp += 2) {
-			memcpy(hexbuf, lp, 2);
-			hexbuf[2] = '\0';
-			sum += strtoul(hexbuf, NULL, 16);
-		}
-
-		if (type >=1 && type <=3) {
-			area = lookup_area(arealist, addr);
-			if (area == NULL) {
-				fprintf(stderr, "%08x is out of ROM.", addr);
-				ret = -1;
-				goto error;
-			}
-			bufp = area->image + addr - area->start;
-		} else {
-			bufp = data;
-		}
-		/* parse body */
-		for (; len > 1; --len, lp += 2, buff_size++) {
-			unsigned char d;
-			memcpy(hexbuf, lp, 2);
-			hexbuf[2] = '\0';
-			d = strtoul(hexbuf, NULL, 16);
-			*bufp++ = d;
-			sum    += d;
-		}
+	return h8flash_connect(h, job->config);
+}
 
-		/* checksum */
-		memcpy(hexbuf, lp, 2);
-		hexbuf[2] = '\0';
-		sum += strtoul(hexbuf, NULL, 16);
-		if ((sum & 0xff) != 0xff) {
-			fputs("\n" PROGNAME ": Checksum unmatch\n",stderr);
-			ret = -1;
-			goto error;
-		}
-		if (type = 0 && verbose)
-			printf("S0: %256s", data);
-		else if (type >= 4 && verbose)
-			printf("skip S%d record\n", type);
-	}
-	ret = com->write_rom(p, arealist, mat);
- error:
-	fclose(fp);
-	return ret;
+static int gang_write(struct h8flash *h, void *arg)
+{
+	struct gang_job *job = arg;
+	int no;
+
+	/* board number is port order */
+	for (no = 0; job->h[no] != h; no++);
+	if (h8flash_share(h, job->base) < 0 ||
+	    apply_patch(h, job->patch, job->patch->board + no) < 0 ||
+	    h8flash_plan(h, NULL, 0, 0, job->resume, NULL) < 0 ||
+	    h8flash_write(h) < 0)
+		return -1;
+	if (job->verify && h8flash_verify(h) < 0)
+		return -1;
+	return h8flash_release(h);
 }
 
-#ifdef HAVE_GELF_H
-static int write_elf(FILE *fp, struct comm_t *com,
-		     struct port_t *p, struct arealist_t *arealist,
-		     enum mat_t mat)
+/* write all ports concurrently. returns number of failed ports */
+static int gang(char *ports, const struct h8flash_config *config,
+		const struct patch_list *patches,
+		const char *file, int binary, unsigned long base,
+		int resume, int verify, int events)
 {
-	unsigned char *romimage = NULL;
-	unsigned int romsize;
-	int fd;
-	size_t n;
-	int i,j;
-	Elf *elf = NULL;
-	GElf_Phdr phdr;
-	unsigned long top, last_addr = 0;
-	int ret = -1;
-	size_t sz, remain;
-	struct area_t *area;
-	
-	elf_version(EV_CURRENT);
-	fd = fileno(fp);
-	elf = elf_begin(fd, ELF_C_READ, NULL);
-	if (elf == NULL) {
-		fputs(elf_errmsg(-1), stderr);
+	struct gang_job job = {config, patches, NULL, NULL, resume, verify};
+	struct h8flash **h;
+	char **name;
+	int *result;
+	char *port;
+	int n, i;
+	int failed = 0;
+
+	for (n = 1, port = ports; *port; port++)
+		if (*port == ',')
+			n++;
+	h = calloc(n, sizeof(struct h8flash *));
+	name = calloc(n, sizeof(char *));
+	result = calloc(n, sizeof(int));
+	if (h == NULL || name == NULL || result == NULL) {
+		perror(PROGNAME);
+		return n;
+	}
+	for (i = 0, port = strtok(ports, ","); port && i < n;
+	     port = strtok(NULL, ","), i++) {
+		name[i] = port;
+		h[i] = h8flash_open(port);
+		if (h[i] && events >= 0)
+			h8flash_events(h[i], events);
+		result[i] = -1;
+	}
+	n = i;
+	job.h = h;
+
+	if (h8flash_gang(h, n, gang_connect, &job, result) < 0)
 		goto error;
+	for (i = 0; i < n; i++) {
+		if (h[i] && result[i] < 0) {
+			h8flash_close(h[i]);
+			h[i] = NULL;
+		} else if (h[i] && job.base == NULL)
+			job.base = h[i];
 	}
-	if(elf_kind(elf) != ELF_K_ELF) {
-		fputs("Not ELF executable", stderr);
+	/* load image once, other ports share it */
+	if (job.base == NULL ||
+	    h8flash_load(job.base, file, binary, base) < 0) {
+		for (i = 0; i < n; i++)
+			result[i] = -1;
 		goto error;
 	}
-	elf_getphdrnum(elf, &n);
+	h8flash_gang(h, n, gang_write, &job, result);
+
+ error:
 	for (i = 0; i < n; i++) {
-		if (gelf_getphdr(elf, i, &phdr) == NULL) {
-			fputs(elf_errmsg(-1), stderr);
-			goto error;
-		}
-		if (phdr.p_type != PT_LOAD)
-			continue ;
-		if (verbose) {
-			printf("   offset   paddr    size\n");
-			printf("%d: %08x %08x %08x\n",
-			       i, phdr.p_offset, phdr.p_paddr, phdr.p_filesz);
-		}
-		if (phdr.p_filesz == 0)
-			continue ;
-		lseek(fd, phdr.p_offset, SEEK_SET);
-		remain = phdr.p_filesz;
-		top = phdr.p_paddr;
-		while(remain > 0) {
-			area = lookup_area(arealist, top);
-			if (area == NULL) {
-				fprintf(stderr, "%08x - %08x is out of ROM",
-					top, top + remain);
-				goto error;
-			}
-			j = remain < (area->end - area->start)?
-				remain:(area->size);
-			sz = read(fd, area->image + top - area->start, j);
-			if (sz != j) {
-				perror(PROGNAME);
-				goto error;
-			}
-			remain -= j;
-			top += j;
-		}
+		if (h[i] == NULL)
+			result[i] = -1;
+		if (result[i] < 0)
+			failed++;
+		printf("%s: %s\n", name[i], (result[i] == 0) ? "done" :
+		       (h[i] ? "write failed" : "connect failed"));
+		/* base session owns shared image, close last */
+		if (h[i] != job.base)
+			h8flash_close(h[i]);
 	}
-	ret = com->write_rom(p, arealist, mat);
-error:
-	if (elf)
-		elf_end(elf);
-	fclose(fp);
-	return ret;
-}		
-#endif
+	h8flash_close(job.base);
+	free(result);
+	free(name);
+	free(h);
+	return failed;
+}
 
-/* read rom writing data */
-static int writefile_to_rom(char *fn, int force_binary,
-			    unsigned long binbase,
-			    struct comm_t *com,
-			    struct port_t *port,
-			    struct arealist_t *arealist,
-			    enum mat_t mat)
+struct scan_job {
+	struct h8flash **h;
+	struct h8flash_probe *info;
+};
+
+static int scan_probe(struct h8flash *h, void *arg)
 {
-	FILE *fp = NULL;
-	static char linebuf[SREC_MAXLEN + 1];
-	char hexbuf[3];
-	int sum;
-	int len;
-	char *p;
-
-	hexbuf[2] = '\0';
-
-	/* open download data file */
-	fp = fopen(fn, "r");
-	if (fp == NULL) {
-		perror(PROGNAME);
-		return -1;
-	}
-	/* get head */
-	if (fread(linebuf, sizeof(linebuf), 1, fp) < 0 && ferror(fp)) {
-		fclose(fp);
-		return -1;
-	}
-	fseek(fp,0,SEEK_SET);
+	struct scan_job *job = arg;
+	int no;
 
-#ifdef HAVE_GELF_H
-	/* check ELF */
-	if (!force_binary && memcmp(linebuf, ELFMAG, SELFMAG) == 0)
-		return write_elf(fp, com, port, arealist, mat);
-#endif
-	/* check 'S-record' */
-	if (!force_binary && linebuf[0] == 'S' && isdigit(linebuf[1])) {
-		/* check body (calcurate checksum) */
-		memcpy(hexbuf, &linebuf[2], 2);
-		sum = len = strtoul(hexbuf, NULL, 16);
-		for (p = &linebuf[4]; len > 0; --len, p += 2) {
-			memcpy(hexbuf, p, 2);
-			sum += strtoul(hexbuf, NULL, 16);
-		}
-		if ((sum & 0xff) == 0xff)
-			/* checksum ok. This file is S-record format */
-			return write_srec(fp, com, port, arealist, mat);
-	}
-	/* binary file */
-	return write_binary(fp, com, port, arealist, mat, binbase);
+	for (no = 0; job->h[no] != h; no++);
+	return h8flash_probe(h, SCAN_TIMEOUT, &job->info[no]);
 }
 
-/* get target rommap */
-static struct arealist_t *get_rominfo(struct comm_t *com, struct port_t *port,
-				    enum mat_t mat)
+/* daemon with port list */
+static int daemon_ports(const char *sock, char *ports,
+			const struct h8flash_config *config)
 {
-	struct arealist_t *arealist = NULL;
-	int c;
-	
-	/* get target rommap list */
-	arealist = com->get_arealist(port, mat);
-	if (arealist == NULL) {
-		if (errno != 0)
-			perror(PROGNAME);
-		else
-			fputs("area list error\n", stderr);
-		return NULL;
+	char **list;
+	char *port;
+	int n, r;
+
+	for (n = 1, port = ports; *port; port++)
+		if (*port == ',')
+			n++;
+	list = calloc(n, sizeof(char *));
+	if (list == NULL)
+		return -1;
+	for (n = 0, port = strtok(ports, ","); port; port = strtok(NULL, ","))
+		list[n++] = port;
+	r = daemon_main(sock, list, n, config);
+	free(list);
+	return r;
+}
+
+/* probe all boot mode targets concurrently */
+static int scan(const char *pattern)
+{
+	struct scan_job job;
+	glob_t g;
+	int *result;
+	size_t i;
+	int found = 0;
+
+	if (glob(pattern, GLOB_BRACE, NULL, &g) != 0) {
+		puts("no port");
+		return 1;
 	}
-	if (verbose) {
-		printf("area map\n");
-		for (c = 0; c < arealist->areas; c++)
-			printf("%08x - %08x %08xbyte\n",
-			       arealist->area[c].start, 
-			       arealist->area[c].end,
-			       arealist->area[c].size); 
+	job.h = calloc(g.gl_pathc, sizeof(struct h8flash *));
+	job.info = calloc(g.gl_pathc, sizeof(struct h8flash_probe));
+	result = calloc(g.gl_pathc, sizeof(int));
+	if (job.h == NULL || job.info == NULL || result == NULL) {
+		perror(PROGNAME);
+		goto error;
 	}
-
-	/* check write area info */
-	if (arealist->areas < 0) {
-		fputs("illigal areamap\n", stderr);
-		free(arealist);
-		return NULL;
+	for (i = 0; i < g.gl_pathc; i++)
+		job.h[i] = h8flash_open(g.gl_pathv[i]);
+	h8flash_gang(job.h, g.gl_pathc, scan_probe, &job, result);
+	for (i = 0; i < g.gl_pathc; i++) {
+		printf("%s: ", g.gl_pathv[i]);
+		if (job.h[i] == NULL)
+			puts("busy");
+		else if (job.info[i].protocol)
+			printf("v%d (%02x) %s\n", job.info[i].protocol,
+			       job.info[i].answer, job.info[i].target);
+		else if (job.info[i].answer == 0xaa)
+			puts("boot mode download (aa)");
+		else if (job.info[i].answer)
+			printf("unknown answer %02x\n", job.info[i].answer);
+		else
+			puts("no answer");
+		if (result[i] == 0)
+			found++;
+		h8flash_close(job.h[i]);
 	}
-	return arealist;
+ error:
+	free(result);
+	free(job.info);
+	free(job.h);
+	globfree(&g);
+	return found ? 0 : 1;
 }
 
-static int get_freq_num(const char *arg)
+/* print write plan. profile: target geometry file
+   (not exist: connect target and save) */
+static int dryrun(const char *port, const struct h8flash_config *config,
+		  const char *profile, const char *rates, const char *previous,
+		  const struct patch_list *patch,
+		  const char *file, int binary, unsigned long base)
 {
-	int scale = 100;
-	int period = 0;
-	int val = 0;
+	struct h8flash *h;
+	int r = -1;
 
-	while (*arg && period < 3) {
-		if (period > 0) {
-			scale /= 10;
-			period++;
-		}
-		if (*arg == '.') {
-			period = 1;
-			arg++;
-			continue;
+	if (profile && access(profile, R_OK) == 0) {
+		h = h8flash_open_profile(profile, config);
+		if (h == NULL)
+			return 1;
+	} else {
+		h = h8flash_open(port);
+		if (h == NULL || h8flash_connect(h, config) < 0)
+			goto error;
+		if (profile) {
+			if (h8flash_save_profile(h, profile) < 0)
+				goto error;
+			printf("profile %s saved\n", profile);
 		}
-		if (!isdigit(*arg))
-			break ;
-		val *= 10;
-		val += *arg & 0x0f;
-		arg++;
 	}
-	return val * scale;
+	/* same image as write (patch overlay) */
+	if (h8flash_load(h, file, binary, base) < 0 ||
+	    apply_patch(h, patch, patch->board) < 0)
+		goto error;
+	r = h8flash_dryrun(h, rates, previous, binary, base);
+ error:
+	h8flash_close(h);
+	return r < 0 ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
@@ -384,30 +356,49 @@ int main(int argc, char *argv[])
 	char port[FILENAME_MAX] = DEFAULT_SERIAL;
 	int c;
 	int long_index;
-	int input_freq = 0;
 	int force_binary = 0;
 	int config_list = 0;
+	int verify = 0;
+	int dump = 0;
+	int resume = 0;
+	int verbose_mode = 0;
+	char *dump_ranges = NULL;
+	char *gang_ports = NULL;
+	const char *scan_ports = NULL;
+	const char *daemon_socket = NULL;
+	const char *ctl_socket = NULL;
+	const char *report = NULL;
+	const char *trace = NULL;
+	const char *impair = NULL;
+	const char *profile = NULL;
+	const char *previous = NULL;
+	const char *plan_rates = NULL;
+	int plan = 0;
+	int events = -1;
+	char *end;
+	struct patch_list patches = {NULL, 0, NULL, 0};
+	int station_mode = 0;
+	int watch_mode = 0;
 	int r;
-	struct port_t *p = NULL;
-	struct comm_t *com = NULL;
-	struct arealist_t *arealist;
-	enum mat_t mat = user;
-	char endian='l';
+	struct h8flash *h = NULL;
+	struct h8flash_config config = {.endian = 'l'};
+	struct station_config station_config = {&config, &patches};
+	struct h8flash_stats stats;
 	unsigned long binbase = 0;
 
 	/* parse argment */
-	while ((c = getopt_long(argc, argv, "p:f:b::Vle:",
+	while ((c = getopt_long(argc, argv, "p:f:b::Vle:cr",
 				long_options, &long_index)) >= 0) {
 		switch (c) {
 		case 'u':
-			mat = userboot;
+			config.userboot = 1;
 			break ;
 		case 'p':
 			strncpy(port, optarg, sizeof(port));
 			port[sizeof(port) - 1] = '\0';
 			break ;
 		case 'f':
-			input_freq = get_freq_num(optarg);
+			config.freq = get_freq_num(optarg);
 			break ;
 		case 'b':
 			force_binary = 1;
@@ -415,14 +406,105 @@ int main(int argc, char *argv[])
 				binbase = strtoul(optarg, NULL, 16);
 			break ;
 		case 'V':
-			verbose = 1;
+			verbose_mode = 1;
+			h8flash_verbose(1);
 			break ;
 		case 'l':
 			config_list = 1;
 			break;
+		case 'c':
+			verify = 1;
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 's':
+			config.stub = optarg;
+			break;
+		case 'g':
+			gang_ports = optarg;
+			break;
+		case 'P':
+			if (patches.spec == NULL)
+				patches.spec = calloc(argc, sizeof(char *));
+			if (patches.spec == NULL)
+				return 1;
+			patches.spec[patches.specs++] = optarg;
+			break;
+		case 'C':
+			patches.csv = optarg;
+			break;
+		case 'T':
+			station_mode = 1;
+			break;
+		case 'M':
+			if (station_config.match == NULL)
+				station_config.match = calloc(argc, sizeof(char *));
+			if (station_config.match == NULL)
+				return 1;
+			station_config.match[station_config.matches++] = optarg;
+			break;
+		case 'L':
+			station_config.log = optarg;
+			break;
+		case 'B':
+			config.boot_seq = optarg;
+			break;
+		case 'R':
+			config.run_seq = optarg;
+			break;
+		case 'D':
+			daemon_socket = optarg;
+			break;
+		case 'O':
+			ctl_socket = optarg;
+			break;
+		case 'W':
+			watch_mode = 1;
+			break;
+		case 'j':
+			report = optarg;
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'a':
+			return analyze(optarg);
+		case 'I':
+			impair = optarg;
+			break;
+		case 'n':
+			plan = 1;
+			plan_rates = optarg;
+			break;
+		case 'F':
+			profile = optarg;
+			break;
+		case 'v':
+			previous = optarg;
+			break;
+		case 'E':
+			events = strtol(optarg, &end, 0);
+			if (*optarg == '\0' || *end || events < 0) {
+				usage();
+				return 1;
+			}
+			/* closed reader stops stream, not writer */
+			signal(SIGPIPE, SIG_IGN);
+			break;
+		case 'A':
+			scan_ports = optarg ? optarg : SCAN_PORTS;
+			break;
+		case 'N':
+			patches.board = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dump = 1;
+			dump_ranges = optarg;
+			break;
 		case 'e':
-			endian = optarg[0];
-			if (endian != 'l' && endian !='b') {
+			config.endian = optarg[0];
+			if (config.endian != 'l' && config.endian !='b') {
 				usage();
 				return 1;
 			}
@@ -433,66 +515,132 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc && input_freq == 0 && !config_list) {
+	if (scan_ports)
+		return scan(scan_ports);
+	if (ctl_socket) {
+		if (optind >= argc) {
+			usage();
+			return 1;
+		}
+		return daemon_ctl(ctl_socket, argc - optind, argv + optind);
+	}
+	if (daemon_socket)
+		return daemon_ports(daemon_socket, gang_ports ? gang_ports : port,
+				    &config) < 0 ? 1 : 0;
+
+	if (optind >= argc && config.freq == 0 && !config_list) {
 		usage();
 		return 1;
 	}
 
-	r = 1;
-#ifdef HAVE_USB_H
-	if (strncasecmp(port, "usb", 3) == 0) {
-		unsigned short vid = DEFAULT_VID;
-		unsigned short pid = DEFAULT_PID;
-		if (strlen(port) > 3) {
-			if (sscanf("%04x:%04x", port + 3, &vid, &pid) != 2) {
-				fputs("Unkonwn USB device id", stderr);
-				goto error;
-			}
+	if (plan) {
+		if (optind >= argc || station_mode || gang_ports ||
+		    config_list || dump || watch_mode) {
+			usage();
+			return 1;
 		}
-		p = open_usb(vid, pid);
-	} else
-		p = open_serial(port);
-#else
-	p = open_serial(port);
-#endif
-	if (p == NULL)
-		goto error;
+		return dryrun(port, &config, profile, plan_rates, previous,
+			      &patches, argv[optind], force_binary, binbase);
+	}
 
-	switch (p->connect_target(port)) {
-	case 0xff:
-		r = -1;
-		goto error;
-	case 0xe6:
-		VERBOSE_PRINT("Detect old protocol\n");
-		com = comm_v1();
-		break;
-	case 0xc1:
-		VERBOSE_PRINT("Detect new protocol\n");
-		com = comm_v2();
-		break;
-	default:
-		fputs("unknown_target", stderr);
-		goto error;
+	if (station_mode) {
+		if (optind >= argc || config_list || dump || gang_ports ||
+		    watch_mode || report || trace || impair || events >= 0) {
+			usage();
+			return 1;
+		}
+		station_config.file = argv[optind];
+		station_config.binary = force_binary;
+		station_config.base = binbase;
+		station_config.verify = verify;
+		station_config.verbose = verbose_mode;
+		station(&station_config);
+		return 1;
 	}
 
+	if (gang_ports) {
+		if (optind >= argc || config_list || dump || watch_mode ||
+		    report || trace || impair) {
+			usage();
+			return 1;
+		}
+		return gang(gang_ports, &config, &patches, argv[optind],
+			    force_binary, binbase, resume, verify,
+			    events) ? 1 : 0;
+	}
+
+	r = 1;
+	h = h8flash_open(port);
+	if (h == NULL || (impair && h8flash_impair(h, impair) < 0) ||
+	    (trace && h8flash_trace(h, trace) < 0) ||
+	    (events >= 0 && h8flash_events(h, events) < 0))
+		goto error;
+
 	if (config_list) {
-		com->dump_configs(p);
-		p->close();
-		return 0;
+		r = h8flash_list(h, &config);
+		h8flash_close(h);
+		return r;
 	}
 
-	if (com->setup_connection(p, input_freq, endian) < 0)
+	if (optind >= argc || (watch_mode && (dump || resume))) {
+		usage();
 		goto error;
-	puts("Connect target");
+	}
 
-	if (!(arealist = get_rominfo(com, p, mat)))
+	if ((r = h8flash_connect(h, &config)) < 0)
 		goto error;
 
-	r = writefile_to_rom(argv[optind], force_binary, binbase,
-			     com, p, arealist, mat);
+	if (watch_mode) {
+		struct watch_config w = {&config, &patches, argv[optind],
+					 force_binary, binbase, verify};
+		r = watch(h, &w);
+		goto error;
+	}
+
+	if (dump) {
+		r = h8flash_dump(h, dump_ranges, argv[optind]);
+		if (r == 0)
+			r = h8flash_release(h);
+		goto error;
+	}
+
+	if (patches.specs || patches.csv) {
+		/* loaded image + patch overlay */
+		if ((r = h8flash_load(h, argv[optind], force_binary, binbase)) < 0 ||
+		    (r = apply_patch(h, &patches, patches.board)) < 0 ||
+		    (r = h8flash_plan(h, NULL, 0, 0, resume, NULL)) < 0)
+			goto error;
+	} else {
+		r = h8flash_plan(h, argv[optind], force_binary, binbase,
+				 resume, NULL);
+		if (r < 0)
+			goto error;
+	}
+
+	r = h8flash_write(h);
+	if (r == 0 && verify) {
+		puts("Verify...");
+		r = h8flash_verify(h);
+	}
+	/* profile with flash time of this write */
+	if (r == 0 && profile) {
+		r = h8flash_save_profile(h, profile);
+		if (r == 0)
+			printf("profile %s saved\n", profile);
+	}
+	if (r == 0)
+		r = h8flash_release(h);
  error:
-	puts((r==0)?"done": "write failed");
-	if (p)
-		p->close();
+	if (h) {
+		h8flash_stats(h, &stats);
+		if (verbose_mode || stats.retries)
+			printf("frames %lu, retries %lu, nak %lu, errors %lu\n",
+			       stats.frames, stats.retries,
+			       stats.naks, stats.errors);
+		if (report && h8flash_report(h, report, r) == 0)
+			printf("report %s\n", report);
+	}
+	puts((r==0)?"done": (dump ? "dump failed" : "write failed"));
+	h8flash_close(h);
 	return r;
 }
@@ -0,0 +1,487 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  network I/O (raw TCP / RFC2217)
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * tcp://host:port      raw serial server. bitrate is fixed by server
+ *                      (no setbaud), target must select same bitrate.
+ * rfc2217://host:port  telnet com port control, setbaud is sent to
+ *                      server as SET-BAUDRATE and waits answer.
+ *
+ * send data is queued and sent in one segment when waiting answer
+ * (TCP_NODELAY), one frame of protocol is one segment.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "h8flash.h"
+
+#define TRY1COUNT 60
+#define BAUD_ADJUST_LEN 30
+/* receive timeout (ms) */
+#define RX_TIMEOUT 10000
+/* probe reply wait (ms) */
+#define PROBE_WAIT 100
+/* server answer timeout (ms) */
+#define NET_TIMEOUT 3000
+#define NET_TXBUF 2048
+
+/* telnet */
+#define IAC  255
+#define DONT 254
+#define DO   253
+#define WONT 252
+#define WILL 251
+#define SB   250
+#define SE   240
+#define OPT_BINARY  0
+#define OPT_SGA     3
+#define OPT_COMPORT 44
+
+/* com port option (client -> server, server answer is +100) */
+#define CPO_BAUDRATE 1
+#define CPO_DATASIZE 2
+#define CPO_PARITY   3
+#define CPO_STOPSIZE 4
+#define CPO_CONTROL  5
+#define CPO_PURGE    12
+
+enum telnet_state {TN_DATA, TN_IAC, TN_OPT, TN_SB, TN_SB_IAC};
+
+struct net_port_t {
+	struct port_t port;
+	char name[FILENAME_MAX];
+	int rfc2217;
+	unsigned char txbuf[NET_TXBUF];
+	int txlen;
+	unsigned char rxbuf[1024];
+	int rxpos;
+	int rxcount;
+	/* telnet receive */
+	enum telnet_state state;
+	unsigned char verb;
+	unsigned char sb[16];
+	int sblen;
+	/* SET-BAUDRATE answered */
+	int baud_ack;
+};
+
+#define NET(p) ((struct net_port_t *)(p))
+
+/* send queued data */
+static int tx_flush(struct port_t *p)
+{
+	struct net_port_t *np = NET(p);
+	int pos, r;
+
+	for (pos = 0; pos < np->txlen; pos += r) {
+		r = send(p->fd, np->txbuf + pos, np->txlen - pos, MSG_NOSIGNAL);
+		p->stats.syscalls++;
+		if (r > 0)
+			p->stats.tx_bytes += r;
+		if (r < 0 && errno == EINTR)
+			r = 0;
+		else if (r < 0) {
+			np->txlen = 0;
+			return -1;
+		}
+	}
+	np->txlen = 0;
+	return 0;
+}
+
+static int tx_put(struct port_t *p, unsigned char c)
+{
+	struct net_port_t *np = NET(p);
+
+	if (np->txlen >= NET_TXBUF && tx_flush(p) < 0)
+		return -1;
+	np->txbuf[np->txlen++] = c;
+	return 0;
+}
+
+/* queue data (IAC is doubled on telnet) */
+static int send_data(struct port_t *p, const unsigned char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (NET(p)->rfc2217 && buf[i] == IAC && tx_put(p, IAC) < 0)
+			return -1;
+		if (tx_put(p, buf[i]) < 0)
+			return -1;
+	}
+	return len;
+}
+
+static void telnet_cmd(struct port_t *p, unsigned char verb, unsigned char opt)
+{
+	tx_put(p, IAC);
+	tx_put(p, verb);
+	tx_put(p, opt);
+}
+
+/* com port option subnegotiation */
+static void comport(struct port_t *p, unsigned char cmd,
+		    const unsigned char *val, int len)
+{
+	telnet_cmd(p, SB, OPT_COMPORT);
+	tx_put(p, cmd);
+	send_data(p, val, len);
+	tx_put(p, IAC);
+	tx_put(p, SE);
+}
+
+static void negotiate(struct port_t *p, unsigned char verb, unsigned char opt)
+{
+	/* answer of own request */
+	if (opt == OPT_BINARY || opt == OPT_SGA || opt == OPT_COMPORT)
+		return;
+	if (verb == WILL)
+		telnet_cmd(p, DONT, opt);
+	else if (verb == DO)
+		telnet_cmd(p, WONT, opt);
+}
+
+/* strip telnet commands from received data */
+static int telnet_rx(struct port_t *p, unsigned char *buf, int len)
+{
+	struct net_port_t *np = NET(p);
+	unsigned char c;
+	int i, n;
+
+	for (n = 0, i = 0; i < len; i++) {
+		c = buf[i];
+		switch (np->state) {
+		case TN_DATA:
+			if (c == IAC)
+				np->state = TN_IAC;
+			else
+				buf[n++] = c;
+			break;
+		case TN_IAC:
+			np->state = TN_DATA;
+			if (c == IAC)
+				buf[n++] = c;
+			else if (c >= WILL) {
+				np->verb = c;
+				np->state = TN_OPT;
+			} else if (c == SB) {
+				np->sblen = 0;
+				np->state = TN_SB;
+			}
+			break;
+		case TN_OPT:
+			negotiate(p, np->verb, c);
+			np->state = TN_DATA;
+			break;
+		case TN_SB:
+			if (c == IAC)
+				np->state = TN_SB_IAC;
+			else if (np->sblen < sizeof(np->sb))
+				np->sb[np->sblen++] = c;
+			break;
+		case TN_SB_IAC:
+			if (c == IAC) {
+				if (np->sblen < sizeof(np->sb))
+					np->sb[np->sblen++] = c;
+				np->state = TN_SB;
+				break;
+			}
+			np->state = TN_DATA;
+			if (c == SE && np->sblen >= 2 &&
+			    np->sb[0] == OPT_COMPORT &&
+			    np->sb[1] == CPO_BAUDRATE + 100)
+				np->baud_ack = 1;
+			break;
+		}
+	}
+	return n;
+}
+
+/* wait socket readable. 1: ready 0: timeout -1: error */
+static int wait_rx(struct port_t *p, int timeout)
+{
+	struct pollfd pfd;
+
+	if (tx_flush(p) < 0)
+		return -1;
+	if (p->wait)
+		return p->wait(p, timeout, WAIT_RX);
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+	p->stats.syscalls++;
+	return poll(&pfd, 1, timeout);
+}
+
+/* receive into rxbuf. 1: received (may be telnet command only)
+   0: timeout -1: error */
+static int fill(struct port_t *p, int timeout)
+{
+	struct net_port_t *np = NET(p);
+	int r;
+
+	if (np->rxpos > 0) {
+		memmove(np->rxbuf, np->rxbuf + np->rxpos,
+			np->rxcount - np->rxpos);
+		np->rxcount -= np->rxpos;
+		np->rxpos = 0;
+	}
+	if (np->rxcount >= sizeof(np->rxbuf))
+		return 1;
+	r = wait_rx(p, timeout);
+	if (r < 1)
+		return r;
+	r = recv(p->fd, np->rxbuf + np->rxcount,
+		 sizeof(np->rxbuf) - np->rxcount, 0);
+	p->stats.syscalls++;
+	if (r <= 0)
+		return -1;
+	p->stats.rx_bytes += r;
+	if (np->rfc2217)
+		r = telnet_rx(p, np->rxbuf + np->rxcount, r);
+	np->rxcount += r;
+	return 1;
+}
+
+/* receive 1byte */
+static int receive_byte(struct port_t *p, unsigned char *data)
+{
+	struct net_port_t *np = NET(p);
+
+	*data = 0;
+	/* telnet command only segment has no data */
+	while (np->rxpos >= np->rxcount)
+		if (fill(p, RX_TIMEOUT) < 1)
+			return -1;
+	*data = np->rxbuf[np->rxpos++];
+	return 1;
+}
+
+/* discard received data */
+static void flush(struct port_t *p)
+{
+	struct net_port_t *np = NET(p);
+
+	if (np->rfc2217)
+		comport(p, CPO_PURGE, (const unsigned char *)"\001", 1);
+	np->rxpos = np->rxcount = 0;
+	while (fill(p, 0) > 0)
+		np->rxpos = np->rxcount = 0;
+}
+
+/* set server bitrate */
+static int setbaud(struct port_t *p, int bitrate)
+{
+	struct net_port_t *np = NET(p);
+	unsigned char val[4];
+	unsigned long baud = bitrate * 100;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		val[i] = baud >> (24 - i * 8);
+	np->baud_ack = 0;
+	comport(p, CPO_BAUDRATE, val, 4);
+	/* data arrived before answer is kept */
+	for (i = 0; i < NET_TIMEOUT / 100 && !np->baud_ack; i++)
+		if (fill(p, 100) < 0)
+			break;
+	if (!np->baud_ack) {
+		fprintf(stderr, PROGNAME ": %s no SET-BAUDRATE answer\n",
+			p->dev);
+		return 0;
+	}
+	p->bitrate = bitrate;
+	return 1;
+}
+
+/* boot program bitrate adjust and select protocol */
+static int autobaud(struct port_t *p, int tries, int wait, int quiet)
+{
+	unsigned char buf[BAUD_ADJUST_LEN];
+	int try1, r;
+
+	for (try1 = 0; try1 < tries; try1++) {
+		memset(buf, 0x00, BAUD_ADJUST_LEN);
+		/* send dummy data */
+		send_data(p, buf, BAUD_ADJUST_LEN);
+		/* wait reply */
+		r = fill(p, wait);
+		if (r == -1)
+			return 0xff;
+		if (NET(p)->rxpos < NET(p)->rxcount && receive_byte(p, buf) == 1 &&
+		    buf[0] == 0)
+			goto connect;
+		if (try1 > 0 && !quiet) {
+			putchar('.');
+			fflush(stdout);
+		}
+	}
+	if (!quiet)
+		putchar('\n');
+	return 0xff;
+connect:
+	if (!quiet)
+		putchar('\n');
+	/* connect done */
+	NET(p)->rxpos = NET(p)->rxcount = 0;
+	buf[0] = 0x55;
+	send_data(p, buf, 1);
+	if (quiet && fill(p, wait) < 1)
+		return 0xff;
+	if (receive_byte(p, buf) == 1)
+		return buf[0]; /* ok */
+	else
+		return 0xff; /* ng */
+}
+
+/* connect to target CPU */
+static int connect_target(struct port_t *p)
+{
+	/* wait connection establish  */
+	printf("Connecting via %s.", p->dev);
+	fflush(stdout);
+	return autobaud(p, TRY1COUNT, 1000, 0);
+}
+
+/* bounded connect (timeout ms) */
+static int probe(struct port_t *p, int timeout)
+{
+	flush(p);
+	return autobaud(p, timeout / PROBE_WAIT > 0 ? timeout / PROBE_WAIT : 1,
+			PROBE_WAIT, 1);
+}
+
+static void port_close(struct port_t *p)
+{
+	tx_flush(p);
+	close(p->fd);
+	free(p);
+}
+
+static const struct port_t net_port = {
+	.type = net,
+	.dev = NULL,
+	.send_data = send_data,
+	.receive_byte = receive_byte,
+	.connect_target = connect_target,
+	.probe = probe,
+	.setbaud = setbaud,
+	.flush = flush,
+	.close = port_close,
+	.settle = BITRATE_SETTLE,
+};
+
+/* "host:port" / "[v6addr]:port" */
+static int net_connect(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port;
+	int fd = -1;
+	int one = 1;
+	int n;
+
+	if (addr[0] == '[') {
+		n = strcspn(addr + 1, "]");
+		port = addr + n + 2;
+		addr++;
+	} else {
+		n = strcspn(addr, ":");
+		port = addr + n;
+	}
+	if (*port != ':' || n >= sizeof(host)) {
+		fprintf(stderr, PROGNAME ": bad address %s\n", addr);
+		return -1;
+	}
+	memcpy(host, addr, n);
+	host[n] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	n = getaddrinfo(host, port + 1, &hints, &res);
+	if (n != 0) {
+		fprintf(stderr, PROGNAME ": %s: %s\n", host, gai_strerror(n));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		perror(host);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	return fd;
+}
+
+/* network port open. url is tcp://host:port or rfc2217://host:port */
+struct port_t *open_net(const char *url)
+{
+	struct net_port_t *np;
+	const char *addr;
+
+	np = calloc(1, sizeof(struct net_port_t));
+	if (np == NULL) {
+		perror(PROGNAME);
+		return NULL;
+	}
+	np->port = net_port;
+	snprintf(np->name, sizeof(np->name), "%s", url);
+	np->port.dev = np->name;
+	np->rfc2217 = (strncmp(url, "rfc2217://", 10) == 0);
+	if (!np->rfc2217)
+		np->port.setbaud = NULL;
+	addr = strstr(url, "://") + 3;
+	np->port.fd = net_connect(addr);
+	if (np->port.fd < 0) {
+		free(np);
+		return NULL;
+	}
+	if (np->rfc2217) {
+		telnet_cmd(&np->port, WILL, OPT_BINARY);
+		telnet_cmd(&np->port, DO, OPT_BINARY);
+		telnet_cmd(&np->port, WILL, OPT_SGA);
+		telnet_cmd(&np->port, DO, OPT_SGA);
+		telnet_cmd(&np->port, WILL, OPT_COMPORT);
+		/* 8N1, no flow control */
+		comport(&np->port, CPO_DATASIZE, (const unsigned char *)"\010", 1);
+		comport(&np->port, CPO_PARITY, (const unsigned char *)"\001", 1);
+		comport(&np->port, CPO_STOPSIZE, (const unsigned char *)"\001", 1);
+		comport(&np->port, CPO_CONTROL, (const unsigned char *)"\001", 1);
+		if (!setbaud(&np->port, 96)) {
+			port_close(&np->port);
+			return NULL;
+		}
+	}
+	/* discard stale data from previous session */
+	flush(&np->port);
+	return &np->port;
+}
@@ -0,0 +1,346 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  per board patch overlay
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * patched write units have own copy (overlay) on top of area image,
+ * area image (may be shared with other sessions) is not modified.
+ *
+ * patch spec  addr:type:value
+ *  hex   hex byte string             1ff00:hex:0012ab
+ *  str   text (no terminator)        1ff00:str:BOARD-A
+ *  seq   text, '#' run (max 23) is replaced by board number (zero padded)
+ *                                    1ff00:seq:SN-######
+ *  beN / leN  N byte integer value + board number (N = 1 - 8)
+ *                                    1ff10:be6:0x0012340000
+ *  file  file contents               1e000:file:calib.bin
+ *
+ * patch csv
+ *  first line is column specs "addr:type,...", next lines are values
+ *  of each board (board number 0 is second line).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "h8flash.h"
+
+#define PATCH_MAX 4096
+
+struct overlay_t {
+	struct overlay_t *next;
+	unsigned int offset;
+	/* sum difference from area image */
+	unsigned int delta;
+	unsigned char data[0];
+};
+
+/* image data at area offset (overlay when patched). valid in one unit */
+char *area_image(struct area_t *area, unsigned int offset)
+{
+	struct overlay_t *ov;
+
+	for (ov = area->overlay; ov; ov = ov->next)
+		if (offset >= ov->offset && offset - ov->offset < area->size)
+			return (char *)ov->data + offset - ov->offset;
+	return area->image + offset;
+}
+
+/* base image sum / CRC, once per loaded image */
+void area_base(struct area_t *area)
+{
+	if (area->based)
+		return;
+	area->sum = image_sum(area->image, AREA_LEN(area));
+	area->crc = image_crc32(0, area->image, AREA_LEN(area));
+	area->based = 1;
+}
+
+/* image sum of area */
+unsigned int area_sum(struct area_t *area)
+{
+	struct overlay_t *ov;
+	unsigned int sum;
+
+	area_base(area);
+	sum = area->sum;
+	for (ov = area->overlay; ov; ov = ov->next)
+		sum += ov->delta;
+	return sum;
+}
+
+/* image CRC-32 of area */
+unsigned int area_crc(struct area_t *area)
+{
+	struct overlay_t *ov;
+	unsigned int crc, n;
+
+	area_base(area);
+	crc = area->crc;
+	/* CRC is linear: add CRC of patched unit difference
+	   moved to end of area */
+	for (ov = area->overlay; ov; ov = ov->next) {
+		n = AREA_LEN(area) - ov->offset < area->size ?
+			AREA_LEN(area) - ov->offset : area->size;
+		crc ^= image_crc32_combine(
+			image_crc32(~0U, area->image + ov->offset, n) ^
+			image_crc32(~0U, ov->data, n),
+			0, AREA_LEN(area) - ov->offset - n);
+	}
+	return crc;
+}
+
+/* patch in one unit */
+static int area_patch(struct area_t *area, unsigned int offset,
+		      const unsigned char *data, unsigned int len)
+{
+	struct overlay_t *ov;
+	unsigned int unit, n;
+
+	unit = offset - offset % area->size;
+	for (ov = area->overlay; ov; ov = ov->next)
+		if (ov->offset == unit)
+			break;
+	if (ov == NULL) {
+		n = AREA_LEN(area) - unit < area->size ?
+			AREA_LEN(area) - unit : area->size;
+		ov = malloc(sizeof(struct overlay_t) + n);
+		if (ov == NULL)
+			return -1;
+		ov->offset = unit;
+		ov->delta = 0;
+		memcpy(ov->data, area->image + unit, n);
+		ov->next = area->overlay;
+		area->overlay = ov;
+	}
+	ov->delta -= image_sum(ov->data + offset - unit, len);
+	memcpy(ov->data + offset - unit, data, len);
+	ov->delta += image_sum(ov->data + offset - unit, len);
+	return 0;
+}
+
+int patch_apply(struct arealist_t *arealist, unsigned int addr,
+		const unsigned char *data, unsigned int len)
+{
+	struct area_t *area;
+	unsigned int offset, n;
+	int i;
+
+	while (len > 0) {
+		for (area = NULL, i = 0; i < arealist->areas; i++)
+			if (arealist->area[i].start <= addr &&
+			    arealist->area[i].end >= addr) {
+				area = &arealist->area[i];
+				break;
+			}
+		if (area == NULL) {
+			fprintf(stderr, PROGNAME ": patch %08x is out of rom area\n",
+				addr);
+			return -1;
+		}
+		offset = addr - area->start;
+		/* split at unit boundary */
+		n = area->size - offset % area->size;
+		if (n > AREA_LEN(area) - offset)
+			n = AREA_LEN(area) - offset;
+		if (n > len)
+			n = len;
+		if (area_patch(area, offset, data, n) < 0)
+			return -1;
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void patch_clear(struct arealist_t *arealist)
+{
+	struct overlay_t *ov, *next;
+	int i;
+
+	for (i = 0; i < arealist->areas; i++) {
+		for (ov = arealist->area[i].overlay; ov; ov = next) {
+			next = ov->next;
+			free(ov);
+		}
+		arealist->area[i].overlay = NULL;
+	}
+}
+
+static int hexval(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* value to patch data. returns length or -1 */
+static int encode(const char *type, const char *value, unsigned long board,
+		  unsigned char *buf)
+{
+	unsigned long long v;
+	char digits[24];
+	FILE *fp;
+	int len, width, i, h, l;
+	char *end;
+
+	if (strcmp(type, "hex") == 0) {
+		for (len = 0; value[0] && len < PATCH_MAX; value += 2) {
+			if ((h = hexval(value[0])) < 0 || (l = hexval(value[1])) < 0)
+				return -1;
+			buf[len++] = h << 4 | l;
+		}
+		return value[0] ? -1 : len;
+	}
+	if (strcmp(type, "str") == 0) {
+		len = strlen(value);
+		if (len > PATCH_MAX)
+			return -1;
+		memcpy(buf, value, len);
+		return len;
+	}
+	if (strcmp(type, "seq") == 0) {
+		for (len = 0; *value && len < PATCH_MAX; ) {
+			if (*value != '#') {
+				buf[len++] = *value++;
+				continue;
+			}
+			for (width = 0; value[width] == '#'; width++);
+			if (width >= sizeof(digits))
+				return -1;
+			snprintf(digits, sizeof(digits), "%0*lu", width, board);
+			/* keep field width, use lower digits */
+			l = strlen(digits);
+			for (i = 0; i < width && len < PATCH_MAX; i++)
+				buf[len++] = digits[l - width + i];
+			value += width;
+		}
+		return *value ? -1 : len;
+	}
+	if ((type[0] == 'b' || type[0] == 'l') && type[1] == 'e') {
+		width = atoi(type + 2);
+		if (width < 1 || width > 8)
+			return -1;
+		v = strtoull(value, &end, 0);
+		if (*end)
+			return -1;
+		v += board;
+		for (i = 0; i < width; i++)
+			buf[type[0] == 'b' ? width - 1 - i : i] = v >> (i * 8);
+		return width;
+	}
+	if (strcmp(type, "file") == 0) {
+		fp = fopen(value, "rb");
+		if (fp == NULL) {
+			perror(value);
+			return -1;
+		}
+		len = fread(buf, 1, PATCH_MAX, fp);
+		fclose(fp);
+		return len;
+	}
+	return -1;
+}
+
+static int patch_value(struct arealist_t *arealist, const char *spec,
+		       const char *value, unsigned long board)
+{
+	unsigned char buf[PATCH_MAX];
+	char type[8];
+	unsigned int addr;
+	const char *p;
+	char *end;
+	int len;
+
+	addr = strtoul(spec, &end, 16);
+	if (*end != ':')
+		goto error;
+	p = end + 1;
+	for (len = 0; p[len] && p[len] != ':' && len < sizeof(type) - 1; len++)
+		type[len] = p[len];
+	type[len] = '\0';
+	if (value == NULL) {
+		if (p[len] != ':')
+			goto error;
+		value = p + len + 1;
+	}
+	len = encode(type, value, board, buf);
+	if (len < 0)
+		goto error;
+	VERBOSE_PRINT("patch %08x %d byte\n", addr, len);
+	return patch_apply(arealist, addr, buf, len);
+ error:
+	fprintf(stderr, PROGNAME ": bad patch %s\n", spec);
+	return -1;
+}
+
+/* apply "addr:type:value" */
+int patch_spec(struct arealist_t *arealist, const char *spec,
+	       unsigned long board)
+{
+	return patch_value(arealist, spec, NULL, board);
+}
+
+static int csv_split(char *line, char **col, int max)
+{
+	int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	for (col[n++] = line; *line && n < max; line++)
+		if (*line == ',') {
+			*line = '\0';
+			col[n++] = line + 1;
+		}
+	return n;
+}
+
+/* apply line of board number in patch csv */
+int patch_csv(struct arealist_t *arealist, const char *fn,
+	      unsigned long board)
+{
+	char head[1024], line[1024];
+	char *spec[64], *value[64];
+	unsigned long no;
+	FILE *fp;
+	int found;
+	int n, i;
+	int r = -1;
+
+	fp = fopen(fn, "r");
+	if (fp == NULL) {
+		perror(fn);
+		return -1;
+	}
+	if (fgets(head, sizeof(head), fp) == NULL)
+		goto error;
+	for (found = 0, no = 0; !found && fgets(line, sizeof(line), fp); no++)
+		found = (no == board);
+	if (!found) {
+		fprintf(stderr, PROGNAME ": %s has no board %lu\n", fn, board);
+		goto error;
+	}
+	n = csv_split(head, spec, 64);
+	if (csv_split(line, value, 64) != n) {
+		fprintf(stderr, PROGNAME ": %s board %lu column unmatched\n",
+			fn, board);
+		goto error;
+	}
+	for (i = 0; i < n; i++)
+		if (patch_value(arealist, spec[i], value[i], 0) < 0)
+			goto error;
+	r = 0;
+ error:
+	fclose(fp);
+	return r;
+}
@@ -0,0 +1,375 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  dry run planner
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * erase blocks, write units, frames and wire bytes of write_rom are
+ * counted by plan_rom of protocol (no I/O). time at each bitrate is
+ * estimated as wire bytes * 10 / bitrate + answer waits * turnaround
+ * + erase blocks * erase time + KB * program time.
+ * turnaround is measured with keepalive inquiry of connected target,
+ * erase / program time is measured by complete write of the session
+ * that saved profile (PLAN_ERASE / PLAN_PROGRAM when not measured).
+ *
+ * geometry profile (text) keeps target map for plan without target:
+ *   protocol v2
+ *   target 0000000000000000
+ *   mat user
+ *   bitrate 1152            (100bps unit)
+ *   rtt 850                 (us)
+ *   window 1
+ *   maxdata 256
+ *   erase 52000             (us per erase block, 0: not measured)
+ *   program 9800            (us per KB)
+ *   area fffc0000 fffc0fff 1000
+ *   ...
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "h8flash.h"
+
+#define DEFAULT_RATES "115200,460800,921600"
+
+struct offline_port_t {
+	struct port_t port;
+	char name[256];
+};
+
+void wire_frame(struct wire_t *w, int tx, int rx)
+{
+	w->frames++;
+	w->waits++;
+	w->tx_bytes += tx;
+	w->rx_bytes += rx;
+}
+
+static int offline_send(struct port_t *p, const unsigned char *data, int len)
+{
+	return -1;
+}
+
+static int offline_receive(struct port_t *p, unsigned char *data)
+{
+	return -1;
+}
+
+static void offline_flush(struct port_t *p)
+{
+}
+
+static void offline_close(struct port_t *p)
+{
+	free(p);
+}
+
+/* port of profile session (no target) */
+struct port_t *open_offline(const char *name)
+{
+	struct offline_port_t *op;
+
+	op = calloc(1, sizeof(struct offline_port_t));
+	if (op == NULL)
+		return NULL;
+	op->port.type = serial;
+	op->port.fd = -1;
+	op->port.send_data = offline_send;
+	op->port.receive_byte = offline_receive;
+	op->port.flush = offline_flush;
+	op->port.close = offline_close;
+	snprintf(op->name, sizeof(op->name), "%s", name);
+	op->port.dev = op->name;
+	return &op->port;
+}
+
+int profile_save(const char *fn, const struct profile_t *pf,
+		 struct arealist_t *arealist)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL) {
+		perror(fn);
+		return -1;
+	}
+	fprintf(fp, "protocol %s\ntarget %s\nmat %s\nbitrate %d\nrtt %d\n"
+		"window %d\nmaxdata %d\nerase %d\nprogram %d\n",
+		pf->protocol, pf->target,
+		pf->mat == userboot ? "userboot" : "user", pf->bitrate,
+		pf->rtt, pf->window, pf->maxdata, pf->erase, pf->program);
+	for (i = 0; i < arealist->areas; i++)
+		fprintf(fp, "area %08x %08x %x\n", arealist->area[i].start,
+			arealist->area[i].end, arealist->area[i].size);
+	if (fclose(fp) != 0) {
+		perror(fn);
+		return -1;
+	}
+	return 0;
+}
+
+static struct arealist_t *new_arealist(int areas)
+{
+	struct arealist_t *a;
+
+	a = calloc(1, sizeof(struct arealist_t) + sizeof(struct area_t) * areas);
+	if (a)
+		a->areas = areas;
+	return a;
+}
+
+static void free_arealist(struct arealist_t *a)
+{
+	int i;
+
+	if (a == NULL)
+		return;
+	for (i = 0; i < a->areas; i++)
+		free(a->area[i].image);
+	free(a);
+}
+
+struct arealist_t *profile_load(const char *fn, struct profile_t *pf)
+{
+	struct arealist_t *arealist = NULL, *a;
+	struct area_t area;
+	char line[256], mat[16];
+	FILE *fp;
+	int n = 0;
+
+	fp = fopen(fn, "r");
+	if (fp == NULL) {
+		perror(fn);
+		return NULL;
+	}
+	memset(pf, 0, sizeof(*pf));
+	mat[0] = '\0';
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "area %x %x %x", &area.start, &area.end,
+			   &area.size) == 3) {
+			if (area.end < area.start || area.size <= 0)
+				goto error;
+			a = realloc(arealist, sizeof(struct arealist_t) +
+				    sizeof(struct area_t) * (n + 1));
+			if (a == NULL)
+				goto error;
+			arealist = a;
+			arealist->areas = n;
+			memset(&arealist->area[n], 0, sizeof(struct area_t));
+			arealist->area[n].start = area.start;
+			arealist->area[n].end = area.end;
+			arealist->area[n].size = area.size;
+			arealist->area[n].image = malloc(AREA_LEN(&area));
+			if (arealist->area[n].image == NULL)
+				goto error;
+			memset(arealist->area[n].image, 0xff, AREA_LEN(&area));
+			arealist->areas = ++n;
+			arealist->journal = NULL;
+		} else if (sscanf(line, "protocol %7s", pf->protocol) == 1 ||
+			   sscanf(line, "target %31s", pf->target) == 1 ||
+			   sscanf(line, "mat %15s", mat) == 1 ||
+			   sscanf(line, "bitrate %d", &pf->bitrate) == 1 ||
+			   sscanf(line, "rtt %d", &pf->rtt) == 1 ||
+			   sscanf(line, "window %d", &pf->window) == 1 ||
+			   sscanf(line, "maxdata %d", &pf->maxdata) == 1 ||
+			   sscanf(line, "erase %d", &pf->erase) == 1 ||
+			   sscanf(line, "program %d", &pf->program) == 1)
+			continue;
+		else if (line[0] != '#' && line[0] != '\n')
+			goto error;
+	}
+	fclose(fp);
+	pf->mat = strcmp(mat, "userboot") == 0 ? userboot : user;
+	if (arealist == NULL || pf->protocol[0] == '\0') {
+		fprintf(stderr, "%s: no protocol or area in profile\n", fn);
+		free_arealist(arealist);
+		return NULL;
+	}
+	return arealist;
+ error:
+	fprintf(stderr, "%s: invalid profile: %s", fn, line);
+	fclose(fp);
+	free_arealist(arealist);
+	return NULL;
+}
+
+/* copy of image (with patches), blank: geometry only */
+static struct arealist_t *copy_arealist(struct arealist_t *src, int blank)
+{
+	struct arealist_t *a;
+	struct area_t *area;
+	unsigned int off, n;
+	int i;
+
+	a = new_arealist(src->areas);
+	if (a == NULL)
+		return NULL;
+	for (i = 0; i < src->areas; i++) {
+		area = &src->area[i];
+		a->area[i].start = area->start;
+		a->area[i].end = area->end;
+		a->area[i].size = area->size;
+		a->area[i].image = malloc(AREA_LEN(area));
+		if (a->area[i].image == NULL) {
+			free_arealist(a);
+			return NULL;
+		}
+		memset(a->area[i].image, 0xff, AREA_LEN(area));
+		for (off = 0; !blank && off < AREA_LEN(area); off += n) {
+			n = AREA_LEN(area) - off < area->size ?
+				AREA_LEN(area) - off : area->size;
+			memcpy(a->area[i].image + off, area_image(area, off), n);
+		}
+	}
+	return a;
+}
+
+/* blank out units same as previous image. returns changed units */
+static unsigned int drop_unchanged(struct arealist_t *a,
+				   struct arealist_t *prev)
+{
+	struct area_t *area;
+	unsigned int off, n;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < a->areas; i++) {
+		area = &a->area[i];
+		area->based = 0;
+		for (off = 0; off < AREA_LEN(area); off += n) {
+			n = AREA_LEN(area) - off < area->size ?
+				AREA_LEN(area) - off : area->size;
+			if (image_blank(area->image + off, n))
+				continue;
+			if (memcmp(area->image + off,
+				   prev->area[i].image + off, n) == 0)
+				memset(area->image + off, 0xff, n);
+			else
+				count++;
+		}
+	}
+	return count;
+}
+
+static void print_plan(const char *title, struct arealist_t *arealist,
+		       const struct wire_t *w, const struct profile_t *pf,
+		       const char *rates)
+{
+	struct area_t *area;
+	double link, wait, flash;
+	const char *r;
+	int i, n, bps;
+
+	printf("%s: %u bytes in %u write units\n", title, w->payload,
+	       w->units);
+	if (w->erase == ERASE_ALL)
+		puts("  erase: whole flash (boot program)");
+	else {
+		printf("  erase: %u blocks", w->erase);
+		for (n = 0, i = 0; i < arealist->areas; i++) {
+			area = &arealist->area[i];
+			if (image_blank(area_image(area, 0), area->size))
+				continue;
+			printf("%s%08x", (n++ % 8) ? " " : "\n    ", area->start);
+		}
+		putchar('\n');
+	}
+	printf("  frames: %lu (%d data bytes, %d in flight), "
+	       "answer waits: %lu\n", w->frames, w->maxdata, w->window,
+	       w->waits);
+	printf("  wire: %lu bytes sent, %lu bytes received\n",
+	       w->tx_bytes, w->rx_bytes);
+	/* erase / program time is same at any bitrate */
+	flash = ((w->erase == ERASE_ALL ? 1 : w->erase) *
+		 (double)(pf->erase ? pf->erase : PLAN_ERASE) +
+		 w->payload / 1024.0 *
+		 (pf->program ? pf->program : PLAN_PROGRAM)) / 1e6;
+	printf("  %10s %10s %10s %10s %10s\n", "bitrate", "link(s)",
+	       "wait(s)", "flash(s)", "total(s)");
+	wait = w->waits * (pf->rtt / 1e6);
+	/* connected bitrate first, then candidates */
+	bps = pf->bitrate * 100;
+	r = rates;
+	for (;;) {
+		if (bps > 0) {
+			link = (w->tx_bytes + w->rx_bytes) * 10.0 / bps;
+			printf("  %10d %10.2f %10.2f %10.2f %10.2f\n", bps,
+			       link, wait, flash, link + wait + flash);
+		}
+		if (*r == '\0')
+			break;
+		bps = strtol(r, NULL, 0);
+		if (bps == pf->bitrate * 100)
+			bps = 0;
+		r += strcspn(r, ",");
+		if (*r == ',')
+			r++;
+	}
+}
+
+/* print write plan of loaded image. previous: image on target */
+int plan_print(struct comm_t *com, struct arealist_t *arealist,
+	       const struct profile_t *pf, const char *rates,
+	       const char *previous, int binary, unsigned long base)
+{
+	struct arealist_t *full, *prev = NULL;
+	struct wire_t w;
+	unsigned int changed;
+	int r = -1;
+
+	if (com->plan_rom == NULL)
+		return -1;
+	full = copy_arealist(arealist, 0);
+	if (full == NULL)
+		return -1;
+	printf("target %s (%s protocol), bitrate %d, turnaround %.2fms\n",
+	       pf->target[0] ? pf->target : "-", pf->protocol,
+	       pf->bitrate * 100, pf->rtt / 1000.0);
+	printf("flash erase %.1fms/block, program %.1fms/KB (%s)\n",
+	       (pf->erase ? pf->erase : PLAN_ERASE) / 1000.0,
+	       (pf->program ? pf->program : PLAN_PROGRAM) / 1000.0,
+	       pf->erase && pf->program ? "measured" : "typical");
+	if (rates == NULL)
+		rates = DEFAULT_RATES;
+	memset(&w, 0, sizeof(w));
+	w.window = pf->window;
+	w.maxdata = pf->maxdata;
+	com->plan_rom(com, full, &w);
+	print_plan("full write", full, &w, pf, rates);
+
+	if (previous) {
+		prev = copy_arealist(arealist, 1);
+		if (prev == NULL ||
+		    load_file(previous, binary, base, prev) < 0)
+			goto error;
+		if (!com->block_erase) {
+			puts("incremental: old protocol erases whole flash, "
+			     "same as full write");
+			goto done;
+		}
+		changed = drop_unchanged(full, prev);
+		memset(&w, 0, sizeof(w));
+		w.window = pf->window;
+		w.maxdata = pf->maxdata;
+		com->plan_rom(com, full, &w);
+		printf("previous %s: %u units changed\n", previous, changed);
+		print_plan("incremental write", full, &w, pf, rates);
+	}
+ done:
+	r = 0;
+ error:
+	free_arealist(prev);
+	free_arealist(full);
+	return r;
+}
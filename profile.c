@@ -0,0 +1,233 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  phase profiler
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * session and protocol code name the running phase with prof_phase(),
+ * time (monotonic clock) and port counters are added to the phase
+ * until next prof_phase(). prof_phase(p, NULL) ends the phase.
+ * same name phases are accumulated.
+ * first phase is counted from prof_open() (port open).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "h8flash.h"
+
+struct phase_t {
+	const char *name;
+	long long first;	/* ns from open */
+	long long ns;
+	unsigned long count;
+	struct stats_t stats;
+};
+
+struct prof_t {
+	long long origin;
+	long long start;
+	struct phase_t *cur;
+	/* port counters at start of current phase */
+	struct stats_t base;
+	int phases;
+	struct phase_t phase[PROF_PHASES];
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct prof_t *prof_open(void)
+{
+	struct prof_t *prof;
+
+	prof = calloc(1, sizeof(struct prof_t));
+	if (prof == NULL)
+		return NULL;
+	prof->origin = now_ns();
+	return prof;
+}
+
+void prof_close(struct prof_t *prof)
+{
+	free(prof);
+}
+
+static void stats_add(struct stats_t *d, const struct stats_t *a,
+		      const struct stats_t *b)
+{
+	d->frames += a->frames - b->frames;
+	d->retries += a->retries - b->retries;
+	d->naks += a->naks - b->naks;
+	d->errors += a->errors - b->errors;
+	d->tx_bytes += a->tx_bytes - b->tx_bytes;
+	d->rx_bytes += a->rx_bytes - b->rx_bytes;
+	d->syscalls += a->syscalls - b->syscalls;
+}
+
+static struct phase_t *find(struct prof_t *prof, const char *name)
+{
+	int i;
+
+	for (i = 0; i < prof->phases; i++)
+		if (strcmp(prof->phase[i].name, name) == 0)
+			return &prof->phase[i];
+	return NULL;
+}
+
+static struct phase_t *lookup(struct prof_t *prof, const char *name)
+{
+	struct phase_t *ph;
+
+	ph = find(prof, name);
+	if (ph || prof->phases >= PROF_PHASES)
+		return ph;
+	ph = &prof->phase[prof->phases++];
+	ph->name = name;
+	return ph;
+}
+
+/* switch phase of port (name is static string) */
+void prof_phase(struct port_t *p, const char *name)
+{
+	struct prof_t *prof = p->prof;
+	long long t;
+
+	if (prof == NULL)
+		return;
+	if (prof->cur && name && strcmp(prof->cur->name, name) == 0)
+		return;
+	trace_mark(p, TRACE_PHASE, name ? name : "");
+	progress_phase(p, name);
+	t = now_ns();
+	if (prof->cur) {
+		prof->cur->ns += t - prof->start;
+		stats_add(&prof->cur->stats, &p->stats, &prof->base);
+	}
+	prof->cur = name ? lookup(prof, name) : NULL;
+	if (prof->cur == NULL)
+		return;
+	prof->start = (prof->phases == 1 && prof->cur->count == 0) ?
+		prof->origin : t;
+	if (prof->cur->count++ == 0)
+		prof->cur->first = prof->start - prof->origin;
+	prof->base = p->stats;
+}
+
+/* accumulated time (ns) and port counters of phase, 0: no phase */
+long long prof_time(struct port_t *p, const char *name,
+		    struct stats_t *stats)
+{
+	struct phase_t *ph;
+
+	memset(stats, 0, sizeof(*stats));
+	if (p->prof == NULL || (ph = find(p->prof, name)) == NULL)
+		return 0;
+	*stats = ph->stats;
+	return ph->ns;
+}
+
+static void json_str(FILE *fp, const char *s)
+{
+	putc('"', fp);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			putc(*s, fp);
+	}
+	putc('"', fp);
+}
+
+/* JSON run report. payload: image bytes written */
+int prof_report(struct port_t *p, const char *target, unsigned int payload,
+		int result, const char *fn)
+{
+	struct prof_t *prof = p->prof;
+	struct phase_t *ph;
+	FILE *fp;
+	double ms, link, tx;
+	int i;
+
+	if (prof == NULL)
+		return -1;
+	prof_phase(p, NULL);
+	fp = fopen(fn, "w");
+	if (fp == NULL) {
+		perror(fn);
+		return -1;
+	}
+	fputs("{\n  \"port\": ", fp);
+	json_str(fp, p->dev);
+	fputs(",\n  \"target\": ", fp);
+	if (target)
+		json_str(fp, target);
+	else
+		fputs("null", fp);
+	fprintf(fp, ",\n  \"result\": \"%s\",\n", result == 0 ? "ok" : "failed");
+	fprintf(fp, "  \"total_ms\": %.3f,\n", (now_ns() - prof->origin) / 1e6);
+	fputs("  \"phases\": [", fp);
+	for (i = 0; i < prof->phases; i++) {
+		ph = &prof->phase[i];
+		fprintf(fp, "%s\n    {\"name\": \"%s\", \"start_ms\": %.3f, "
+			"\"ms\": %.3f, \"count\": %lu, \"tx_bytes\": %lu, "
+			"\"rx_bytes\": %lu, \"frames\": %lu, \"retries\": %lu, "
+			"\"syscalls\": %lu}", i ? "," : "", ph->name,
+			ph->first / 1e6, ph->ns / 1e6, ph->count,
+			ph->stats.tx_bytes, ph->stats.rx_bytes,
+			ph->stats.frames, ph->stats.retries,
+			ph->stats.syscalls);
+	}
+	fprintf(fp, "\n  ],\n  \"wire\": {\"tx_bytes\": %lu, \"rx_bytes\": %lu, "
+		"\"frames\": %lu, \"retries\": %lu, \"naks\": %lu, "
+		"\"errors\": %lu, \"syscalls\": %lu},\n",
+		p->stats.tx_bytes, p->stats.rx_bytes, p->stats.frames,
+		p->stats.retries, p->stats.naks, p->stats.errors,
+		p->stats.syscalls);
+
+	/* programming throughput (8N1: 10 bit per byte) */
+	ms = tx = 0;
+	for (i = 0; i < 2; i++) {
+		ph = find(prof, i ? "write" : "erase");
+		if (ph) {
+			ms += ph->ns / 1e6;
+			tx += ph->stats.tx_bytes;
+		}
+	}
+	link = p->bitrate * 100 / 10.0;
+	fprintf(fp, "  \"throughput\": {\"payload_bytes\": %u, \"ms\": %.3f, "
+		"\"effective_Bps\": %.1f, \"wire_Bps\": %.1f, ",
+		payload, ms, ms > 0 ? payload * 1000.0 / ms : 0,
+		ms > 0 ? tx * 1000 / ms : 0);
+	if (link > 0)
+		fprintf(fp, "\"link_bps\": %d, \"link_Bps\": %.1f, "
+			"\"utilization\": %.3f}\n",
+			p->bitrate * 100, link,
+			ms > 0 ? tx * 1000 / ms / link : 0);
+	else
+		fputs("\"link_bps\": null, \"link_Bps\": null, "
+		      "\"utilization\": null}\n", fp);
+	fputs("}\n", fp);
+	if (fclose(fp) != 0) {
+		perror(fn);
+		return -1;
+	}
+	return 0;
+}
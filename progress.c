@@ -0,0 +1,227 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  progress and event stream
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * protocol code reports transferred units with progress_step() between
+ * progress_start() / progress_end(). progress line is printed at most
+ * every PROGRESS_INTERVAL ms with throughput and ETA, or as log lines
+ * every PROGRESS_LOG_INTERVAL ms when stdout is not terminal or console
+ * is shared (gang).
+ * event stream is newline delimited JSON on fd, one write per event:
+ *   {"t":0.512,"port":"/dev/ttyUSB0","event":"phase","name":"write"}
+ *   {...,"event":"start","what":"writing","total":24576}
+ *   {...,"event":"block","addr":4096,"bytes":4096,"done":8192,
+ *    "total":24576}
+ *   {...,"event":"retry","retries":1}
+ *   {...,"event":"end","what":"writing","bytes":24576,"ms":2130.5}
+ *   {...,"event":"stats","frames":108,"retries":1,"naks":0,"errors":1,
+ *    "tx_bytes":25296,"rx_bytes":648,"ms":3010.2}
+ * t is seconds from port open.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include "h8flash.h"
+
+struct progress_t {
+	int fd;			/* event stream, -1: none */
+	const char *label;	/* line prefix (shared console) */
+	long long origin;
+	/* current transfer, what is NULL when idle */
+	const char *what;
+	unsigned int total;
+	unsigned int done;
+	long long start;
+	long long last;		/* last printed (ns) */
+	int printed;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct progress_t *progress_open(void)
+{
+	struct progress_t *pg;
+
+	pg = calloc(1, sizeof(struct progress_t));
+	if (pg == NULL)
+		return NULL;
+	pg->fd = -1;
+	pg->origin = now_ns();
+	return pg;
+}
+
+/* print prefix of shared console (static string) */
+void progress_label(struct port_t *p, const char *label)
+{
+	if (p->progress)
+		p->progress->label = label;
+}
+
+int progress_events(struct port_t *p, int fd)
+{
+	if (p->progress == NULL)
+		return -1;
+	p->progress->fd = fd;
+	return 0;
+}
+
+/* one event line. fmt: rest of members (",\"key\":value...") */
+static void event(struct port_t *p, const char *name, const char *fmt, ...)
+{
+	struct progress_t *pg = p->progress;
+	char buf[512];
+	const char *s;
+	va_list ap;
+	int n;
+
+	if (pg == NULL || pg->fd < 0)
+		return;
+	n = snprintf(buf, sizeof(buf), "{\"t\":%.3f,\"port\":\"",
+		     (now_ns() - pg->origin) / 1e9);
+	for (s = p->dev; s && *s && n < sizeof(buf) - 8; s++) {
+		if (*s == '"' || *s == '\\')
+			buf[n++] = '\\';
+		if ((unsigned char)*s >= 0x20)
+			buf[n++] = *s;
+	}
+	n += snprintf(buf + n, sizeof(buf) - n, "\",\"event\":\"%s\"", name);
+	/* snprintf returns untruncated length */
+	if (n > sizeof(buf) - 1)
+		n = sizeof(buf) - 1;
+	va_start(ap, fmt);
+	n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+	va_end(ap);
+	if (n > sizeof(buf) - 3)
+		n = sizeof(buf) - 3;
+	buf[n++] = '}';
+	buf[n++] = '\n';
+	if (write(pg->fd, buf, n) != n)
+		/* reader is gone, stop stream */
+		pg->fd = -1;
+}
+
+static int line_mode(struct progress_t *pg)
+{
+	return pg->label || !isatty(STDOUT_FILENO);
+}
+
+static void print(struct progress_t *pg, long long t)
+{
+	double sec = (t - pg->start) / 1e9;
+	double rate = sec > 0 ? pg->done / sec : 0;
+	unsigned int eta;
+
+	if (pg->label)
+		printf("%s: ", pg->label);
+	printf("%s %u/%u byte", pg->what, pg->done, pg->total);
+	if (rate > 0 && pg->done < pg->total) {
+		eta = (pg->total - pg->done) / rate + 0.5;
+		printf(" %.1fKB/s ETA %u:%02u", rate / 1024, eta / 60, eta % 60);
+	} else if (rate > 0)
+		printf(" %.1fKB/s %.1fs", rate / 1024, sec);
+	/* clear rest of previous line */
+	fputs(line_mode(pg) ? "\n" : "    \r", stdout);
+	fflush(stdout);
+	pg->last = t;
+	pg->printed = 1;
+}
+
+/* begin transfer of total bytes */
+void progress_start(struct port_t *p, const char *what, unsigned int total)
+{
+	struct progress_t *pg = p->progress;
+
+	if (pg == NULL)
+		return;
+	pg->what = what;
+	pg->total = total;
+	pg->done = 0;
+	pg->start = pg->last = now_ns();
+	pg->printed = 0;
+	event(p, "start", ",\"what\":\"%s\",\"total\":%u", what, total);
+}
+
+/* unit at addr is transferred */
+void progress_step(struct port_t *p, unsigned int addr, unsigned int bytes)
+{
+	struct progress_t *pg = p->progress;
+	long long t;
+
+	if (pg == NULL || pg->what == NULL)
+		return;
+	pg->done += bytes;
+	event(p, "block", ",\"addr\":%u,\"bytes\":%u,\"done\":%u,\"total\":%u",
+	      addr, bytes, pg->done, pg->total);
+	if (verbose)
+		return;
+	t = now_ns();
+	if (t - pg->last >= (line_mode(pg) ? PROGRESS_LOG_INTERVAL :
+			     PROGRESS_INTERVAL) * 1000000LL)
+		print(pg, t);
+}
+
+void progress_end(struct port_t *p)
+{
+	struct progress_t *pg = p->progress;
+	long long t;
+
+	if (pg == NULL || pg->what == NULL)
+		return;
+	t = now_ns();
+	if (!verbose && (pg->done || pg->printed)) {
+		print(pg, t);
+		if (!line_mode(pg))
+			putc('\n', stdout);
+	}
+	event(p, "end", ",\"what\":\"%s\",\"bytes\":%u,\"ms\":%.1f",
+	      pg->what, pg->done, (t - pg->start) / 1e6);
+	pg->what = NULL;
+}
+
+void progress_retry(struct port_t *p)
+{
+	event(p, "retry", ",\"retries\":%lu", p->stats.retries);
+}
+
+void progress_phase(struct port_t *p, const char *name)
+{
+	if (name)
+		event(p, "phase", ",\"name\":\"%s\"", name);
+}
+
+/* final counters to event stream */
+void progress_close(struct port_t *p)
+{
+	struct progress_t *pg = p->progress;
+
+	if (pg == NULL)
+		return;
+	event(p, "stats", ",\"frames\":%lu,\"retries\":%lu,\"naks\":%lu,"
+	      "\"errors\":%lu,\"tx_bytes\":%lu,\"rx_bytes\":%lu,\"ms\":%.1f",
+	      p->stats.frames, p->stats.retries, p->stats.naks,
+	      p->stats.errors, p->stats.tx_bytes, p->stats.rx_bytes,
+	      (now_ns() - pg->origin) / 1e6);
+	p->progress = NULL;
+	free(pg);
+}
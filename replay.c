@@ -0,0 +1,271 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  trace replay port
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * replay://file        target answers are taken from --trace file.
+ *
+ * sent bytes must be same as recorded send bytes, answer bytes are
+ * received in recorded order. send after partial answer discards rest
+ * of the answer, receive at send record is timeout (no wait).
+ * boot mode answer of connect is recorded protocol. no sleep in port
+ * and no settle wait after bitrate change (settle 0), so run time is
+ * host overhead (load, plan, framing, checksum) only, plus backoff of
+ * retries if the trace has retried frames.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "h8flash.h"
+
+struct replay_port_t {
+	struct port_t port;
+	char name[256];
+	unsigned char *trace;
+	size_t size;
+	/* current record and used bytes of it */
+	size_t pos;
+	int off;
+	int answer;
+	int failed;
+	long long start;
+};
+
+#define REPLAY(p) ((struct replay_port_t *)(p))
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* next send / receive record with unused data. returns 0 at end */
+static int current(struct replay_port_t *rp, struct trace_rec *rec)
+{
+	while (rp->pos < rp->size) {
+		memcpy(rec, rp->trace + rp->pos, sizeof(*rec));
+		if ((rec->type == TRACE_TX || rec->type == TRACE_RX) &&
+		    rp->off < rec->len)
+			return 1;
+		rp->pos += sizeof(*rec) + rec->len;
+		rp->off = 0;
+	}
+	return 0;
+}
+
+static int send_data(struct port_t *p, const unsigned char *data, int len)
+{
+	struct replay_port_t *rp = REPLAY(p);
+	struct trace_rec rec;
+	size_t at;
+	int i;
+
+	if (rp->failed)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (!current(rp, &rec)) {
+			fprintf(stderr, "replay: send after end of trace\n");
+			goto mismatch;
+		}
+		if (rec.type == TRACE_RX) {
+			/* host does not read rest of answer */
+			rp->off = rec.len;
+			i--;
+			continue;
+		}
+		at = rp->pos + sizeof(rec) + rp->off++;
+		if (rp->trace[at] != data[i]) {
+			fprintf(stderr, "replay: trace offset %zu: sent %02x, "
+				"recorded %02x\n", at, data[i], rp->trace[at]);
+			goto mismatch;
+		}
+	}
+	p->stats.tx_bytes += len;
+	return len;
+ mismatch:
+	rp->failed = 1;
+	p->stats.errors++;
+	return -1;
+}
+
+static int receive_byte(struct port_t *p, unsigned char *data)
+{
+	struct replay_port_t *rp = REPLAY(p);
+	struct trace_rec rec;
+
+	*data = 0;
+	if (rp->failed || !current(rp, &rec) || rec.type != TRACE_RX)
+		return -1;
+	*data = rp->trace[rp->pos + sizeof(rec) + rp->off++];
+	p->stats.rx_bytes++;
+	return 1;
+}
+
+static int setbaud(struct port_t *p, int bitrate)
+{
+	p->bitrate = bitrate;
+	return 1;
+}
+
+static int probe(struct port_t *p, int timeout)
+{
+	REPLAY(p)->start = now_ns();
+	return REPLAY(p)->answer;
+}
+
+static int connect_target(struct port_t *p)
+{
+	printf("Connecting via %s.\n", p->dev);
+	return probe(p, 0);
+}
+
+static void flush(struct port_t *p)
+{
+	/* discarded bytes are not in trace */
+}
+
+static void port_close(struct port_t *p)
+{
+	struct replay_port_t *rp = REPLAY(p);
+	struct trace_rec rec;
+	double ns;
+	unsigned long bytes;
+
+	if (rp->start) {
+		ns = now_ns() - rp->start;
+		bytes = p->stats.tx_bytes + p->stats.rx_bytes;
+		printf("replay: %lu bytes, %lu frames in %.3fms, "
+		       "%.1fns/byte, %.0f frames/s\n", bytes, p->stats.frames,
+		       ns / 1e6, bytes ? ns / bytes : 0,
+		       ns > 0 ? p->stats.frames * 1e9 / ns : 0);
+	}
+	if (rp->failed)
+		puts("replay: sent data differs from trace");
+	else if (current(rp, &rec))
+		printf("replay: %zu bytes of trace are not replayed\n",
+		       rp->size - rp->pos);
+	free(rp->trace);
+	free(rp);
+}
+
+static const struct port_t replay_port = {
+	.type = replay,
+	.dev = NULL,
+	.fd = -1,
+	.send_data = send_data,
+	.receive_byte = receive_byte,
+	.connect_target = connect_target,
+	.probe = probe,
+	.setbaud = setbaud,
+	.flush = flush,
+	.close = port_close,
+};
+
+/* boot mode answer of recorded protocol */
+static int answer(const unsigned char *name, int len)
+{
+	static const struct {
+		const char *name;
+		int answer;
+	} proto[] = {{"v1", 0xe6}, {"v2", 0xc1}, {"stub", 0xaa}};
+	int i;
+
+	for (i = 0; i < sizeof(proto) / sizeof(proto[0]); i++)
+		if (len == strlen(proto[i].name) &&
+		    memcmp(name, proto[i].name, len) == 0)
+			return proto[i].answer;
+	return 0xff;
+}
+
+/* read trace file and check records */
+static int load(struct replay_port_t *rp, const char *fn, char *dev)
+{
+	struct trace_rec rec;
+	FILE *fp;
+	long size;
+	size_t pos;
+	char head[64];
+
+	fp = fopen(fn, "r");
+	if (fp == NULL) {
+		perror(fn);
+		return -1;
+	}
+	if (fread(head, sizeof(head), 1, fp) != 1 ||
+	    memcmp(head, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not trace file\n", fn);
+		goto error;
+	}
+	memcpy(dev, head + 8, sizeof(head) - 8);
+	dev[sizeof(head) - 9] = '\0';
+	if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 ||
+	    fseek(fp, sizeof(head), SEEK_SET) < 0)
+		goto error;
+	rp->size = size - sizeof(head);
+	rp->trace = malloc(rp->size + 1);
+	if (rp->trace == NULL ||
+	    fread(rp->trace, 1, rp->size, fp) != rp->size) {
+		perror(fn);
+		goto error;
+	}
+	fclose(fp);
+
+	for (pos = 0; pos + sizeof(rec) <= rp->size;
+	     pos += sizeof(rec) + rec.len) {
+		memcpy(&rec, rp->trace + pos, sizeof(rec));
+		if (rec.len > TRACE_BUF ||
+		    pos + sizeof(rec) + rec.len > rp->size)
+			break;
+		if (rec.type == TRACE_PROTO && rp->answer == 0xff)
+			rp->answer = answer(rp->trace + pos + sizeof(rec),
+					    rec.len);
+	}
+	if (pos != rp->size) {
+		fprintf(stderr, "%s: broken record\n", fn);
+		return -1;
+	}
+	return 0;
+ error:
+	fclose(fp);
+	return -1;
+}
+
+struct port_t *open_replay(const char *url)
+{
+	struct replay_port_t *rp;
+	char dev[64];
+
+	rp = calloc(1, sizeof(struct replay_port_t));
+	if (rp == NULL) {
+		perror(PROGNAME);
+		return NULL;
+	}
+	rp->port = replay_port;
+	rp->answer = 0xff;
+	snprintf(rp->name, sizeof(rp->name), "%s", url);
+	rp->port.dev = rp->name;
+	if (load(rp, strstr(url, "://") + 3, dev) < 0) {
+		free(rp->trace);
+		free(rp);
+		return NULL;
+	}
+	/* USB boot interface has no bitrate change */
+	if (strncasecmp(dev, "usb", 3) == 0)
+		rp->port.type = usb;
+	return &rp->port;
+}
@@ -8,8 +8,13 @@
  * General Public License version 2.1 (or later).
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
@@ -21,42 +26,175 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <ctype.h>
+#include <glob.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_GPIO_H
+#include <linux/gpio.h>
+#endif
 #include "h8flash.h"
 
 #define TRY1COUNT 60
 #define BAUD_ADJUST_LEN 30
+/* receive timeout (ms) */
+#define RX_TIMEOUT 10000
+/* blocked send timeout (ms) */
+#define TX_TIMEOUT 10000
+/* output queue limit (bytes) */
+#define TX_QUEUE 512
+/* probe reply wait (ms) */
+#define PROBE_WAIT 100
+/* USB serial CBUS GPIO lines */
+#define CBUS_LINES 4
+
+struct serial_port_t {
+	struct port_t port;
+	int lock_fd;
+	char name[FILENAME_MAX];
+	char lockname[FILENAME_MAX];
+	unsigned char rxbuf[256];
+	int rxpos;
+	int rxcount;
+	/* sent data is on the wire at (us, monotonic) */
+	long long tx_end;
+	/* CBUS line handle */
+	int cbus[CBUS_LINES];
+};
+
+#define SERIAL(p) ((struct serial_port_t *)(p))
+
+/* wait fd ready (WAIT_RX / WAIT_TX, 0: sleep only).
+   1: ready 0: timeout -1: error */
+static int wait_fd(struct port_t *p, int timeout, int events)
+{
+	struct timeval tv;
+	fd_set rset, wset;
+
+	if (p->wait)
+		return p->wait(p, timeout, events);
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	if (events & WAIT_RX)
+		FD_SET(p->fd, &rset);
+	if (events & WAIT_TX)
+		FD_SET(p->fd, &wset);
+	p->stats.syscalls++;
+	return select(p->fd + 1, &rset, &wset, NULL, &tv);
+}
+
+/* bytes in driver output queue, -1: unknown */
+static int tx_queued(struct port_t *p)
+{
+	int n;
+
+	p->stats.syscalls++;
+	if (ioctl(p->fd, TIOCOUTQ, &n) < 0)
+		return -1;
+	return n;
+}
+
+/* line time of n bytes (us). 10 bit per byte */
+static long long line_us(struct port_t *p, int n)
+{
+	return p->bitrate > 0 ? n * 100000LL / p->bitrate : 0;
+}
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-static int ser_fd;
-static int lock_fd;
-static char lockname[FILENAME_MAX];
+/* send byte stream. fd is non blocking and output queue is kept
+   under TX_QUEUE bytes (paced by line rate), port wait hook serves
+   other ports while long frame is sent. returns len or -1 */
+static int send_data(struct port_t *p, const unsigned char *buf, int len)
+{
+	struct serial_port_t *sp = SERIAL(p);
+	long long t;
+	int done, n, q;
+	int r;
+
+	for (done = 0; done < len; done += r) {
+		r = 0;
+		n = len - done;
+		t = now_us();
+		if (sp->tx_end < t)
+			sp->tx_end = t;
+		/* check real queue only when line time says it is full */
+		if (p->bitrate > 0 &&
+		    (sp->tx_end - t) * p->bitrate / 100000 + n > TX_QUEUE &&
+		    (q = tx_queued(p)) >= 0) {
+			sp->tx_end = t + line_us(p, q);
+			if (q >= TX_QUEUE) {
+				/* sleep until half of queue is on the wire */
+				if (wait_fd(p, line_us(p, q - TX_QUEUE / 2) /
+					    1000 + 1, 0) < 0)
+					return -1;
+				continue;
+			}
+			if (n > TX_QUEUE - q)
+				n = TX_QUEUE - q;
+		}
+		r = write(p->fd, buf + done, n);
+		p->stats.syscalls++;
+		if (r > 0) {
+			p->stats.tx_bytes += r;
+			sp->tx_end += line_us(p, r);
+			continue;
+		}
+		r = 0;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN || wait_fd(p, TX_TIMEOUT, WAIT_TX) < 1) {
+			p->stats.errors++;
+			return -1;
+		}
+	}
+	return len;
+}
 
-/* send byte stream */
-static int send_data(const unsigned char *buf, int len)
+/* wait receive data. 1: ready 0: timeout -1: error
+   timeout starts when sent data is on the wire */
+static int wait_rx(struct port_t *p, int timeout)
 {
-	return write(ser_fd, buf, len);
+	long long left = SERIAL(p)->tx_end - now_us();
+
+	return wait_fd(p, timeout + (left > 0 ? left / 1000 : 0), WAIT_RX);
 }
 
 /* receive 1byte */
-static int receive_byte(unsigned char *data)
+static int receive_byte(struct port_t *p, unsigned char *data)
 {
+	struct serial_port_t *sp = SERIAL(p);
 	int r;
-	struct timeval tv;
-	fd_set fdset;
 
 	*data = 0;
-	tv.tv_sec = 10;
-	tv.tv_usec = 0;
-	FD_ZERO(&fdset);
-	FD_SET(ser_fd, &fdset);
-	r = select(ser_fd + 1, &fdset, NULL, NULL, &tv);
-	if (r < 1)
-		return -1;
-	return read(ser_fd, data, 1);
+	if (sp->rxpos >= sp->rxcount) {
+		if (wait_rx(p, RX_TIMEOUT) < 1)
+			return -1;
+		do {
+			r = read(p->fd, sp->rxbuf, sizeof(sp->rxbuf));
+			p->stats.syscalls++;
+		} while (r < 0 && errno == EINTR);
+		if (r <= 0)
+			return -1;
+		p->stats.rx_bytes += r;
+		sp->rxpos = 0;
+		sp->rxcount = r;
+	}
+	*data = sp->rxbuf[sp->rxpos++];
+	return 1;
 }
 
 /* set host bitrate */
-static int setbaud(int bitrate)
+static int setbaud(struct port_t *p, int bitrate)
 {
+	int ser_fd = p->fd;
 	int b;
 	struct termios serattr;
 
@@ -67,6 +205,15 @@ static int setbaud(int bitrate)
 	case 384:  b = B38400; break;
 	case 576:  b = B57600; break;
 	case 1152: b = B115200; break;
+#ifdef B230400
+	case 2304: b = B230400; break;
+#endif
+#ifdef B460800
+	case 4608: b = B460800; break;
+#endif
+#ifdef B921600
+	case 9216: b = B921600; break;
+#endif
 	}
 	if (b == 0)
 		return 0;
@@ -75,68 +222,206 @@ static int setbaud(int bitrate)
 	cfsetospeed(&serattr, b);
 	cfsetispeed(&serattr, b);
 	tcsetattr(ser_fd, TCSANOW, &serattr);
+	p->stats.syscalls += 2;
+	p->bitrate = bitrate;
 	return 1;
 }
 
-/* connect to target CPU */
-static int connect_target(char *port)
+/* boot program bitrate adjust and select protocol */
+static int autobaud(struct port_t *p, int tries, int wait, int quiet)
 {
+	int ser_fd = p->fd;
 	int try1;
 	int r;
-	struct timeval tv;
-	fd_set fdset;
 	unsigned char buf[BAUD_ADJUST_LEN];
 
-	/* wait connection establish  */
-	printf("Connecting via %s.", port);
-	fflush(stdout);
-	for(try1 = 0; try1 < TRY1COUNT; try1++) {
+	for(try1 = 0; try1 < tries; try1++) {
 		memset(buf, 0x00, BAUD_ADJUST_LEN);
 		/* send dummy data */
-		write(ser_fd, buf, BAUD_ADJUST_LEN);
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		FD_ZERO(&fdset);
-		FD_SET(ser_fd, &fdset);
+		send_data(p, buf, BAUD_ADJUST_LEN);
 		/* wait reply */
-		r = select(ser_fd + 1, &fdset, NULL, NULL, &tv);
+		r = wait_rx(p, wait);
 		if (r == -1)
 			return 0;
-		if ((r > 0) && (read(ser_fd, buf, 1) == 1) && buf[0] == 0)
-			goto connect;
-		if (try1 > 0) {
+		if (r > 0) {
+			r = read(ser_fd, buf, 1);
+			p->stats.syscalls++;
+			p->stats.rx_bytes += (r > 0) ? r : 0;
+			if (r == 1 && buf[0] == 0)
+				goto connect;
+		}
+		if (try1 > 0 && !quiet) {
 			putchar('.');
 			fflush(stdout);
 		}
 	}
-	putchar('\n');
+	if (!quiet)
+		putchar('\n');
 	return 0xff;
 connect:
-	putchar('\n');
+	if (!quiet)
+		putchar('\n');
 	/* connect done */
 	buf[0] = 0x55;
-	write(ser_fd, buf, 1);
-	if (receive_byte(buf) == 1)
+	send_data(p, buf, 1);
+	if (quiet && wait_rx(p, wait) < 1)
+		return 0xff;
+	if (receive_byte(p, buf) == 1)
 		return buf[0]; /* ok */
 	else
 		return 0xff; /* ng */
 }
 
-static void port_close(void)
+/* connect to target CPU */
+static int connect_target(struct port_t *p)
+{
+	/* wait connection establish  */
+	printf("Connecting via %s.", p->dev);
+	fflush(stdout);
+	return autobaud(p, TRY1COUNT, 1000, 0);
+}
+
+/* discard received data */
+static void flush(struct port_t *p)
+{
+	SERIAL(p)->rxpos = SERIAL(p)->rxcount = 0;
+	tcflush(p->fd, TCIFLUSH);
+	p->stats.syscalls++;
+}
+
+/* bounded connect (timeout ms) */
+static int probe(struct port_t *p, int timeout)
+{
+	flush(p);
+	return autobaud(p, timeout / PROBE_WAIT > 0 ? timeout / PROBE_WAIT : 1,
+			PROBE_WAIT, 1);
+}
+
+#ifdef HAVE_LINUX_GPIO_H
+/* CBUS GPIO of USB serial converter (gpiochip of ftdi_sio) */
+static int set_cbus(struct serial_port_t *sp, int line, int val)
+{
+	struct gpiohandle_request req;
+	struct gpiohandle_data data;
+	char path[FILENAME_MAX];
+	glob_t g;
+	int fd, r;
+
+	if (sp->cbus[line] >= 0) {
+		memset(&data, 0, sizeof(data));
+		data.values[0] = val;
+		return ioctl(sp->cbus[line], GPIOHANDLE_SET_LINE_VALUES_IOCTL,
+			     &data);
+	}
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../gpiochip*",
+		 basename(sp->name));
+	if (glob(path, 0, NULL, &g) != 0) {
+		fprintf(stderr, PROGNAME ": %s has no CBUS GPIO\n", sp->name);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/dev/%s", basename(g.gl_pathv[0]));
+	globfree(&g);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.lineoffsets[0] = line;
+	req.lines = 1;
+	req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+	req.default_values[0] = val;
+	strncpy(req.consumer_label, PROGNAME, sizeof(req.consumer_label) - 1);
+	r = ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+	close(fd);
+	if (r < 0) {
+		perror(path);
+		return -1;
+	}
+	/* keep line handle until close */
+	sp->cbus[line] = req.fd;
+	return 0;
+}
+#endif
+
+/* control line sequence "dtr=1,rts=0,wait=100,cbus0=1,..." */
+static int control(struct port_t *p, const char *top)
+{
+	const char *seq;
+	char name[8];
+	int bits = 0, mask;
+	int val, n;
+	int run;
+
+	/* check syntax, then run */
+	for (run = 0; run < 2; run++) {
+		if (run && ioctl(p->fd, TIOCMGET, &bits) < 0) {
+			perror(PROGNAME);
+			return -1;
+		}
+		for (seq = top; *seq; ) {
+			if (sscanf(seq, "%7[a-z0-9]=%d%n", name, &val, &n) != 2)
+				goto error;
+			if (strcmp(name, "dtr") == 0 || strcmp(name, "rts") == 0) {
+				mask = (name[0] == 'd') ? TIOCM_DTR : TIOCM_RTS;
+				bits = val ? (bits | mask) : (bits & ~mask);
+				if (run && ioctl(p->fd, TIOCMSET, &bits) < 0) {
+					perror(PROGNAME);
+					return -1;
+				}
+			} else if (strcmp(name, "wait") == 0) {
+				if (run)
+					wait_fd(p, val, 0);
+			} else if (strncmp(name, "cbus", 4) == 0 &&
+				   isdigit(name[4]) && name[5] == '\0' &&
+				   name[4] - '0' < CBUS_LINES) {
+#ifdef HAVE_LINUX_GPIO_H
+				if (run && set_cbus(SERIAL(p), name[4] - '0',
+						    val != 0) < 0)
+					return -1;
+#else
+				goto error;
+#endif
+			} else
+				goto error;
+			seq += n;
+			if (*seq == ',')
+				seq++;
+			else if (*seq)
+				goto error;
+		}
+	}
+	return 0;
+ error:
+	fprintf(stderr, PROGNAME ": bad control sequence %s\n", top);
+	return -1;
+}
+
+static void port_close(struct port_t *p)
 {
-	close(ser_fd);
-	close(lock_fd);
-	unlink(lockname);
+	int i;
+
+	for (i = 0; i < CBUS_LINES; i++)
+		if (SERIAL(p)->cbus[i] >= 0)
+			close(SERIAL(p)->cbus[i]);
+	close(p->fd);
+	close(SERIAL(p)->lock_fd);
+	unlink(SERIAL(p)->lockname);
+	free(p);
 }
 
-static struct port_t serial_port = {
+static const struct port_t serial_port = {
 	.type = serial,
 	.dev = NULL,
 	.send_data = send_data,
 	.receive_byte = receive_byte,
 	.connect_target = connect_target,
+	.probe = probe,
+	.control = control,
 	.setbaud = setbaud,
+	.flush = flush,
 	.close = port_close,
+	.settle = BITRATE_SETTLE,
 };
 
 static int serial_lock(const char *lock)
@@ -175,24 +460,41 @@ static int serial_lock(const char *lock)
 /* host serial open */
 struct port_t *open_serial(char *ser_port)
 {
+	struct serial_port_t *sp;
 	struct termios serattr;
+	int i;
 
-	snprintf(lockname, sizeof(lockname), LOCKDIR "/LCK..%s",
-		 basename(ser_port));
-	lock_fd = serial_lock(lockname);
-	if (lock_fd == -1) {
+	sp = calloc(1, sizeof(struct serial_port_t));
+	if (sp == NULL) {
+		perror(PROGNAME);
+		return NULL;
+	}
+	sp->port = serial_port;
+	for (i = 0; i < CBUS_LINES; i++)
+		sp->cbus[i] = -1;
+	strncpy(sp->name, ser_port, sizeof(sp->name) - 1);
+	sp->name[sizeof(sp->name) - 1] = '\0';
+	sp->port.dev = sp->name;
+	snprintf(sp->lockname, sizeof(sp->lockname), LOCKDIR "/LCK..%s",
+		 basename(sp->name));
+	sp->lock_fd = serial_lock(sp->lockname);
+	if (sp->lock_fd == -1) {
 		fprintf(stderr, PROGNAME ": Serial port %s lock failed.\n",
 			ser_port);
+		free(sp);
 		return NULL;
 	}
 
-	ser_fd = open(ser_port, O_RDWR);
-	if (ser_fd == -1) {
-		perror("PROGNAME: ");
+	sp->port.fd = open(ser_port, O_RDWR | O_NONBLOCK);
+	if (sp->port.fd == -1) {
+		perror(PROGNAME);
+		close(sp->lock_fd);
+		unlink(sp->lockname);
+		free(sp);
 		return NULL;
 	}
 
-	tcgetattr(ser_fd, &serattr);
+	tcgetattr(sp->port.fd, &serattr);
 	serattr.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON | IXOFF);
 	serattr.c_oflag &= ~OPOST;
 	serattr.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
@@ -202,8 +504,9 @@ struct port_t *open_serial(char *ser_port)
 	serattr.c_cc[VTIME] = 0;
 	cfsetospeed(&serattr, B9600);
 	cfsetispeed(&serattr, B9600);
-	tcsetattr(ser_fd, TCSANOW, &serattr);
-	serial_port.dev = ser_port;
-	return &serial_port;
+	tcsetattr(sp->port.fd, TCSANOW, &serattr);
+	sp->port.bitrate = 96;
+	/* discard stale data from previous session */
+	tcflush(sp->port.fd, TCIOFLUSH);
+	return &sp->port;
 }
-
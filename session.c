@@ -0,0 +1,924 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  writer session
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include "h8flash.h"
+#include "libh8flash.h"
+
+int verbose = 0;
+
+struct h8flash {
+	struct port_t *port;
+	struct comm_t *com;
+	struct arealist_t *arealist;
+	enum mat_t mat;
+	/* image written and not failed verify */
+	int complete;
+	/* images owned by other session */
+	int shared;
+	const char *run_seq;
+	/* image on target after last complete write (block erase only) */
+	char *last;
+	unsigned int lastlen;
+	/* units kept from last write in current plan */
+	unsigned int unchanged;
+	/* bytes to write in current plan */
+	unsigned int bytes;
+	/* geometry of profile session (no target) */
+	struct profile_t *profile;
+	/* complete writes of session: time without line time (ns),
+	   answer waits, erase blocks and bytes (flash time of profile) */
+	long long erase_ns, program_ns;
+	unsigned long erase_waits, program_waits;
+	unsigned int erase_blocks, payload;
+};
+
+static void free_arealist(struct arealist_t *arealist, int shared)
+{
+	int i;
+
+	if (arealist == NULL)
+		return;
+	journal_close(arealist->journal, 0);
+	patch_clear(arealist);
+	for (i = 0; i < arealist->areas && !shared; i++)
+		free(arealist->area[i].image);
+	free(arealist);
+}
+
+/* get target rommap */
+static struct arealist_t *get_rominfo(struct comm_t *com, struct port_t *port,
+				    enum mat_t mat)
+{
+	struct arealist_t *arealist = NULL;
+	int c;
+
+	/* get target rommap list */
+	arealist = com->get_arealist(com, port, mat);
+	if (arealist == NULL) {
+		if (errno != 0)
+			perror(PROGNAME);
+		else
+			fputs("area list error\n", stderr);
+		return NULL;
+	}
+	if (verbose) {
+		printf("area map\n");
+		for (c = 0; c < arealist->areas; c++)
+			printf("%08x - %08x %08xbyte\n",
+			       arealist->area[c].start,
+			       arealist->area[c].end,
+			       arealist->area[c].size);
+	}
+
+	/* check write area info */
+	if (arealist->areas < 0) {
+		fputs("illigal areamap\n", stderr);
+		free(arealist);
+		return NULL;
+	}
+	return arealist;
+}
+
+static unsigned int image_len(struct arealist_t *arealist)
+{
+	unsigned int len;
+	int i;
+
+	for (len = 0, i = 0; i < arealist->areas; i++)
+		len += AREA_LEN(&arealist->area[i]);
+	return len;
+}
+
+static void drop_last(struct h8flash *h)
+{
+	free(h->last);
+	h->last = NULL;
+	h->lastlen = 0;
+}
+
+/* keep written image (with patches) for next write */
+static void save_last(struct h8flash *h)
+{
+	struct arealist_t *arealist = h->arealist;
+	struct area_t *area;
+	unsigned int pos, off, n;
+	char *p;
+	int i;
+
+	if (!h->com->block_erase) {
+		drop_last(h);
+		return;
+	}
+	p = realloc(h->last, image_len(arealist));
+	if (p == NULL) {
+		drop_last(h);
+		return;
+	}
+	h->last = p;
+	h->lastlen = image_len(arealist);
+	for (pos = 0, i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		for (off = 0; off < AREA_LEN(area); off += n) {
+			n = AREA_LEN(area) - off < area->size ?
+				AREA_LEN(area) - off : area->size;
+			memcpy(p + pos + off, area_image(area, off), n);
+		}
+		pos += AREA_LEN(area);
+	}
+}
+
+/* mark units same as last written image done. returns marked units */
+static unsigned int mark_unchanged(struct h8flash *h)
+{
+	struct arealist_t *arealist = h->arealist;
+	struct area_t *area;
+	unsigned int pos, off, n;
+	unsigned int count = 0;
+	int i;
+
+	if (h->last == NULL || arealist->journal == NULL ||
+	    h->lastlen != image_len(arealist))
+		return 0;
+	for (pos = 0, i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		for (off = 0; off < AREA_LEN(area); off += n) {
+			n = AREA_LEN(area) - off < area->size ?
+				AREA_LEN(area) - off : area->size;
+			if (image_blank(area_image(area, off), n) ||
+			    journal_done(arealist->journal, area->start + off) ||
+			    memcmp(area_image(area, off), h->last + pos + off, n))
+				continue;
+			journal_ack(arealist->journal, area->start + off);
+			count++;
+		}
+		pos += AREA_LEN(area);
+	}
+	return count;
+}
+
+struct h8flash *h8flash_open(const char *port)
+{
+	struct h8flash *h;
+	struct prof_t *prof;
+
+	h = calloc(1, sizeof(struct h8flash));
+	if (h == NULL)
+		return NULL;
+	prof = prof_open();
+	if (strncmp(port, "tcp://", 6) == 0 ||
+	    strncmp(port, "rfc2217://", 10) == 0) {
+		h->port = open_net(port);
+		goto opened;
+	}
+	if (strncmp(port, "replay://", 9) == 0) {
+		h->port = open_replay(port);
+		goto opened;
+	}
+#ifdef HAVE_USB
+	/* usb[VVVV:PPPP][@bus:address] */
+	if (strncasecmp(port, "usb", 3) == 0) {
+		unsigned int vid = DEFAULT_VID;
+		unsigned int pid = DEFAULT_PID;
+		int bus = -1, addr = -1;
+		const char *at = strchr(port, '@');
+		if ((strlen(port) > 3 && port + 3 != at &&
+		     sscanf(port + 3, "%04x:%04x", &vid, &pid) != 2) ||
+		    (at && sscanf(at + 1, "%d:%d", &bus, &addr) != 2)) {
+			fputs("Unkonwn USB device id", stderr);
+			free(h);
+			return NULL;
+		}
+		h->port = open_usb(vid, pid, bus, addr);
+	} else
+		h->port = open_serial((char *)port);
+#else
+	h->port = open_serial((char *)port);
+#endif
+ opened:
+	if (h->port == NULL) {
+		prof_close(prof);
+		free(h);
+		return NULL;
+	}
+	h->port->prof = prof;
+	h->port->progress = progress_open();
+	prof_phase(h->port, "open");
+	prof_phase(h->port, NULL);
+	return h;
+}
+
+/* boot program handshake and select protocol */
+static int handshake(struct h8flash *h, const struct h8flash_config *config)
+{
+	if (h->com)
+		return 0;
+	switch (h->port->connect_target(h->port)) {
+	case 0xff:
+		return -1;
+	case 0xaa:
+		VERBOSE_PRINT("Detect boot mode download\n");
+		trace_mark(h->port, TRACE_PROTO, "stub");
+		if (config->stub == NULL) {
+			fputs("target needs --stub\n", stderr);
+			return -1;
+		}
+		h->com = comm_stub(config->stub);
+		break;
+	case 0xe6:
+		VERBOSE_PRINT("Detect old protocol\n");
+		trace_mark(h->port, TRACE_PROTO, "v1");
+		h->com = comm_v1();
+		if (config->stub)
+			fputs("boot program has no RAM download, "
+			      "--stub ignored\n", stderr);
+		break;
+	case 0xc1:
+		VERBOSE_PRINT("Detect new protocol\n");
+		trace_mark(h->port, TRACE_PROTO, "v2");
+		h->com = comm_v2();
+		if (config->stub)
+			fputs("boot program has no RAM download, "
+			      "--stub ignored\n", stderr);
+		break;
+	default:
+		fputs("unknown_target", stderr);
+		return -1;
+	}
+	return h->com ? 0 : -1;
+}
+
+int h8flash_probe(struct h8flash *h, int timeout, struct h8flash_probe *info)
+{
+	const char *id;
+	int r;
+
+	memset(info, 0, sizeof(*info));
+	if (h->com || h->port->probe == NULL)
+		return -1;
+	prof_phase(h->port, "probe");
+	info->answer = h->port->probe(h->port, timeout);
+	prof_phase(h->port, NULL);
+	switch (info->answer) {
+	case 0xe6:
+		info->protocol = 1;
+		h->com = comm_v1();
+		break;
+	case 0xc1:
+		info->protocol = 2;
+		h->com = comm_v2();
+		break;
+	case 0xaa:
+		/* device type needs RAM stub */
+		return 0;
+	case 0xff:
+		info->answer = 0;
+		/* fall through */
+	default:
+		return -1;
+	}
+	if (h->com == NULL)
+		return -1;
+	prof_phase(h->port, "identify");
+	r = h->com->identify(h->com, h->port);
+	prof_phase(h->port, NULL);
+	if (r < 0)
+		return -1;
+	id = h->com->target_id(h->com);
+	strncpy(info->target, id, sizeof(info->target) - 1);
+	return 0;
+}
+
+static int control(struct h8flash *h, const char *seq)
+{
+	if (h->port->control == NULL) {
+		fprintf(stderr, "%s has no control line\n", h->port->dev);
+		return -1;
+	}
+	return h->port->control(h->port, seq);
+}
+
+int h8flash_connect(struct h8flash *h, const struct h8flash_config *config)
+{
+	h->run_seq = config->run_seq;
+	if (config->boot_seq && h->com == NULL) {
+		prof_phase(h->port, "boot_seq");
+		if (control(h, config->boot_seq) < 0)
+			goto error;
+	}
+	prof_phase(h->port, "autobaud");
+	if (handshake(h, config) < 0)
+		goto error;
+	h->mat = config->userboot ? userboot : user;
+	if (h->com->setup_connection(h->com, h->port,
+				     config->freq, config->endian) < 0)
+		goto error;
+	puts("Connect target");
+	prof_phase(h->port, "area");
+	h->arealist = get_rominfo(h->com, h->port, h->mat);
+ error:
+	prof_phase(h->port, NULL);
+	return h->arealist ? 0 : -1;
+}
+
+int h8flash_reconnect(struct h8flash *h, const struct h8flash_config *config)
+{
+	if (h->shared)
+		return -1;
+	if (h->arealist) {
+		journal_close(h->arealist->journal, h->complete);
+		h->arealist->journal = NULL;
+		free_arealist(h->arealist, 0);
+		h->arealist = NULL;
+	}
+	if (h->com) {
+		h->com->close(h->com);
+		h->com = NULL;
+	}
+	h->complete = 0;
+	/* boot program starts at 9600bps */
+	if (h->port->setbaud)
+		h->port->setbaud(h->port, 96);
+	h->port->flush(h->port);
+	return h8flash_connect(h, config);
+}
+
+int h8flash_list(struct h8flash *h, const struct h8flash_config *config)
+{
+	prof_phase(h->port, "autobaud");
+	if (handshake(h, config) < 0) {
+		prof_phase(h->port, NULL);
+		return -1;
+	}
+	prof_phase(h->port, "list");
+	h->com->dump_configs(h->com, h->port);
+	prof_phase(h->port, NULL);
+	return 0;
+}
+
+int h8flash_load(struct h8flash *h, const char *file,
+		 int binary, unsigned long base)
+{
+	struct arealist_t *arealist = h->arealist;
+	int i, r;
+
+	if (arealist == NULL || h->shared)
+		return -1;
+	/* previous image of this session */
+	if (arealist->journal) {
+		journal_close(arealist->journal, h->complete);
+		arealist->journal = NULL;
+	}
+	h->complete = 0;
+	patch_clear(arealist);
+	for (i = 0; i < arealist->areas; i++) {
+		memset(arealist->area[i].image, 0xff, AREA_LEN(&arealist->area[i]));
+		arealist->area[i].based = 0;
+	}
+	prof_phase(h->port, "load");
+	r = load_file(file, binary, base, arealist);
+	/* sum / CRC of image once, patched boards add deltas */
+	for (i = 0; r >= 0 && i < arealist->areas; i++)
+		area_base(&arealist->area[i]);
+	prof_phase(h->port, NULL);
+	return r;
+}
+
+int h8flash_share(struct h8flash *h, struct h8flash *src)
+{
+	struct arealist_t *a = h->arealist;
+	struct arealist_t *s = src->arealist;
+	int i;
+
+	if (h == src)
+		return 0;
+	if (a == NULL || s == NULL)
+		return -1;
+	if (a->areas != s->areas)
+		goto unmatch;
+	for (i = 0; i < a->areas; i++)
+		if (a->area[i].start != s->area[i].start ||
+		    a->area[i].end != s->area[i].end ||
+		    a->area[i].size != s->area[i].size)
+			goto unmatch;
+	for (i = 0; i < a->areas; i++) {
+		free(a->area[i].image);
+		area_base(&s->area[i]);
+		a->area[i].image = s->area[i].image;
+		a->area[i].sum = s->area[i].sum;
+		a->area[i].crc = s->area[i].crc;
+		a->area[i].based = 1;
+	}
+	h->shared = 1;
+	return 0;
+ unmatch:
+	fprintf(stderr, "%s: rom map unmatched\n", h->port->dev);
+	return -1;
+}
+
+int h8flash_patch(struct h8flash *h, const char *spec, unsigned long board)
+{
+	if (h->arealist == NULL || h->arealist->journal)
+		return -1;
+	return patch_spec(h->arealist, spec, board);
+}
+
+int h8flash_patch_csv(struct h8flash *h, const char *file,
+		      unsigned long board)
+{
+	if (h->arealist == NULL || h->arealist->journal)
+		return -1;
+	return patch_csv(h->arealist, file, board);
+}
+
+void h8flash_unpatch(struct h8flash *h)
+{
+	if (h->arealist && h->arealist->journal == NULL)
+		patch_clear(h->arealist);
+}
+
+int h8flash_plan(struct h8flash *h, const char *file,
+		 int binary, unsigned long base, int resume,
+		 struct h8flash_plan *plan)
+{
+	struct arealist_t *arealist = h->arealist;
+	struct h8flash_plan pl;
+	struct area_t *area;
+	char key[64];
+	unsigned int addr, n;
+	int i;
+
+	if (arealist == NULL)
+		return -1;
+	if (file && h8flash_load(h, file, binary, base) < 0)
+		return -1;
+
+	/* same target on gang ports, journal per port */
+	if (h->shared || file == NULL)
+		snprintf(key, sizeof(key), "%s-%s", h->com->target_id(h->com),
+			 strrchr(h->port->dev, '/') ?
+			 strrchr(h->port->dev, '/') + 1 : h->port->dev);
+	else
+		snprintf(key, sizeof(key), "%s", h->com->target_id(h->com));
+	prof_phase(h->port, "plan");
+	arealist->journal = journal_open(arealist, key, h->mat, resume);
+	if (journal_acked(arealist->journal) > 0 && !h->com->block_erase) {
+		puts("old protocol erases whole flash, restart writing");
+		journal_discard(arealist->journal);
+	}
+	if (journal_acked(arealist->journal) > 0) {
+		puts("Resume check...");
+		if (h->com->verify_rom(h->com, h->port, arealist, h->mat) < 0) {
+			puts("journal unmatched, restart writing");
+			journal_discard(arealist->journal);
+		} else
+			printf("resume from journal (%d units written)\n",
+			       journal_acked(arealist->journal));
+	}
+	/* rewrite only units changed from last write */
+	h->unchanged = mark_unchanged(h);
+	if (h->unchanged)
+		VERBOSE_PRINT("%u units unchanged\n", h->unchanged);
+
+	memset(&pl, 0, sizeof(pl));
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		for (addr = area->start; addr <= area->end; addr += n) {
+			n = area->end - addr + 1 < area->size ?
+				area->end - addr + 1 : area->size;
+			pl.units++;
+			if (image_blank(area_image(area, addr - area->start), n))
+				pl.blank++;
+			else if (journal_done(arealist->journal, addr))
+				pl.done++;
+			else {
+				pl.write++;
+				pl.bytes += n;
+			}
+			if (addr + n - 1 == 0xffffffff)
+				break;
+		}
+	}
+	pl.unchanged = h->unchanged;
+	pl.done -= h->unchanged;
+	h->bytes = pl.bytes;
+	if (plan)
+		*plan = pl;
+	prof_phase(h->port, NULL);
+	return 0;
+}
+
+/* line time of bytes (ns) */
+static long long line_ns(struct port_t *p, unsigned long bytes)
+{
+	return p->bitrate > 0 ? bytes * 100000000LL / p->bitrate : 0;
+}
+
+/* ns without line time. link faster than bitrate (pty, USB): ns */
+static long long sub_line(struct port_t *p, long long ns, unsigned long bytes)
+{
+	return ns > line_ns(p, bytes) ? ns - line_ns(p, bytes) : ns;
+}
+
+/* add flash time of complete write. w: traffic of write,
+   e / es, t / ts: erase / write phase before write */
+static void add_flash(struct h8flash *h, const struct wire_t *w,
+		      long long e, const struct stats_t *es,
+		      long long t, const struct stats_t *ts)
+{
+	struct stats_t s;
+	unsigned long frames;
+
+	if (w->payload == 0)
+		return;
+	e = sub_line(h->port, prof_time(h->port, "erase", &s) - e,
+		     s.tx_bytes + s.rx_bytes - es->tx_bytes - es->rx_bytes);
+	frames = s.frames - es->frames;
+	t = sub_line(h->port, prof_time(h->port, "write", &s) - t,
+		     s.tx_bytes + s.rx_bytes - ts->tx_bytes - ts->rx_bytes);
+	h->erase_ns += e;
+	h->program_ns += t;
+	h->erase_waits += frames;
+	h->program_waits += w->waits > frames ? w->waits - frames : 0;
+	h->erase_blocks += w->erase == ERASE_ALL ? 1 : w->erase;
+	h->payload += w->payload;
+}
+
+int h8flash_write(struct h8flash *h)
+{
+	struct stats_t es, ts;
+	struct wire_t w;
+	long long e, t;
+
+	if (h->arealist == NULL)
+		return -1;
+	memset(&w, 0, sizeof(w));
+	if (h->com->plan_rom)
+		h->com->plan_rom(h->com, h->arealist, &w);
+	e = prof_time(h->port, "erase", &es);
+	t = prof_time(h->port, "write", &ts);
+	/* protocol switches erase / write */
+	prof_phase(h->port, "write");
+	h->complete = (h->com->write_rom(h->com, h->port,
+					 h->arealist, h->mat) == 0);
+	/* failed write ends progress too */
+	progress_end(h->port);
+	prof_phase(h->port, NULL);
+	if (h->complete) {
+		save_last(h);
+		add_flash(h, &w, e, &es, t, &ts);
+	} else
+		drop_last(h);
+	return h->complete ? 0 : -1;
+}
+
+int h8flash_release(struct h8flash *h)
+{
+	int r;
+
+	if (h->run_seq == NULL)
+		return 0;
+	prof_phase(h->port, "release");
+	r = control(h, h->run_seq);
+	prof_phase(h->port, NULL);
+	return r;
+}
+
+int h8flash_verify(struct h8flash *h)
+{
+	int r;
+
+	if (h->arealist == NULL)
+		return -1;
+	prof_phase(h->port, "verify");
+	r = h->com->verify_rom(h->com, h->port, h->arealist, h->mat);
+	prof_phase(h->port, NULL);
+	if (r < 0) {
+		h->complete = 0;
+		drop_last(h);
+		return -1;
+	}
+	return 0;
+}
+
+int h8flash_dump(struct h8flash *h, const char *ranges, const char *file)
+{
+	int r;
+
+	if (h->arealist == NULL)
+		return -1;
+	prof_phase(h->port, "read");
+	r = dump_rom(h->com, h->port, h->arealist, h->mat, ranges, file);
+	prof_phase(h->port, NULL);
+	return r;
+}
+
+struct gang_arg {
+	struct h8flash **h;
+	int (*job)(struct h8flash *h, void *arg);
+	void *arg;
+};
+
+static int gang_job(int no, void *arg)
+{
+	struct gang_arg *ga = arg;
+
+	return ga->job(ga->h[no], ga->arg);
+}
+
+int h8flash_gang(struct h8flash **h, int n,
+		 int (*job)(struct h8flash *h, void *arg), void *arg,
+		 int *result)
+{
+	struct gang_arg ga = {h, job, arg};
+	struct port_t **ports;
+	int i, r;
+
+	ports = calloc(n, sizeof(struct port_t *));
+	if (ports == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+		ports[i] = h[i] ? h[i]->port : NULL;
+	r = gang_run(ports, n, gang_job, &ga, result);
+	free(ports);
+	return r;
+}
+
+int h8flash_keepalive(struct h8flash *h)
+{
+	int r;
+
+	if (h->com == NULL || h->com->keepalive == NULL)
+		return -1;
+	prof_phase(h->port, "keepalive");
+	r = h->com->keepalive(h->com, h->port);
+	prof_phase(h->port, NULL);
+	return r;
+}
+
+const char *h8flash_port(struct h8flash *h)
+{
+	return h->port->dev;
+}
+
+const char *h8flash_target(struct h8flash *h)
+{
+	if (h->profile)
+		return h->profile->target;
+	return h->com ? h->com->target_id(h->com) : NULL;
+}
+
+void h8flash_stats(struct h8flash *h, struct h8flash_stats *stats)
+{
+	stats->frames = h->port->stats.frames;
+	stats->retries = h->port->stats.retries;
+	stats->naks = h->port->stats.naks;
+	stats->errors = h->port->stats.errors;
+	stats->tx_bytes = h->port->stats.tx_bytes;
+	stats->rx_bytes = h->port->stats.rx_bytes;
+	stats->syscalls = h->port->stats.syscalls;
+}
+
+int h8flash_trace(struct h8flash *h, const char *file)
+{
+	return trace_open(h->port, file);
+}
+
+int h8flash_impair(struct h8flash *h, const char *spec)
+{
+	return impair_open(h->port, spec);
+}
+
+int h8flash_events(struct h8flash *h, int fd)
+{
+	return progress_events(h->port, fd);
+}
+
+int h8flash_report(struct h8flash *h, const char *file, int result)
+{
+	return prof_report(h->port, h8flash_target(h),
+			   h->complete ? h->bytes : 0, result, file);
+}
+
+struct h8flash *h8flash_open_profile(const char *file,
+				     const struct h8flash_config *config)
+{
+	struct h8flash *h;
+
+	h = calloc(1, sizeof(struct h8flash));
+	if (h == NULL)
+		return NULL;
+	h->profile = calloc(1, sizeof(struct profile_t));
+	if (h->profile == NULL)
+		goto error;
+	h->arealist = profile_load(file, h->profile);
+	if (h->arealist == NULL)
+		goto error;
+	h->mat = h->profile->mat;
+	if (h->mat != (config->userboot ? userboot : user)) {
+		fprintf(stderr, "%s: profile is %s MAT\n", file,
+			h->mat == userboot ? "user boot" : "user");
+		goto error;
+	}
+	if (strcmp(h->profile->protocol, "v1") == 0)
+		h->com = comm_v1();
+	else if (strcmp(h->profile->protocol, "v2") == 0)
+		h->com = comm_v2();
+	else if (strcmp(h->profile->protocol, "stub") == 0)
+		h->com = comm_stub(config->stub);
+	else
+		fprintf(stderr, "%s: unknown protocol %s\n", file,
+			h->profile->protocol);
+	if (h->com == NULL)
+		goto error;
+	h->port = open_offline(file);
+	if (h->port == NULL)
+		goto error;
+	h->port->bitrate = h->profile->bitrate;
+	return h;
+ error:
+	if (h->com)
+		h->com->close(h->com);
+	free_arealist(h->arealist, 0);
+	free(h->profile);
+	free(h);
+	return NULL;
+}
+
+struct h8flash *h8flash_open_image(struct h8flash *src)
+{
+	struct h8flash *h;
+	struct area_t *area;
+	int i;
+
+	if (src->arealist == NULL)
+		return NULL;
+	h = calloc(1, sizeof(struct h8flash));
+	if (h == NULL)
+		return NULL;
+	h->arealist = calloc(1, sizeof(struct arealist_t) +
+			     sizeof(struct area_t) * src->arealist->areas);
+	if (h->arealist == NULL)
+		goto error;
+	for (i = 0; i < src->arealist->areas; i++) {
+		area = &h->arealist->area[i];
+		area->start = src->arealist->area[i].start;
+		area->end = src->arealist->area[i].end;
+		area->size = src->arealist->area[i].size;
+		area->image = malloc(AREA_LEN(area));
+		if (area->image == NULL)
+			goto error;
+		memset(area->image, 0xff, AREA_LEN(area));
+		h->arealist->areas = i + 1;
+	}
+	h->mat = src->mat;
+	h->port = open_offline("image");
+	if (h->port == NULL)
+		goto error;
+	return h;
+ error:
+	free_arealist(h->arealist, 0);
+	free(h);
+	return NULL;
+}
+
+/* answer turnaround (us): best of keepalive round trips without
+   line time of frames */
+static int measure_rtt(struct h8flash *h)
+{
+	struct timespec t0, t1;
+	unsigned long bytes;
+	long long ns, best = -1;
+	int i;
+
+	if (h->com->keepalive == NULL)
+		return 0;
+	for (i = 0; i < 5; i++) {
+		bytes = h->port->stats.tx_bytes + h->port->stats.rx_bytes;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (h->com->keepalive(h->com, h->port) < 0)
+			return 0;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+			t1.tv_nsec - t0.tv_nsec;
+		bytes = h->port->stats.tx_bytes + h->port->stats.rx_bytes - bytes;
+		ns = sub_line(h->port, ns, bytes);
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+	return best > 1000 ? best / 1000 : 1;
+}
+
+/* per block / KB flash time of complete writes */
+static void flash_time(struct h8flash *h, struct profile_t *pf)
+{
+	long long e, t, erase;
+
+	e = h->erase_ns - h->erase_waits * pf->rtt * 1000LL;
+	t = h->program_ns - h->program_waits * pf->rtt * 1000LL;
+	if (h->erase_waits == 0) {
+		/* erased in write frames (stub), split by typical ratio */
+		erase = (long long)h->erase_blocks * PLAN_ERASE;
+		t += e;
+		e = t * erase / (erase + h->payload / 1024.0 * PLAN_PROGRAM);
+		t -= e;
+	}
+	/* 0 is unknown */
+	if (h->erase_blocks)
+		pf->erase = e > 1000LL * h->erase_blocks ?
+			e / 1000 / h->erase_blocks : 1;
+	pf->program = t > 0 && t * 1.024 / h->payload > 1 ?
+		t * 1.024 / h->payload : 1;
+}
+
+/* geometry and link of session */
+static int get_profile(struct h8flash *h, struct profile_t *pf)
+{
+	struct arealist_t empty = {.areas = 0};
+	struct wire_t w;
+
+	if (h->profile) {
+		*pf = *h->profile;
+		return 0;
+	}
+	if (h->com == NULL || h->arealist == NULL)
+		return -1;
+	memset(pf, 0, sizeof(*pf));
+	snprintf(pf->protocol, sizeof(pf->protocol), "%s", h->com->name);
+	snprintf(pf->target, sizeof(pf->target), "%s", h8flash_target(h));
+	pf->mat = h->mat;
+	pf->bitrate = h->port->bitrate;
+	prof_phase(h->port, "keepalive");
+	pf->rtt = measure_rtt(h);
+	prof_phase(h->port, NULL);
+	/* frame parameters of session */
+	memset(&w, 0, sizeof(w));
+	h->com->plan_rom(h->com, &empty, &w);
+	pf->window = w.window;
+	pf->maxdata = w.maxdata;
+	if (h->payload)
+		flash_time(h, pf);
+	return 0;
+}
+
+int h8flash_save_profile(struct h8flash *h, const char *file)
+{
+	struct profile_t pf;
+
+	if (get_profile(h, &pf) < 0)
+		return -1;
+	return profile_save(file, &pf, h->arealist);
+}
+
+int h8flash_dryrun(struct h8flash *h, const char *rates, const char *previous,
+		   int binary, unsigned long base)
+{
+	struct profile_t pf;
+
+	if (get_profile(h, &pf) < 0)
+		return -1;
+	return plan_print(h->com, h->arealist, &pf, rates, previous,
+			  binary, base);
+}
+
+void h8flash_close(struct h8flash *h)
+{
+	if (h == NULL)
+		return;
+	if (h->arealist) {
+		journal_close(h->arealist->journal, h->complete);
+		h->arealist->journal = NULL;
+	}
+	free_arealist(h->arealist, h->shared);
+	if (h->com)
+		h->com->close(h->com);
+	progress_close(h->port);
+	prof_close(h->port->prof);
+	trace_close(h->port);
+	impair_close(h->port);
+	h->port->close(h->port);
+	drop_last(h);
+	free(h->profile);
+	free(h);
+}
+
+void h8flash_verbose(int level)
+{
+	verbose = level;
+}
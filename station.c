@@ -0,0 +1,418 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  hotplug flashing station
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * wait kernel uevent (netlink), write image into each added port.
+ * ports are written concurrently by own thread, port is claimed with
+ * serial lock in open. image is loaded once with rom map of first
+ * connected board, all boards share it (read only).
+ *
+ * match  KEY=pattern         uevent property (SUBSYSTEM, DEVNAME, ...)
+ *        ATTRS{name}=pattern sysfs attribute of device or parents
+ * pattern is shell glob. all matches must be true.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "h8flash.h"
+#include "libh8flash.h"
+
+#define STATION_PORTS 64
+#define UEVENT_SIZE 8192
+/* wait device node creation (ms) */
+#define NODE_WAIT 2000
+
+struct station_t {
+	const struct station_config *config;
+	pthread_mutex_t lock;
+	FILE *log;
+	/* loaded image (no target) */
+	struct h8flash *image;
+	unsigned long board;
+	char active[STATION_PORTS][FILENAME_MAX];
+};
+
+struct board_t {
+	struct station_t *st;
+	char port[FILENAME_MAX];
+	/* board number, given after connect */
+	unsigned long no;
+	int numbered;
+	int slot;
+};
+
+struct uevent_t {
+	const char *action;
+	const char *devpath;
+	const char *env[64];
+	int envs;
+};
+
+static const char *uevent_get(struct uevent_t *ev, const char *key)
+{
+	int len = strlen(key);
+	int i;
+
+	for (i = 0; i < ev->envs; i++)
+		if (strncmp(ev->env[i], key, len) == 0 && ev->env[i][len] == '=')
+			return ev->env[i] + len + 1;
+	return NULL;
+}
+
+static int uevent_parse(char *buf, int len, struct uevent_t *ev)
+{
+	char *p;
+
+	memset(ev, 0, sizeof(*ev));
+	/* libudev message is not used */
+	if (strchr(buf, '@') == NULL)
+		return -1;
+	for (p = buf + strlen(buf) + 1; p < buf + len && ev->envs < 64;
+	     p += strlen(p) + 1)
+		ev->env[ev->envs++] = p;
+	ev->action = uevent_get(ev, "ACTION");
+	ev->devpath = uevent_get(ev, "DEVPATH");
+	return (ev->action && ev->devpath) ? 0 : -1;
+}
+
+/* sysfs attribute of device or parents */
+static int match_attrs(const char *devpath, const char *name,
+		       const char *pattern)
+{
+	char path[FILENAME_MAX];
+	char val[256];
+	char *p;
+	FILE *fp;
+	int n;
+
+	snprintf(path, sizeof(path), "/sys%s", devpath);
+	/* tty class device, start from real device */
+	if (strncmp(devpath, "/devices/", 9) != 0)
+		return 0;
+	for (;;) {
+		n = strlen(path);
+		snprintf(path + n, sizeof(path) - n, "/%s", name);
+		fp = fopen(path, "r");
+		path[n] = '\0';
+		if (fp) {
+			if (fgets(val, sizeof(val), fp) == NULL)
+				val[0] = '\0';
+			fclose(fp);
+			val[strcspn(val, "\n")] = '\0';
+			if (fnmatch(pattern, val, 0) == 0)
+				return 1;
+		}
+		p = strrchr(path, '/');
+		if (p == NULL || p - path <= 13)	/* "/sys/devices" */
+			return 0;
+		*p = '\0';
+	}
+}
+
+/* port name of added device. returns 0 not target */
+static int event_port(struct uevent_t *ev, char *port, int size)
+{
+	const char *devname = uevent_get(ev, "DEVNAME");
+	const char *subsystem = uevent_get(ev, "SUBSYSTEM");
+#ifdef HAVE_USB
+	const char *product = uevent_get(ev, "PRODUCT");
+	const char *devtype = uevent_get(ev, "DEVTYPE");
+	const char *busnum = uevent_get(ev, "BUSNUM");
+	const char *devnum = uevent_get(ev, "DEVNUM");
+	unsigned int vid, pid;
+#endif
+
+	if (subsystem == NULL)
+		return 0;
+	if (strcmp(subsystem, "tty") == 0 && devname) {
+		snprintf(port, size, "/dev/%s", devname);
+		return 1;
+	}
+#ifdef HAVE_USB
+	/* boot program of USB interface */
+	if (strcmp(subsystem, "usb") == 0 && devtype && product &&
+	    strcmp(devtype, "usb_device") == 0 &&
+	    sscanf(product, "%x/%x/", &vid, &pid) == 2) {
+		/* same boards are selected by bus and address */
+		if (busnum && devnum)
+			snprintf(port, size, "usb%04x:%04x@%d:%d", vid, pid,
+				 atoi(busnum), atoi(devnum));
+		else
+			snprintf(port, size, "usb%04x:%04x", vid, pid);
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+static int match(const struct station_config *config, struct uevent_t *ev,
+		 const char *port)
+{
+	char key[64];
+	const char *val;
+	const char *m;
+	int i, n;
+
+	if (config->matches == 0)
+		return strncmp(port, "/dev/ttyUSB", 11) == 0 ||
+			strncmp(port, "/dev/ttyACM", 11) == 0 ||
+			(strncmp(port, "usb", 3) == 0 &&
+			 strtoul(port + 3, NULL, 16) == DEFAULT_VID &&
+			 strtoul(port + 8, NULL, 16) == DEFAULT_PID);
+	for (i = 0; i < config->matches; i++) {
+		m = config->match[i];
+		n = strcspn(m, "=");
+		if (m[n] != '=' || n >= sizeof(key))
+			return 0;
+		memcpy(key, m, n);
+		key[n] = '\0';
+		if (strncmp(key, "ATTRS{", 6) == 0 && key[n - 1] == '}') {
+			key[n - 1] = '\0';
+			if (!match_attrs(ev->devpath, key + 6, m + n + 1))
+				return 0;
+			continue;
+		}
+		val = uevent_get(ev, key);
+		if (val == NULL || fnmatch(m + n + 1, val, 0) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void station_log(struct station_t *st, struct board_t *b,
+			const char *target, const char *result,
+			struct h8flash_stats *stats, time_t start)
+{
+	char date[32], no[24] = "-";
+	time_t now = time(NULL);
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	if (b->numbered)
+		snprintf(no, sizeof(no), "%lu", b->no);
+	pthread_mutex_lock(&st->lock);
+	fprintf(st->log, "%s %s board %s target %s %s %lds "
+		"(frames %lu, retries %lu)\n",
+		date, b->port, no, target ? target : "-", result,
+		(long)(now - start), stats->frames, stats->retries);
+	fflush(st->log);
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* share loaded image, first board loads it */
+static int share_image(struct station_t *st, struct h8flash *h)
+{
+	const struct station_config *config = st->config;
+	int r;
+
+	pthread_mutex_lock(&st->lock);
+	if (st->image == NULL) {
+		st->image = h8flash_open_image(h);
+		if (st->image &&
+		    h8flash_load(st->image, config->file, config->binary,
+				 config->base) < 0) {
+			h8flash_close(st->image);
+			st->image = NULL;
+		}
+	}
+	r = st->image ? h8flash_share(h, st->image) : -1;
+	pthread_mutex_unlock(&st->lock);
+	return r;
+}
+
+static void *flash_board(void *arg)
+{
+	struct board_t *b = arg;
+	struct station_t *st = b->st;
+	const struct station_config *config = st->config;
+	struct h8flash_stats stats = {0};
+	const char *result = "write failed";
+	struct h8flash *h;
+	time_t start = time(NULL);
+	int i;
+
+	/* wait device node */
+	for (i = 0; i < NODE_WAIT / 100 && b->port[0] == '/' &&
+		     access(b->port, R_OK | W_OK) < 0; i++)
+		usleep(100000);
+	h = h8flash_open(b->port);
+	if (h == NULL || h8flash_connect(h, config->config) < 0) {
+		result = "connect failed";
+		goto error;
+	}
+	/* numbers are not used by boards failed to connect */
+	pthread_mutex_lock(&st->lock);
+	b->no = st->board++;
+	b->numbered = 1;
+	pthread_mutex_unlock(&st->lock);
+	printf("%s: board %lu\n", b->port, b->no);
+	if (share_image(st, h) < 0 ||
+	    apply_patch(h, config->patch, b->no) < 0 ||
+	    h8flash_plan(h, NULL, 0, 0, 0, NULL) < 0 ||
+	    h8flash_write(h) < 0)
+		goto error;
+	if (config->verify && h8flash_verify(h) < 0) {
+		result = "verify failed";
+		goto error;
+	}
+	result = (h8flash_release(h) < 0) ? "reset failed" : "done";
+ error:
+	if (h)
+		h8flash_stats(h, &stats);
+	station_log(st, b, h ? h8flash_target(h) : NULL, result, &stats, start);
+	h8flash_close(h);
+	pthread_mutex_lock(&st->lock);
+	st->active[b->slot][0] = '\0';
+	pthread_mutex_unlock(&st->lock);
+	free(b);
+	return NULL;
+}
+
+/* start writing thread of port. */
+static void start_board(struct station_t *st, const char *port)
+{
+	struct board_t *b;
+	pthread_t th;
+	int i, slot = -1;
+
+	b = calloc(1, sizeof(struct board_t));
+	if (b == NULL)
+		return;
+	snprintf(b->port, sizeof(b->port), "%s", port);
+	pthread_mutex_lock(&st->lock);
+	for (i = 0; i < STATION_PORTS; i++) {
+		/* already writing */
+		if (strcmp(st->active[i], b->port) == 0) {
+			slot = -1;
+			break;
+		}
+		if (slot < 0 && st->active[i][0] == '\0')
+			slot = i;
+	}
+	if (slot >= 0) {
+		strcpy(st->active[slot], b->port);
+		b->slot = slot;
+	}
+	pthread_mutex_unlock(&st->lock);
+	if (slot < 0) {
+		free(b);
+		return;
+	}
+	b->st = st;
+	printf("%s: start\n", b->port);
+	if (pthread_create(&th, NULL, flash_board, b) != 0) {
+		perror(PROGNAME);
+		pthread_mutex_lock(&st->lock);
+		st->active[slot][0] = '\0';
+		pthread_mutex_unlock(&st->lock);
+		free(b);
+		return;
+	}
+	pthread_detach(th);
+}
+
+/* station main loop. returns only error */
+int station(const struct station_config *config)
+{
+	struct station_t st;
+	struct sockaddr_nl sa;
+	struct uevent_t ev;
+	char port[FILENAME_MAX];
+	struct iovec iov;
+	struct msghdr msg;
+	char *buf;
+	int fd;
+	int len;
+
+	memset(&st, 0, sizeof(st));
+	st.config = config;
+	st.board = config->patch->board;
+	pthread_mutex_init(&st.lock, NULL);
+	st.log = stdout;
+	if (config->log) {
+		st.log = fopen(config->log, "a");
+		if (st.log == NULL) {
+			perror(config->log);
+			return -1;
+		}
+	}
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		perror(PROGNAME);
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	/* kernel uevent */
+	sa.nl_groups = 1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror(PROGNAME);
+		close(fd);
+		return -1;
+	}
+	buf = malloc(UEVENT_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+	puts("waiting target...");
+	for (;;) {
+		iov.iov_base = buf;
+		iov.iov_len = UEVENT_SIZE - 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sa;
+		msg.msg_namelen = sizeof(sa);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		len = recvmsg(fd, &msg, 0);
+		if (len < 0 && errno == ENOBUFS) {
+			/* socket buffer overrun, events are lost */
+			fputs(PROGNAME ": uevent overrun, replug waiting "
+			      "boards\n", stderr);
+			continue;
+		}
+		if (len < 0 && errno != EINTR) {
+			perror(PROGNAME);
+			break;
+		}
+		if (len <= 0)
+			continue;
+		/* only from kernel */
+		if (sa.nl_pid != 0)
+			continue;
+		buf[len] = '\0';
+		if (uevent_parse(buf, len, &ev) < 0)
+			continue;
+		if (config->verbose)
+			printf("uevent %s %s\n", ev.action, ev.devpath);
+		if (strcmp(ev.action, "add") != 0 ||
+		    !event_port(&ev, port, sizeof(port)) ||
+		    !match(config, &ev, port))
+			continue;
+		start_board(&st, port);
+	}
+	free(buf);
+	close(fd);
+	return -1;
+}
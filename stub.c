@@ -0,0 +1,780 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  target communication (RAM stub)
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * Stub is downloaded into on-chip RAM by boot mode download
+ * (0x55 -> 0xaa, size 2byte, program. each byte is echoed back,
+ *  0xaa at end and start stub program).
+ *
+ * stub protocol (multibyte values are big endian)
+ *  host -> stub  cmd(1) seq(1) len(2) data(len) crc(4)
+ *  stub -> host  res(1) seq(1) len(2) data(len) crc(4)
+ *  crc is CRC-32 (IEEE802.3) of header and data.
+ *
+ *  res is cmd when succeeded, cmd | 0x80 with error code(1) when failed.
+ *  stub executes frame of expected seq and increments expected seq.
+ *  frame with broken crc: answer NAK(0x15) with expected seq once,
+ *   discard frames until expected seq arrived.
+ *  frame of passed seq (resent): I/S/B/C/R execute again,
+ *   E/W answer ACK(0x06) with expected seq - 1 and not execute.
+ *  after bitrate change, stub returns to previous bitrate if
+ *  no valid frame in 1sec.
+ *
+ *  'S' sync       -
+ *  'I' info       mat(1)
+ *                 -> version(1) window(1) maxdata(2) id(16) regions(1)
+ *                    {start(4) end(4) blocksize(4)} * regions
+ *  'B' bitrate    bitrate(4) peripheral clock(4) Hz
+ *  'E' erase      block address(4)
+ *  'W' write      address(4) size(2) method(1) data
+ *                 method 0: raw 1: LZSS (see lz.c)
+ *  'C' crc        start(4) end(4) -> crc(4)
+ *  'R' read       address(4) size(2) -> data
+ *
+ * E / W frames are sent up to window frames without waiting
+ * answer (go-back-N).
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "h8flash.h"
+
+#define ACK 0x06
+#define NAK 0x15
+
+#define STUB_SYNC    'S'
+#define STUB_INFO    'I'
+#define STUB_BITRATE 'B'
+#define STUB_ERASE   'E'
+#define STUB_WRITE   'W'
+#define STUB_CRC     'C'
+#define STUB_READ    'R'
+
+#define METHOD_RAW 0
+#define METHOD_LZ  1
+
+#define BOOT_ACK 0xaa
+#define MAX_REGIONS 16
+/* frame header + crc */
+#define FRAME_OVERHEAD 8
+/* write header: address + size + method */
+#define WRITE_HEAD 7
+#define FRAME_MAX (FRAME_OVERHEAD + WRITE_HEAD + STUB_MAXDATA)
+/* stub fallback time after bitrate change (ms) */
+#define REVERT_WAIT 1200
+
+struct frame_t {
+	unsigned char buf[FRAME_MAX];
+	int len;
+	unsigned int unit;
+	int last;
+	int size;
+	int raw;
+};
+
+struct stub_t {
+	struct comm_t comm;
+	const char *file;
+	int loaded;
+	unsigned char seq;
+	int window;
+	int maxdata;
+	char device_id[17];
+	struct frame_t ring[STUB_WINDOW];
+	/* read answer */
+	unsigned char res[FRAME_OVERHEAD + STUB_MAXDATA];
+};
+
+#define STUB(c) ((struct stub_t *)(c))
+
+/* big endian to cpu endian convert 32bit */
+static __inline__ unsigned int getlong(const unsigned char *p)
+{
+	return (*p << 24) | (*(p+1) << 16) | (*(p+2) << 8) | *(p+3);
+}
+
+/* big endian to cpu endian convert 16bit */
+static __inline__ unsigned short getword(const unsigned char *p)
+{
+	return (*p << 8) | *(p+1);
+}
+
+/* cpu endian to big endian 32bit */
+static __inline__ void setlong(unsigned char *buf, unsigned long val)
+{
+	*(buf + 0) = (val >> 24) & 0xff;
+	*(buf + 1) = (val >> 16) & 0xff;
+	*(buf + 2) = (val >>  8) & 0xff;
+	*(buf + 3) = (val      ) & 0xff;
+}
+
+/* cpu endian to big endian 16bit */
+static __inline__ void setword(unsigned char *buf, unsigned short val)
+{
+	*(buf + 0) = (val >>  8) & 0xff;
+	*(buf + 1) = (val      ) & 0xff;
+}
+
+/* make frame. return frame length */
+static int build(unsigned char *buf, unsigned char cmd, unsigned char s,
+		 const unsigned char *data, int len)
+{
+	buf[0] = cmd;
+	buf[1] = s;
+	setword(buf + 2, len);
+	if (len > 0 && data != buf + 4)
+		memcpy(buf + 4, data, len);
+	setlong(buf + 4 + len, image_crc32(0, buf, 4 + len));
+	return len + FRAME_OVERHEAD;
+}
+
+/* receive answer frame. return res or -1 */
+static int receive(struct port_t *p, unsigned char *data, int size)
+{
+	int len, i;
+
+	for (i = 0; i < 4; i++)
+		if (p->receive_byte(p, data + i) != 1)
+			return -1;
+	len = getword(data + 2);
+	if (len + FRAME_OVERHEAD > size)
+		return -1;
+	for (; i < len + FRAME_OVERHEAD; i++)
+		if (p->receive_byte(p, data + i) != 1)
+			return -1;
+	if (getlong(data + 4 + len) != image_crc32(0, data, 4 + len))
+		return -1;
+	return data[0];
+}
+
+static const struct {
+	unsigned char code;
+	const char *msg;
+} err_messages[] = {
+	{0x01, "unknown command"},
+	{0x02, "address error"},
+	{0x03, "length error"},
+	{0x04, "bitrate error"},
+	{0x05, "decompress error"},
+	{0x10, "erase error"},
+	{0x11, "programming error"},
+};
+
+/* print error code */
+static void err_report(int r, unsigned char *res)
+{
+	int i;
+
+	if (r < 0 || !(r & 0x80) || r == (NAK | 0x80)) {
+		fputs(" (no answer)\n", stderr);
+		return;
+	}
+	for (i = 0; i < sizeof(err_messages) / sizeof(err_messages[0]); i++)
+		if (err_messages[i].code == res[4]) {
+			fprintf(stderr, " (%s)\n", err_messages[i].msg);
+			return;
+		}
+	fprintf(stderr, " (error %02x)\n", res[4]);
+}
+
+/* wait before retry and discard rest of broken frame */
+static void retry_wait(struct port_t *p, int count)
+{
+	p->stats.retries++;
+	progress_retry(p);
+	port_sleep(p, RETRY_WAIT << count);
+	if (p->flush)
+		p->flush(p);
+}
+
+/* send single frame and receive answer. */
+static int transfer(struct stub_t *st, struct port_t *p, unsigned char cmd,
+		    const unsigned char *data, int len,
+		    unsigned char *res, int size)
+{
+	unsigned char buf[FRAME_OVERHEAD + 16];
+	unsigned char s = st->seq++;
+	int count;
+	int r;
+
+	build(buf, cmd, s, data, len);
+	for (count = 0;; count++) {
+		/* port error is not recoverable */
+		if (p->send_data(p, buf, len + FRAME_OVERHEAD) < 0)
+			return -1;
+		p->stats.frames++;
+		r = receive(p, res, size);
+		if (r < 0)
+			p->stats.errors++;
+		else if (r == NAK)
+			p->stats.naks++;
+		else if (res[1] == s)
+			return r;
+		else
+			/* stale answer */
+			p->stats.errors++;
+		if (count >= RETRY_COUNT)
+			return -1;
+		VERBOSE_PRINT("retry command %c\n", cmd);
+		retry_wait(p, count);
+	}
+}
+
+/* download stub with boot mode */
+static int download(struct stub_t *st, struct port_t *p)
+{
+	unsigned char *prog = NULL;
+	unsigned char c, echo;
+	struct stat sb;
+	unsigned int i;
+	int fd;
+
+	fd = open(st->file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		goto error_perror;
+	if (sb.st_size == 0 || sb.st_size > 0xffff) {
+		fprintf(stderr, PROGNAME ": %s illegal stub size\n", st->file);
+		goto error;
+	}
+	prog = malloc(sb.st_size + 2);
+	if (prog == NULL)
+		goto error_perror;
+	setword(prog, sb.st_size);
+	if (read(fd, prog + 2, sb.st_size) != sb.st_size)
+		goto error_perror;
+
+	printf("Download stub %s", st->file);
+	fflush(stdout);
+	for (i = 0; i < sb.st_size + 2; i++) {
+		c = prog[i];
+		if (p->send_data(p, &c, 1) != 1 ||
+		    p->receive_byte(p, &echo) != 1 || echo != c) {
+			fprintf(stderr, "\n" PROGNAME ": stub download failed"
+				" at %d\n", i);
+			goto error;
+		}
+		if (!verbose && (i % 1024) == 0) {
+			putchar('.');
+			fflush(stdout);
+		}
+	}
+	putchar('\n');
+	if (p->receive_byte(p, &c) != 1 || c != BOOT_ACK) {
+		fputs(PROGNAME ": stub start failed\n", stderr);
+		goto error;
+	}
+	close(fd);
+	free(prog);
+	st->loaded = 1;
+	return 0;
+ error_perror:
+	perror(PROGNAME);
+ error:
+	if (fd >= 0)
+		close(fd);
+	free(prog);
+	return -1;
+}
+
+/* get stub information */
+static int get_info(struct stub_t *st, struct port_t *p, enum mat_t mat, unsigned char *res,
+		    int size)
+{
+	unsigned char m = (mat == user) ? 0 : 1;
+	int r;
+
+	r = transfer(st, p, STUB_INFO, &m, 1, res, size);
+	if (r != STUB_INFO || getword(res + 2) < 21)
+		return -1;
+	st->window = res[5] < STUB_WINDOW ? res[5] : STUB_WINDOW;
+	if (st->window == 0)
+		st->window = 1;
+	st->maxdata = getword(res + 6) < STUB_MAXDATA ?
+		getword(res + 6) : STUB_MAXDATA;
+	memcpy(st->device_id, res + 8, 16);
+	st->device_id[16] = '\0';
+	return 0;
+}
+
+/* get target rom mapping */
+static struct arealist_t *get_arealist(struct comm_t *com, struct port_t *p,
+				       enum mat_t mat)
+{
+	struct stub_t *st = STUB(com);
+	unsigned char res[FRAME_OVERHEAD + 21 + MAX_REGIONS * 12];
+	struct arealist_t *arealist;
+	unsigned char *region;
+	unsigned int addr, end, bs;
+	int regions;
+	int numarea;
+	int i;
+
+	if (get_info(st, p, mat, res, sizeof(res)) < 0)
+		return NULL;
+	regions = res[24];
+	if (getword(res + 2) < 21 + regions * 12)
+		return NULL;
+	/* one area per erase block */
+	for (numarea = 0, i = 0; i < regions; i++) {
+		region = res + 25 + i * 12;
+		bs = getlong(region + 8);
+		if (bs == 0 || bs > 0x100000)
+			return NULL;
+		numarea += (getlong(region + 4) - getlong(region) + 1) / bs;
+	}
+	arealist = (struct arealist_t *)calloc(1, sizeof(struct arealist_t) +
+					       sizeof(struct area_t) * numarea);
+	if (arealist == NULL)
+		return NULL;
+	arealist->journal = NULL;
+	arealist->areas = numarea;
+	for (numarea = 0, i = 0; i < regions; i++) {
+		region = res + 25 + i * 12;
+		end = getlong(region + 4);
+		bs = getlong(region + 8);
+		for (addr = getlong(region); addr < end; addr += bs) {
+			arealist->area[numarea].start = addr;
+			arealist->area[numarea].end = addr + bs - 1;
+			arealist->area[numarea].size = bs;
+			if (!(arealist->area[numarea].image = malloc(bs)))
+				return NULL;
+			memset(arealist->area[numarea].image, 0xff, bs);
+			numarea++;
+		}
+	}
+	return arealist;
+}
+
+/* write frame generator state */
+struct writer_t {
+	struct arealist_t *arealist;
+	int maxdata;
+	int area;
+	unsigned int off;
+	unsigned int last;
+	int erased;
+};
+
+/* build next erase / write frame. return 0 when no more frame */
+static int next_frame(struct writer_t *w, struct frame_t *f, unsigned char s)
+{
+	unsigned char buf[WRITE_HEAD + STUB_MAXDATA];
+	struct area_t *area;
+	unsigned int n;
+	int len;
+
+	for (; w->area < w->arealist->areas; w->area++, w->off = 0, w->erased = 0) {
+		area = &w->arealist->area[w->area];
+		if (!w->erased) {
+			if (image_blank(area_image(area, 0), area->size) ||
+			    journal_done(w->arealist->journal, area->start))
+				continue;
+			/* last non blank chunk */
+			for (w->last = (area->size - 1) / w->maxdata * w->maxdata;
+			     w->last > 0; w->last -= w->maxdata) {
+				n = area->size - w->last < w->maxdata ?
+					area->size - w->last : w->maxdata;
+				if (!image_blank(area_image(area, w->last), n))
+					break;
+			}
+			setlong(buf, area->start);
+			f->len = build(f->buf, STUB_ERASE, s, buf, 4);
+			f->unit = area->start;
+			f->last = 0;
+			f->size = 0;
+			f->raw = 0;
+			w->erased = 1;
+			return 1;
+		}
+		for (; w->off <= w->last; w->off += w->maxdata) {
+			n = area->size - w->off < w->maxdata ?
+				area->size - w->off : w->maxdata;
+			if (image_blank(area_image(area, w->off), n))
+				continue;
+			setlong(buf, area->start + w->off);
+			setword(buf + 4, n);
+			len = lz_compress(area_image(area, w->off), n,
+					  buf + WRITE_HEAD, n - 1);
+			if (len < 0) {
+				buf[6] = METHOD_RAW;
+				memcpy(buf + WRITE_HEAD, area_image(area, w->off), n);
+				len = n;
+			} else
+				buf[6] = METHOD_LZ;
+			f->len = build(f->buf, STUB_WRITE, s, buf, WRITE_HEAD + len);
+			f->unit = area->start;
+			f->last = (w->off == w->last);
+			f->size = f->last ? area->size : 0;
+			f->raw = n;
+			w->off += w->maxdata;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* write rom image */
+static int write_rom(struct comm_t *com, struct port_t *port,
+		     struct arealist_t *arealist, enum mat_t mat)
+{
+	struct stub_t *st = STUB(com);
+	struct writer_t w = {.arealist = arealist, .maxdata = st->maxdata};
+	struct frame_t *ring = st->ring;
+	int window = st->window;
+	unsigned char res[FRAME_OVERHEAD + 16];
+	unsigned int base, next, built, total, d;
+	unsigned int raw = 0, wire = 0;
+	unsigned char seq0 = st->seq;
+	struct frame_t *f;
+	int done = 0;
+	int count = 0;
+	int i, r;
+
+	/* bytes to write */
+	for (total = 0, i = 0; i < arealist->areas; i++)
+		if (!image_blank(area_image(&arealist->area[i], 0),
+				 arealist->area[i].size) &&
+		    !journal_done(arealist->journal, arealist->area[i].start))
+			total += arealist->area[i].size;
+	progress_start(port, "writing", total);
+
+	for (base = next = built = 0;;) {
+		/* fill window */
+		while (next - base < window) {
+			f = &ring[next % window];
+			if (next == built) {
+				if (done || !next_frame(&w, f,
+							seq0 + built)) {
+					done = 1;
+					break;
+				}
+				built++;
+				raw += f->raw;
+				wire += f->len;
+			}
+			if (port->send_data(port, f->buf, f->len) < 0) {
+				fputs(PROGNAME ": port write failed\n", stderr);
+				return -1;
+			}
+			port->stats.frames++;
+			next++;
+		}
+		if (done && base == built)
+			break;
+
+		r = receive(port, res, sizeof(res));
+		d = (res[1] - (unsigned char)(seq0 + base)) & 0xff;
+		if (r < 0) {
+			port->stats.errors++;
+			d = 0;
+		} else if (d >= next - base) {
+			/* stale answer */
+			continue;
+		} else if (r & 0x80) {
+			f = &ring[(base + d) % window];
+			fprintf(stderr, PROGNAME ": %s %08x failed",
+				f->buf[0] == STUB_ERASE ? "erase" : "write",
+				getlong(f->buf + 4));
+			err_report(r, res);
+			return -1;
+		} else if (r != NAK)
+			/* answer is cumulative */
+			d++;
+		else
+			port->stats.naks++;
+
+		if (d > 0)
+			count = 0;
+		for (; d > 0; d--, base++) {
+			f = &ring[base % window];
+			if (!f->last)
+				continue;
+			journal_ack(arealist->journal, f->unit);
+			if (verbose)
+				printf("write - %08x\n", f->unit);
+			progress_step(port, f->unit, f->size);
+		}
+		if (r < 0 || r == NAK) {
+			/* go back to first unacked frame */
+			if (count >= RETRY_COUNT) {
+				fprintf(stderr, PROGNAME ": write failed");
+				err_report(r, res);
+				return -1;
+			}
+			VERBOSE_PRINT("resend from %08x\n",
+				      getlong(ring[base % window].buf + 4));
+			retry_wait(port, count++);
+			next = base;
+		}
+	}
+	st->seq = seq0 + built;
+	progress_end(port);
+	VERBOSE_PRINT("%u byte sent for %u byte data\n", wire, raw);
+	return 0;
+}
+
+/* read rom data */
+static int read_rom(struct comm_t *com, struct port_t *port, enum mat_t mat,
+		    unsigned int addr, unsigned int size, unsigned char *buf)
+{
+	struct stub_t *st = STUB(com);
+	unsigned char *res = st->res;
+	unsigned char cmd[6];
+	unsigned int pos, n;
+	int r;
+
+	for (pos = 0; pos < size; pos += n) {
+		n = size - pos < st->maxdata ? size - pos : st->maxdata;
+		setlong(cmd, addr + pos);
+		setword(cmd + 4, n);
+		r = transfer(st, port, STUB_READ, cmd, sizeof(cmd),
+			     res, sizeof(st->res));
+		if (r != STUB_READ || getword(res + 2) != n) {
+			fprintf(stderr, PROGNAME ": read %08x failed",
+				addr + pos);
+			err_report(r, res);
+			return -1;
+		}
+		memcpy(buf + pos, res + 4, n);
+		if (verbose)
+			printf("read - %08x\n", addr + pos);
+		progress_step(port, addr + pos, n);
+	}
+	return 0;
+}
+
+/* compare target CRC with image per written range */
+static int verify_rom(struct comm_t *com, struct port_t *port,
+		      struct arealist_t *arealist, enum mat_t mat)
+{
+	struct stub_t *st = STUB(com);
+	unsigned char cmd[8];
+	unsigned char res[FRAME_OVERHEAD + 16];
+	struct area_t *area;
+	unsigned int start, end, crc, target;
+	int i, r = 0;
+
+	for (i = 0; i < arealist->areas; i++) {
+		area = &arealist->area[i];
+		if (image_blank(area_image(area, 0), area->size) ||
+		    (arealist->journal &&
+		     !journal_done(arealist->journal, area->start)))
+			continue;
+		/* join continuous written blocks */
+		start = area->start;
+		crc = area_crc(area);
+		for (; i < arealist->areas - 1; i++) {
+			area = &arealist->area[i + 1];
+			if (area->start != arealist->area[i].end + 1 ||
+			    image_blank(area_image(area, 0), area->size) ||
+			    (arealist->journal &&
+			     !journal_done(arealist->journal, area->start)))
+				break;
+			crc = image_crc32_combine(crc, area_crc(area),
+						  area->size);
+		}
+		end = arealist->area[i].end;
+
+		setlong(cmd, start);
+		setlong(cmd + 4, end);
+		if (transfer(st, port, STUB_CRC, cmd, sizeof(cmd),
+			     res, sizeof(res)) != STUB_CRC) {
+			fprintf(stderr, PROGNAME ": CRC check %08x - %08x failed\n",
+				start, end);
+			return -1;
+		}
+		target = getlong(res + 4);
+		if (target != crc) {
+			fprintf(stderr, PROGNAME ": verify %08x - %08x failed "
+				"(target %08x / image %08x)\n",
+				start, end, target, crc);
+			r = -1;
+		} else
+			VERBOSE_PRINT("%08x - %08x crc %08x\n", start, end, crc);
+	}
+	return r;
+}
+
+/* bitrate candidate list */
+static const int rate_list[] = {921600, 460800, 230400, 115200};
+
+/* bitrate error margine (%) */
+#define ERR_MARGIN 3
+
+/* change stub bitrate. keep boot bitrate when failed */
+static int change_bitrate(struct stub_t *st, struct port_t *p, int freq)
+{
+	unsigned char cmd[8];
+	unsigned char res[FRAME_OVERHEAD + 16];
+	int brr, errorrate;
+	int i;
+
+	if (p->setbaud == NULL)
+		return 0;
+	for (i = 0; i < sizeof(rate_list) / sizeof(int); i++) {
+		brr = (freq + 16 * rate_list[i]) / (32 * rate_list[i]) - 1;
+		if (brr < 0)
+			continue;
+		errorrate = abs((int)((long long)freq * 100 /
+				      ((long long)(brr + 1) * rate_list[i] * 32)) - 100);
+		if (errorrate > ERR_MARGIN)
+			continue;
+		setlong(cmd, rate_list[i]);
+		setlong(cmd + 4, freq);
+		if (transfer(st, p, STUB_BITRATE, cmd, sizeof(cmd),
+			     res, sizeof(res)) != STUB_BITRATE)
+			continue;
+		if (!p->setbaud(p, rate_list[i] / 100))
+			break;
+		port_sleep(p, p->settle);
+		if (transfer(st, p, STUB_SYNC, NULL, 0, res, sizeof(res)) == STUB_SYNC) {
+			VERBOSE_PRINT("bitrate %d bps\n", rate_list[i]);
+			return 0;
+		}
+		/* wait stub fallback */
+		p->setbaud(p, 96);
+		port_sleep(p, REVERT_WAIT);
+		if (p->flush)
+			p->flush(p);
+	}
+	VERBOSE_PRINT("bitrate 9600 bps\n");
+	return 0;
+}
+
+/* download stub and start */
+static int start_stub(struct stub_t *st, struct port_t *p)
+{
+	unsigned char res[FRAME_OVERHEAD + 16];
+
+	if (!st->loaded && download(st, p) < 0)
+		return -1;
+	if (transfer(st, p, STUB_SYNC, NULL, 0, res, sizeof(res)) != STUB_SYNC) {
+		fputs(PROGNAME ": stub no answer\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+/* connect to target chip */
+static int setup_connection(struct comm_t *com, struct port_t *p,
+			    int input_freq, char endian)
+{
+	struct stub_t *st = STUB(com);
+	unsigned char res[FRAME_OVERHEAD + 21 + MAX_REGIONS * 12];
+
+	prof_phase(p, "setup.download");
+	if (start_stub(st, p) < 0)
+		return -1;
+	prof_phase(p, "setup.info");
+	if (get_info(st, p, user, res, sizeof(res)) < 0) {
+		fputs("stub info failed\n", stderr);
+		return -1;
+	}
+	VERBOSE_PRINT("stub version %d, window %d, %d byte/frame\n",
+		      res[4], st->window, st->maxdata);
+	prof_phase(p, "bitrate");
+	return change_bitrate(st, p, input_freq * 10000);
+}
+
+static void dump_configs(struct comm_t *com, struct port_t *p)
+{
+	struct stub_t *st = STUB(com);
+	unsigned char res[FRAME_OVERHEAD + 21 + MAX_REGIONS * 12];
+
+	if (start_stub(st, p) < 0 ||
+	    get_info(st, p, user, res, sizeof(res)) < 0) {
+		fputs("stub info failed\n", stderr);
+		return;
+	}
+	printf("stub version: %d\n", res[4]);
+	printf("device: %s\n", st->device_id);
+	printf("window: %d frames\n", res[5]);
+	printf("frame size: %d byte\n", getword(res + 6));
+}
+
+static int keepalive(struct comm_t *com, struct port_t *port)
+{
+	unsigned char res[FRAME_OVERHEAD + 16];
+
+	return transfer(STUB(com), port, STUB_SYNC, NULL, 0,
+			res, sizeof(res)) == STUB_SYNC ? 0 : -1;
+}
+
+static const char *target_id(struct comm_t *com)
+{
+	return STUB(com)->device_id;
+}
+
+/* write_rom traffic with same frames (compressed) as write_rom */
+static void plan_rom(struct comm_t *com, struct arealist_t *arealist,
+		     struct wire_t *w)
+{
+	struct stub_t *st = STUB(com);
+	struct writer_t wr = {.arealist = arealist};
+	struct frame_t f;
+	unsigned long frames = 0;
+
+	w->window = st->window ? st->window : w->window;
+	w->maxdata = st->maxdata ? st->maxdata : w->maxdata;
+	if (w->maxdata > STUB_MAXDATA)
+		w->maxdata = STUB_MAXDATA;
+	if (w->window <= 0 || w->maxdata <= 0)
+		return;
+	wr.maxdata = w->maxdata;
+	while (next_frame(&wr, &f, 0)) {
+		w->tx_bytes += f.len;
+		w->rx_bytes += FRAME_OVERHEAD;
+		w->frames++;
+		frames++;
+		if (f.buf[0] == STUB_ERASE)
+			w->erase++;
+		w->units += f.last;
+		w->payload += f.raw;
+	}
+	/* answers of window are waited once */
+	w->waits += (frames + w->window - 1) / w->window;
+}
+
+static void comm_close(struct comm_t *com)
+{
+	free(com);
+}
+
+static const struct comm_t stub = {
+	.name = "stub",
+	.get_arealist = get_arealist,
+	.write_rom = write_rom,
+	.setup_connection = setup_connection,
+	.dump_configs = dump_configs,
+	.verify_rom = verify_rom,
+	.read_rom = read_rom,
+	.target_id = target_id,
+	.keepalive = keepalive,
+	.plan_rom = plan_rom,
+	.close = comm_close,
+	.block_erase = 1,
+};
+
+struct comm_t *comm_stub(const char *fn)
+{
+	struct stub_t *com;
+
+	com = calloc(1, sizeof(struct stub_t));
+	if (com == NULL)
+		return NULL;
+	com->comm = stub;
+	com->file = fn;
+	return &com->comm;
+}
@@ -0,0 +1,193 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  protocol trace recorder
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * send_data / receive_byte / setbaud of port are wrapped and all
+ * bytes are recorded with monotonic clock (ns from trace start).
+ * continuous send (or receive) bytes are one record, so one record is
+ * one frame (or window of frames) in each direction. phase changes
+ * (prof_phase) and selected protocol are recorded as mark.
+ *
+ * file: TRACE_MAGIC(8) port name(56)
+ *       {struct trace_rec, data[len]} ...  (host byte order)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "h8flash.h"
+
+struct trace_t {
+	FILE *fp;
+	long long origin;
+	/* wrapped port operations */
+	int (*send_data)(struct port_t *p, const unsigned char *data, int len);
+	int (*receive_byte)(struct port_t *p, unsigned char *data);
+	int (*setbaud)(struct port_t *p, int bitrate);
+	/* pending record */
+	struct trace_rec rec;
+	unsigned char buf[TRACE_BUF];
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_rec(struct trace_t *t)
+{
+	if (t->rec.type == 0)
+		return;
+	fwrite(&t->rec, sizeof(t->rec), 1, t->fp);
+	fwrite(t->buf, 1, t->rec.len, t->fp);
+	t->rec.type = 0;
+}
+
+/* add data to pending record. start / end: ns */
+static void put(struct trace_t *t, unsigned char type,
+		const unsigned char *data, int len, long long start,
+		long long end)
+{
+	int n;
+
+	/* frame is not split if possible */
+	if (t->rec.type == type && t->rec.len + len > TRACE_BUF)
+		write_rec(t);
+	while (len > 0) {
+		if (t->rec.type != type || t->rec.len >= TRACE_BUF) {
+			write_rec(t);
+			t->rec.type = type;
+			t->rec.len = 0;
+			t->rec.t0 = start - t->origin;
+			/* rest of long frame */
+			start = end;
+		}
+		n = (len < TRACE_BUF - t->rec.len) ?
+			len : TRACE_BUF - t->rec.len;
+		memcpy(t->buf + t->rec.len, data, n);
+		t->rec.len += n;
+		t->rec.t1 = end - t->origin;
+		data += n;
+		len -= n;
+	}
+}
+
+static int trace_send(struct port_t *p, const unsigned char *data, int len)
+{
+	struct trace_t *t = p->trace;
+	long long start = now_ns();
+	int r;
+
+	r = t->send_data(p, data, len);
+	if (r > 0)
+		put(t, TRACE_TX, data, r, start, now_ns());
+	return r;
+}
+
+static int trace_receive(struct port_t *p, unsigned char *data)
+{
+	struct trace_t *t = p->trace;
+	long long now;
+	int r;
+
+	r = t->receive_byte(p, data);
+	if (r == 1) {
+		now = now_ns();
+		put(t, TRACE_RX, data, 1, now, now);
+	}
+	return r;
+}
+
+/* one record of data */
+static void mark(struct trace_t *t, unsigned char type,
+		 const void *data, int len)
+{
+	write_rec(t);
+	t->rec.type = type;
+	t->rec.len = len;
+	t->rec.t0 = t->rec.t1 = now_ns() - t->origin;
+	memcpy(t->buf, data, len);
+	write_rec(t);
+}
+
+static int trace_setbaud(struct port_t *p, int bitrate)
+{
+	int r;
+
+	r = p->trace->setbaud(p, bitrate);
+	if (r)
+		mark(p->trace, TRACE_BITRATE, &p->bitrate, sizeof(p->bitrate));
+	return r;
+}
+
+/* record phase / protocol name */
+void trace_mark(struct port_t *p, unsigned char type, const char *text)
+{
+	if (p->trace)
+		mark(p->trace, type, text, strnlen(text, TRACE_BUF));
+}
+
+int trace_open(struct port_t *p, const char *fn)
+{
+	struct trace_t *t;
+	char head[64];
+
+	if (p->trace)
+		return -1;
+	t = calloc(1, sizeof(struct trace_t));
+	if (t == NULL)
+		return -1;
+	t->fp = fopen(fn, "w");
+	if (t->fp == NULL) {
+		perror(fn);
+		free(t);
+		return -1;
+	}
+	memset(head, 0, sizeof(head));
+	memcpy(head, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	strncpy(head + 8, p->dev, sizeof(head) - 9);
+	fwrite(head, sizeof(head), 1, t->fp);
+	t->origin = now_ns();
+	t->send_data = p->send_data;
+	t->receive_byte = p->receive_byte;
+	t->setbaud = p->setbaud;
+	p->send_data = trace_send;
+	p->receive_byte = trace_receive;
+	if (p->setbaud)
+		p->setbaud = trace_setbaud;
+	p->trace = t;
+	mark(t, TRACE_BITRATE, &p->bitrate, sizeof(p->bitrate));
+	return 0;
+}
+
+int trace_close(struct port_t *p)
+{
+	struct trace_t *t = p->trace;
+	int r;
+
+	if (t == NULL)
+		return 0;
+	write_rec(t);
+	r = fclose(t->fp);
+	p->send_data = t->send_data;
+	p->receive_byte = t->receive_byte;
+	p->setbaud = t->setbaud;
+	p->trace = NULL;
+	free(t);
+	return r ? -1 : 0;
+}
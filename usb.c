@@ -13,14 +13,463 @@
 #endif
 
 #include <stdio.h>
-#ifdef HAVE_USB_H
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(HAVE_LIBUSB1) && defined(HAVE_LIBUSB_1_0_LIBUSB_H)
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+#include "h8flash.h"
+
+/*
+ * libusb-1.0 asynchronous transport.
+ * USB_INFLIGHT bulk IN transfers are always submitted, received data
+ * is taken in submit order and transfer is submitted again.
+ * send data is queued and sent by one bulk OUT transfer when waiting
+ * answer. each port has own libusb context, pollfds of context are
+ * gathered in one epoll fd (port fd), gang event loop waits it with
+ * serial fds.
+ */
+
+#define EP_OUT 0x01
+#define EP_IN  0x82
+/* receive timeout (ms) */
+#define USB_TIMEOUT 10000
+/* connect_target answer wait (ms) */
+#define CONNECT_WAIT 100
+#define CONNECT_COUNT 100
+#define USB_INFLIGHT 4
+#define USB_BUFSIZE 4096
+
+struct usb_xfer_t {
+	struct libusb_transfer *xfer;
+	unsigned char buf[USB_BUFSIZE];
+	int done;
+};
+
+struct usb_port_t {
+	struct port_t port;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int interface;
+	/* max packet size of IN endpoint */
+	int packet;
+	char target[32];
+	/* receive queue */
+	struct usb_xfer_t rx[USB_INFLIGHT];
+	int head;
+	int rxpos;
+	/* send */
+	struct usb_xfer_t tx;
+	int txlen;
+	int txbusy;
+};
+
+#define USB(p) ((struct usb_port_t *)(p))
+
+static void LIBUSB_CALL xfer_done(struct libusb_transfer *xfer)
+{
+	struct usb_xfer_t *x = xfer->user_data;
+
+	x->done = 1;
+}
+
+static void LIBUSB_CALL pollfd_added(int fd, short events, void *arg)
+{
+	struct epoll_event ev;
+
+	ev.events = 0;
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl(USB(arg)->port.fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void LIBUSB_CALL pollfd_removed(int fd, void *arg)
+{
+	epoll_ctl(USB(arg)->port.fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* run libusb events until *done or timeout (ms) */
+static int handle_events(struct port_t *p, int *done, int timeout)
+{
+	struct usb_port_t *up = USB(p);
+	struct timeval tv = {0, 0};
+	struct timeval start, now;
+	int left;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		/* pending events first, wait only when nothing to do */
+		p->stats.syscalls++;
+		if (libusb_handle_events_timeout_completed(up->ctx, &tv,
+							   done) < 0)
+			return -1;
+		if (*done)
+			return 1;
+		gettimeofday(&now, NULL);
+		left = timeout - ((now.tv_sec - start.tv_sec) * 1000 +
+				  (now.tv_usec - start.tv_usec) / 1000);
+		if (left < 0)
+			return 0;
+		if (p->wait) {
+			/* event loop of caller (gang) */
+			if (p->wait(p, left, WAIT_RX) < 0)
+				return -1;
+			tv.tv_sec = tv.tv_usec = 0;
+		} else {
+			tv.tv_sec = left / 1000;
+			tv.tv_usec = (left % 1000) * 1000;
+		}
+	}
+}
+
+static int submit(struct port_t *p, struct usb_xfer_t *x)
+{
+	x->done = 0;
+	p->stats.syscalls++;
+	if (libusb_submit_transfer(x->xfer) < 0) {
+		p->stats.errors++;
+		return -1;
+	}
+	return 0;
+}
+
+/* send queued data */
+static int tx_flush(struct port_t *p)
+{
+	struct usb_port_t *up = USB(p);
+	struct libusb_transfer *xfer = up->tx.xfer;
+
+	if (up->txlen == 0)
+		return 0;
+	xfer->length = up->txlen;
+	p->stats.tx_bytes += up->txlen;
+	up->txlen = 0;
+	if (submit(p, &up->tx) < 0)
+		return -1;
+	if (handle_events(p, &up->tx.done, USB_TIMEOUT) < 1) {
+		libusb_cancel_transfer(xfer);
+		handle_events(p, &up->tx.done, USB_TIMEOUT);
+		return -1;
+	}
+	return (xfer->status == LIBUSB_TRANSFER_COMPLETED) ? 0 : -1;
+}
+
+/* send byte stream */
+static int send_data(struct port_t *p, const unsigned char *buf, int len)
+{
+	struct usb_port_t *up = USB(p);
+	int n, sent;
+
+	for (sent = 0; sent < len; sent += n) {
+		if (up->txlen >= USB_BUFSIZE && tx_flush(p) < 0)
+			return -1;
+		n = len - sent < USB_BUFSIZE - up->txlen ?
+			len - sent : USB_BUFSIZE - up->txlen;
+		memcpy(up->tx.buf + up->txlen, buf + sent, n);
+		up->txlen += n;
+	}
+	return len;
+}
+
+/* wait received data of head transfer. 1: ready 0: timeout -1: error */
+static int wait_rx(struct port_t *p, int timeout)
+{
+	struct usb_port_t *up = USB(p);
+	struct usb_xfer_t *x;
+	struct timeval start, now;
+	int status;
+	int left;
+	int r;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		x = &up->rx[up->head];
+		if (x->done && x->xfer->status == LIBUSB_TRANSFER_COMPLETED &&
+		    up->rxpos < x->xfer->actual_length)
+			return 1;
+		if (x->done) {
+			/* consumed, zero length or failed */
+			status = x->xfer->status;
+			up->rxpos = 0;
+			if (status != LIBUSB_TRANSFER_COMPLETED) {
+				p->stats.errors++;
+				/* halted endpoint */
+				if (status == LIBUSB_TRANSFER_STALL) {
+					p->stats.syscalls++;
+					libusb_clear_halt(up->handle, EP_IN);
+				}
+			}
+			if (submit(p, x) < 0)
+				return -1;
+			up->head = (up->head + 1) % USB_INFLIGHT;
+			/* failed transfer is error of this read */
+			if (status != LIBUSB_TRANSFER_COMPLETED)
+				return -1;
+			continue;
+		}
+		if (tx_flush(p) < 0)
+			return -1;
+		/* one deadline over resubmitted transfers */
+		gettimeofday(&now, NULL);
+		left = timeout - ((now.tv_sec - start.tv_sec) * 1000 +
+				  (now.tv_usec - start.tv_usec) / 1000);
+		if (left < 0)
+			return 0;
+		r = handle_events(p, &x->done, left);
+		if (r < 1)
+			return r;
+	}
+}
+
+/* receive 1byte */
+static int read_byte(struct port_t *p, unsigned char *data)
+{
+	struct usb_port_t *up = USB(p);
+
+	*data = 0;
+	if (wait_rx(p, USB_TIMEOUT) < 1)
+		return -1;
+	*data = up->rx[up->head].buf[up->rxpos++];
+	p->stats.rx_bytes++;
+	return 1;
+}
+
+/* send 0x55 and wait answer. returns answer or 0xff */
+static int boot_answer(struct port_t *p, int count, int quiet)
+{
+	unsigned char req = 0x55;
+	int i, r;
+
+	send_data(p, &req, 1);
+	for (i = 0; i < count; i++) {
+		r = wait_rx(p, CONNECT_WAIT);
+		if (r < 0)
+			break;
+		if (r > 0 && read_byte(p, &req) == 1)
+			return req;
+		if (!quiet) {
+			putchar('.');
+			fflush(stdout);
+		}
+	}
+	return 0xff;
+}
+
+/* connect to target CPU */
+static int connect_target(struct port_t *p)
+{
+	int r;
+
+	printf("now connecting to %s", p->dev);
+	fflush(stdout);
+	r = boot_answer(p, CONNECT_COUNT, 0);
+	putchar('\n');
+	/* old / new protocol */
+	if (r != 0xe6 && r != 0xc1)
+		return 0;
+	else
+		return r;
+}
+
+/* bounded connect (timeout ms) */
+static int probe(struct port_t *p, int timeout)
+{
+	return boot_answer(p, timeout / CONNECT_WAIT > 0 ?
+			   timeout / CONNECT_WAIT : 1, 1);
+}
+
+/* discard received data */
+static void flush(struct port_t *p)
+{
+	struct usb_port_t *up = USB(p);
+	int i;
+
+	up->rxpos = 0;
+	for (i = 0; i < USB_INFLIGHT; i++) {
+		struct usb_xfer_t *x = &up->rx[up->head];
+		if (!x->done)
+			break;
+		submit(p, x);
+		up->head = (up->head + 1) % USB_INFLIGHT;
+	}
+}
+
+static void port_close(struct port_t *p)
+{
+	struct usb_port_t *up = USB(p);
+	int i;
+
+	tx_flush(p);
+	for (i = 0; i < USB_INFLIGHT; i++) {
+		if (up->rx[i].xfer == NULL)
+			continue;
+		if (!up->rx[i].done &&
+		    libusb_cancel_transfer(up->rx[i].xfer) == 0)
+			handle_events(p, &up->rx[i].done, USB_TIMEOUT);
+		libusb_free_transfer(up->rx[i].xfer);
+	}
+	if (up->tx.xfer)
+		libusb_free_transfer(up->tx.xfer);
+	if (up->handle) {
+		libusb_release_interface(up->handle, up->interface);
+		libusb_close(up->handle);
+	}
+	if (up->ctx) {
+		libusb_set_pollfd_notifiers(up->ctx, NULL, NULL, NULL);
+		libusb_exit(up->ctx);
+	}
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p);
+}
+
+static const struct port_t usb_port = {
+	.type = usb,
+	.dev = NULL,
+	.fd = -1,
+	.send_data = send_data,
+	.receive_byte = read_byte,
+	.connect_target = connect_target,
+	.probe = probe,
+	.setbaud = NULL,
+	.flush = flush,
+	.close = port_close,
+	.settle = BITRATE_SETTLE,
+};
+
+/* find device by id and bus / address (-1: any) */
+static libusb_device_handle *find_device(libusb_context *ctx,
+					 unsigned short vid, unsigned short pid,
+					 int bus, int addr, int *interface)
+{
+	libusb_device **list;
+	libusb_device_handle *handle = NULL;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *config;
+	ssize_t n, i;
+	int r;
+
+	n = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < n; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+		    desc.idVendor != vid || desc.idProduct != pid ||
+		    (bus >= 0 && libusb_get_bus_number(list[i]) != bus) ||
+		    (addr >= 0 && libusb_get_device_address(list[i]) != addr))
+			continue;
+		*interface = 0;
+		if (libusb_get_config_descriptor(list[i], 0, &config) == 0) {
+			*interface = config->interface->altsetting->bInterfaceNumber;
+			libusb_free_config_descriptor(config);
+		}
+		r = libusb_open(list[i], &handle);
+		if (r < 0) {
+			fprintf(stderr, PROGNAME ": %s\n", libusb_error_name(r));
+			handle = NULL;
+		}
+		break;
+	}
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return handle;
+}
+
+/* USB port open */
+struct port_t *open_usb(unsigned short vid, unsigned short pid,
+			int bus, int addr)
+{
+	struct usb_port_t *up;
+	const struct libusb_pollfd **fds;
+	int i, r;
+
+	up = calloc(1, sizeof(struct usb_port_t));
+	if (up == NULL)
+		return NULL;
+	up->port = usb_port;
+	up->port.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (up->port.fd < 0 || libusb_init(&up->ctx) < 0) {
+		perror(PROGNAME);
+		goto error;
+	}
+	up->handle = find_device(up->ctx, vid, pid, bus, addr, &up->interface);
+	if (up->handle == NULL) {
+		printf("USB device %04x:%04x not found\n", vid, pid);
+		goto error;
+	}
+	r = libusb_claim_interface(up->handle, up->interface);
+	if (r < 0) {
+		fprintf(stderr, PROGNAME ": %s\n", libusb_error_name(r));
+		libusb_close(up->handle);
+		up->handle = NULL;
+		goto error;
+	}
+	/* all pollfds of context into port fd */
+	fds = libusb_get_pollfds(up->ctx);
+	for (i = 0; fds && fds[i]; i++)
+		pollfd_added(fds[i]->fd, fds[i]->events, up);
+	libusb_free_pollfds(fds);
+	libusb_set_pollfd_notifiers(up->ctx, pollfd_added, pollfd_removed, up);
+
+	/* IN transfer is whole packets (short packet ends transfer) */
+	up->packet = libusb_get_max_packet_size(libusb_get_device(up->handle),
+						EP_IN);
+	if (up->packet <= 0 || up->packet > USB_BUFSIZE)
+		up->packet = 64;
+	up->tx.xfer = libusb_alloc_transfer(0);
+	if (up->tx.xfer == NULL)
+		goto error;
+	libusb_fill_bulk_transfer(up->tx.xfer, up->handle, EP_OUT,
+				  up->tx.buf, 0, xfer_done, &up->tx, 0);
+	/* frame of packet size multiple is terminated by zero length packet */
+	up->tx.xfer->flags = LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	up->tx.done = 1;
+	for (i = 0; i < USB_INFLIGHT; i++) {
+		up->rx[i].done = 1;
+		up->rx[i].xfer = libusb_alloc_transfer(0);
+		if (up->rx[i].xfer == NULL)
+			goto error;
+		libusb_fill_bulk_transfer(up->rx[i].xfer, up->handle, EP_IN,
+					  up->rx[i].buf,
+					  USB_BUFSIZE - USB_BUFSIZE % up->packet,
+					  xfer_done, &up->rx[i], 0);
+		if (submit(&up->port, &up->rx[i]) < 0)
+			goto error;
+	}
+	if (bus >= 0 && addr >= 0)
+		snprintf(up->target, sizeof(up->target), "USB(%04x:%04x@%d:%d)",
+			 vid, pid, bus, addr);
+	else
+		snprintf(up->target, sizeof(up->target), "USB(%04x:%04x)",
+			 vid, pid);
+	up->port.dev = up->target;
+	return &up->port;
+ error:
+	port_close(&up->port);
+	return NULL;
+}
+#elif defined(HAVE_USB_H)
 #include <usb.h>
 #include "h8flash.h"
 
 #define USB_TIMEOUT 100000
 
-static struct usb_dev_handle *handle;
-static char target[32];
+struct usb_port_t {
+	struct port_t port;
+	struct usb_dev_handle *handle;
+	char target[32];
+	/* one packet of IN endpoint */
+	unsigned char rxbuf[512];
+	int packet;
+	unsigned char *rp;
+	int count;
+};
+
+#define USB(p) ((struct usb_port_t *)(p))
 
 /* 
 EP1: bulk out
@@ -28,37 +477,46 @@ EP2: bulk in
 */
 
 /* send byte stream */
-static int send_data(const unsigned char *buf, int len)
+static int send_data(struct port_t *p, const unsigned char *buf, int len)
 {
-	return usb_bulk_write(handle, 0x01, (const char *)buf, len, USB_TIMEOUT);
+	int r;
+
+	r = usb_bulk_write(USB(p)->handle, 0x01, (const char *)buf, len,
+			   USB_TIMEOUT);
+	p->stats.syscalls++;
+	if (r > 0)
+		p->stats.tx_bytes += r;
+	return r;
 }
 
 /* receive 1byte */ 
-static int read_byte(unsigned char *data)
+static int read_byte(struct port_t *p, unsigned char *data)
 {
-	static unsigned char buf[64];
-	static unsigned char *rp;
-	static int count = 0;
+	struct usb_port_t *up = USB(p);
 
-	if (count == 0) {
+	if (up->count == 0) {
 		/* refilling */
-		int r = usb_bulk_read(handle, 0x82, (char *)buf, 64, USB_TIMEOUT);
+		int r = usb_bulk_read(up->handle, 0x82, (char *)up->rxbuf,
+				      up->packet, USB_TIMEOUT);
+		p->stats.syscalls++;
 		if (r < 0)
 			return r;
-		count = r;
-		rp = buf;
+		p->stats.rx_bytes += r;
+		up->count = r;
+		up->rp = up->rxbuf;
 	}
-	count--;
-	*data = *rp++;
+	up->count--;
+	*data = *up->rp++;
 	return 1;
 }
 
 /* connect to target CPU */
-static int connect_target(char *port)
+static int connect_target(struct port_t *p)
 {
+	struct usb_dev_handle *handle = USB(p)->handle;
 	unsigned char req = 0x55;
 	int r;
-	printf("now connecting to %s", port); 
+	printf("now connecting to %s", p->dev); 
 	fflush(stdout);
 	usb_bulk_write(handle, 0x01, (const char *)&req, 1, USB_TIMEOUT);
 	do {
@@ -69,33 +527,47 @@ static int connect_target(char *port)
 			usleep(100000);
 	} while (r == 0);
 	putchar('\n');
-	if (r < 0 || req != 0xe6)
+	if (r < 0 || (req != 0xe6 && req != 0xc1))
 		return 0;
 	else
 		return req;
 }
 
-static void port_close(void)
+/* discard received data */
+static void flush(struct port_t *p)
+{
+	USB(p)->count = 0;
+}
+
+static void port_close(struct port_t *p)
 {
-	usb_close(handle);
+	usb_close(USB(p)->handle);
+	free(p);
 }
 
-static struct port_t usb_port = {
+static const struct port_t usb_port = {
 	.type = usb,
-	.dev = target,
+	.dev = NULL,
+	.fd = -1,
 	.send_data = send_data,
 	.receive_byte = read_byte,
 	.connect_target = connect_target,
 	.setbaud = NULL,
+	.flush = flush,
 	.close = port_close,
+	.settle = BITRATE_SETTLE,
 };
 
 /* USB port open */
-struct port_t *open_usb(unsigned short vid, unsigned short pid)
+struct port_t *open_usb(unsigned short vid, unsigned short pid,
+			int busno, int addr)
 {
 	struct usb_bus *busses;
 	struct usb_bus *bus;
 	struct usb_device *dev = NULL;
+	struct usb_endpoint_descriptor *ep;
+	struct usb_port_t *up;
+	int i;
 	usb_init();
 	usb_get_busses();
 	usb_find_busses();
@@ -106,7 +578,9 @@ struct port_t *open_usb(unsigned short vid, unsigned short pid)
 	for (bus = busses; bus; bus = bus->next) {
 		for (dev = bus->devices; dev; dev = dev->next) {
 			if ((dev->descriptor.idVendor == vid) && 
-			    (dev->descriptor.idProduct == pid)) {
+			    (dev->descriptor.idProduct == pid) &&
+			    (busno < 0 || atoi(bus->dirname) == busno) &&
+			    (addr < 0 || dev->devnum == addr)) {
 				goto found;
 			}
 		}
@@ -117,17 +591,31 @@ found:
 		printf("USB device %04x:%04x not found\n", vid, pid);
 		return NULL;
 	}
-	handle = usb_open(dev);
-	if (handle == NULL) {
+	up = calloc(1, sizeof(struct usb_port_t));
+	if (up == NULL)
+		return NULL;
+	up->port = usb_port;
+	up->handle = usb_open(dev);
+	if (up->handle == NULL) {
 		puts(usb_strerror());
+		free(up);
 		return NULL;
 	}
-	usb_claim_interface(handle, dev->config->interface->altsetting->bInterfaceNumber);
-	snprintf(target, sizeof(target), "USB(%04x:%04x)", vid, pid);
-	return &usb_port;
+	usb_claim_interface(up->handle, dev->config->interface->altsetting->bInterfaceNumber);
+	up->packet = 64;
+	for (i = 0; i < dev->config->interface->altsetting->bNumEndpoints; i++) {
+		ep = &dev->config->interface->altsetting->endpoint[i];
+		if (ep->bEndpointAddress == 0x82 &&
+		    ep->wMaxPacketSize <= sizeof(up->rxbuf))
+			up->packet = ep->wMaxPacketSize;
+	}
+	snprintf(up->target, sizeof(up->target), "USB(%04x:%04x)", vid, pid);
+	up->port.dev = up->target;
+	return &up->port;
 }
 #else
-struct port_t *open_usb(unsigned short vid, unsigned short pid)
+struct port_t *open_usb(unsigned short vid, unsigned short pid,
+			int bus, int addr)
 {
 	return NULL;
 }
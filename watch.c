@@ -0,0 +1,147 @@
+/*
+ *  Renesas CPU On-chip Flash memory writer
+ *  image watch mode
+ *
+ * Yoshinori Sato <ysato@users.sourceforge.jp>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License version 2.1 (or later).
+ */
+
+/*
+ * wait image rebuild (inotify of image directory, build tools often
+ * replace file by rename) and rewrite changed units only.
+ * session keeps last written image, unchanged pages / blocks are skipped.
+ * without --run-seq boot session is held (keepalive while idle),
+ * with --run-seq target runs after each write and is connected again
+ * with --boot-seq on next rebuild.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "h8flash.h"
+#include "libh8flash.h"
+
+#define EVENT_SIZE (16 * (sizeof(struct inotify_event) + FILENAME_MAX))
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* write changed units. returns 1 bad image, -1 session failed */
+static int update(struct h8flash *h, const struct watch_config *w)
+{
+	struct h8flash_plan plan;
+	long long start = now_ms();
+
+	if (h8flash_load(h, w->file, w->binary, w->base) < 0 ||
+	    apply_patch(h, w->patch, w->patch->board) < 0 ||
+	    h8flash_plan(h, NULL, 0, 0, 0, &plan) < 0)
+		return 1;
+	printf("%u units changed (%u unchanged, %u blank)\n",
+	       plan.write, plan.unchanged, plan.blank);
+	if (h8flash_write(h) < 0)
+		return -1;
+	if (w->verify && h8flash_verify(h) < 0)
+		return -1;
+	if (h8flash_release(h) < 0)
+		return -1;
+	printf("written %u byte in %lld ms\n", plan.bytes, now_ms() - start);
+	fflush(stdout);
+	return 0;
+}
+
+/* image file changed in events */
+static int changed(int fd, const char *name)
+{
+	char buf[EVENT_SIZE];
+	struct inotify_event *ev;
+	int len, pos;
+	int r = 0;
+
+	len = read(fd, buf, sizeof(buf));
+	for (pos = 0; pos < len; pos += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)(buf + pos);
+		if (ev->len && strcmp(ev->name, name) == 0)
+			r = 1;
+	}
+	return r;
+}
+
+/* connected session h. returns only error */
+int watch(struct h8flash *h, const struct watch_config *w)
+{
+	struct pollfd pfd;
+	char dir[FILENAME_MAX], base[FILENAME_MAX], name[FILENAME_MAX];
+	int held, n, r;
+
+	snprintf(dir, sizeof(dir), "%s", w->file);
+	snprintf(base, sizeof(base), "%s", w->file);
+	pfd.fd = inotify_init1(IN_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 ||
+	    inotify_add_watch(pfd.fd, dirname(dir),
+			      IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror(w->file);
+		return -1;
+	}
+	/* basename may return pointer into (or modify) its argument */
+	snprintf(name, sizeof(name), "%s", basename(base));
+
+	/* held: boot session is active */
+	held = 1;
+	r = update(h, w);
+	for (;;) {
+		if (r == 0)
+			held = (w->config->run_seq == NULL);
+		else if (r < 0)
+			held = 0;
+		printf("watching %s\n", w->file);
+		fflush(stdout);
+		for (;;) {
+			n = poll(&pfd, 1, held ? WATCH_KEEPALIVE : -1);
+			if (n > 0 && changed(pfd.fd, name))
+				break;
+			/* keep boot session while idle */
+			if (n == 0 && h8flash_keepalive(h) < 0) {
+				puts("target lost");
+				held = 0;
+			}
+		}
+		/* until writing finished */
+		while (poll(&pfd, 1, WATCH_SETTLE) > 0)
+			changed(pfd.fd, name);
+
+		r = -1;
+		if (held)
+			r = update(h, w);
+		/* old protocol writes once per boot session */
+		if (r < 0 && w->config->boot_seq) {
+			puts("Reconnect");
+			if (h8flash_reconnect(h, w->config) == 0)
+				r = update(h, w);
+		}
+		if (r < 0 && w->config->boot_seq == NULL) {
+			fputs(PROGNAME ": target needs reset, use --boot-seq\n",
+			      stderr);
+			break;
+		}
+	}
+	close(pfd.fd);
+	return -1;
+}